@@ -33,6 +33,7 @@
     "amptjp.rep", \
     "bash.rep", \
     "boat.rep",\
+    "calloc.rep", \
     "cccp.rep", \
     "chrome.rep", \
     "coalesce-big.rep",  \
@@ -48,6 +49,7 @@
     "ls.rep", \
     "malloc.rep", \
     "malloc-free.rep", \
+    "memalign.rep", \
     "needle.rep", \
     "nlydf.rep", \
     "perl.rep", \
@@ -107,9 +109,15 @@
 #define ALIGNMENT 8
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes, of each memlib region. Build with
+ * -DBIG_HEAP (make BIG_HEAP=1) for the most mm.c's 32-bit free list
+ * offsets, counted in ALIGNMENT units, can span.
  */
+#ifdef BIG_HEAP
+#define MAX_HEAP ((size_t)32 << 30)  /* 32 GB */
+#else
 #define MAX_HEAP (100*(1<<20))  /* 100 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
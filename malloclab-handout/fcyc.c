@@ -30,6 +30,8 @@ static int compensate = COMPENSATE;
 static int clear_cache = CLEAR_CACHE;
 static int cache_bytes = CACHE_BYTES;
 static int cache_block = CACHE_BLOCK;
+static int counters = 0;
+static perfctr_t best_counts; /* of the sample values[0] came from */
 
 static int *cache_buf = NULL;
 
@@ -123,6 +125,27 @@ static void clear()
     sink = x;
 }
 
+/*
+ * keep_counts - Stop the counters, keep their counts if the sample of
+ *     cyc cycles is the best so far
+ */
+static void keep_counts(double cyc)
+{
+    perfctr_t c;
+
+    perfctr_stop(&c);
+    if (samplecount == 0 || cyc < values[0])
+	best_counts = c;
+}
+
+/*
+ * fcyc_counts - The event counts of the sample behind the last result
+ */
+void fcyc_counts(perfctr_t *c)
+{
+    *c = best_counts;
+}
+
 /*
  * fcyc - Use K-best scheme to estimate the running time of function f
  */
@@ -135,9 +158,13 @@ double fcyc(test_funct f, void *argp)
 	    double cyc;
 	    if (clear_cache)
 		clear();
+	    if (counters)
+		perfctr_start();
 	    start_comp_counter();
 	    f(argp);
 	    cyc = get_comp_counter();
+	    if (counters)
+		keep_counts(cyc);
 	    add_sample(cyc);
 	} while (!has_converged() && samplecount < maxsamples);
     } else {
@@ -145,9 +172,13 @@ double fcyc(test_funct f, void *argp)
 	    double cyc;
 	    if (clear_cache)
 		clear();
+	    if (counters)
+		perfctr_start();
 	    start_counter();
 	    f(argp);
 	    cyc = get_counter();
+	    if (counters)
+		keep_counts(cyc);
 	    add_sample(cyc);
 	} while (!has_converged() && samplecount < maxsamples);
     }
@@ -245,6 +276,16 @@ void set_fcyc_epsilon(double epsilon_arg)
     epsilon = epsilon_arg;
 }
 
+/* 
+ * set_fcyc_counters - When set, will count the perfctr.h events
+ *     around each sample, perfctr_open having been called
+ *     Default = 0
+ */
+void set_fcyc_counters(int counters_arg)
+{
+    counters = counters_arg;
+}
+
 
 
 
@@ -7,12 +7,18 @@
  *
  */
 
+#include "perfctr.h"
+
 /* The test function takes a generic pointer as input */
 typedef void (*test_funct)(void *);
 
 /* Compute number of cycles used by test function f */
 double fcyc(test_funct f, void* argp);
 
+/* The event counts of the sample behind the last fcyc result, if
+   set_fcyc_counters is on */
+void fcyc_counts(perfctr_t *c);
+
 /*********************************************************
  * Set the various parameters used by measurement routines 
  *********************************************************/
@@ -63,6 +69,13 @@ void set_fcyc_maxsamples(int maxsamples_arg);
  */
 void set_fcyc_epsilon(double epsilon_arg);
 
+/* 
+ * set_fcyc_counters - When set, will count the perfctr.h events
+ *     around each sample, perfctr_open having been called
+ *     Default = 0
+ */
+void set_fcyc_counters(int counters_arg);
+
 
 
 
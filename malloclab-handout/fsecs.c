@@ -39,6 +39,31 @@ void init_fsecs(void)
 #endif
 }
 
+/*
+ * init_fsecs_counters - count events around every timed run, if the
+ * machine has any to count
+ */
+int init_fsecs_counters(void)
+{
+    int n = perfctr_open();
+
+    set_fcyc_counters(n > 0);
+    set_ftimer_counters(n > 0);
+    return n;
+}
+
+/*
+ * fsecs_counts - the event counts behind the last fsecs result
+ */
+void fsecs_counts(perfctr_t *c)
+{
+#if USE_FCYC
+    fcyc_counts(c);
+#else
+    ftimer_counts(c);
+#endif
+}
+
 /*
  * fsecs - Return the running time of a function f (in seconds)
  */
@@ -1,4 +1,14 @@
+#include "perfctr.h"
+
 typedef void (*fsecs_test_funct)(void *);
 
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+
+/* Count the perfctr.h events in every fsecs from now on, return how
+   many of them the machine gives us */
+int init_fsecs_counters(void);
+
+/* The counts of one run of the last fsecs: its fastest sample under
+   fcyc, the average run under the timers */
+void fsecs_counts(perfctr_t *c);
@@ -16,6 +16,10 @@
 static void init_etime(void);
 static double get_etime(void);
 
+static int counters = 0;
+static perfctr_t counts; /* of the last timing, over all its runs */
+static int runs = 1;
+
 /* 
  * ftimer_itimer - Use the interval timer to estimate the running time
  * of f(argp). Return the average of n runs.  
@@ -25,11 +29,16 @@ double ftimer_itimer(ftimer_test_funct f, void *argp, int n)
     double start, tmeas;
     int i;
 
+    if (counters)
+	perfctr_start();
     init_etime();
     start = get_etime();
     for (i = 0; i < n; i++) 
 	f(argp);
     tmeas = get_etime() - start;
+    if (counters)
+	perfctr_stop(&counts);
+    runs = n;
     return tmeas / n;
 }
 
@@ -43,16 +52,40 @@ double ftimer_gettod(ftimer_test_funct f, void *argp, int n)
     struct timeval stv, etv;
     double diff;
 
+    if (counters)
+	perfctr_start();
     gettimeofday(&stv, NULL);
     for (i = 0; i < n; i++) 
 	f(argp);
     gettimeofday(&etv,NULL);
+    if (counters)
+	perfctr_stop(&counts);
+    runs = n;
     diff = 1E3*(etv.tv_sec - stv.tv_sec) + 1E-3*(etv.tv_usec-stv.tv_usec);
     diff /= n;
     return (1E-3*diff);
 }
 
 
+/*
+ * set_ftimer_counters - count the perfctr.h events over the runs
+ */
+void set_ftimer_counters(int on)
+{
+    counters = on;
+}
+
+/*
+ * ftimer_counts - the counts of the last timing divided by its runs
+ */
+void ftimer_counts(perfctr_t *c)
+{
+    int i;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++)
+	c->count[i] = counts.count[i] < 0 ? -1 : counts.count[i] / runs;
+}
+
 /*
  * Routines for manipulating the Unix interval timer
  */
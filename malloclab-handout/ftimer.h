@@ -1,6 +1,8 @@
 /* 
  * Function timers 
  */
+#include "perfctr.h"
+
 typedef void (*ftimer_test_funct)(void *); 
 
 /* Estimate the running time of f(argp) using the Unix interval timer.
@@ -12,3 +14,10 @@ double ftimer_itimer(ftimer_test_funct f, void *argp, int n);
    Return the average of n runs */
 double ftimer_gettod(ftimer_test_funct f, void *argp, int n);
 
+/* When set, count the perfctr.h events over the n runs, perfctr_open
+   having been called */
+void set_ftimer_counters(int on);
+
+/* The event counts of the last timing, per run */
+void ftimer_counts(perfctr_t *c);
+
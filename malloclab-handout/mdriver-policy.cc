@@ -0,0 +1,318 @@
+/*
+ * mdriver-policy.cc - Run mdriver's traces over a matrix of mmpolicy heaps
+ *
+ * usage: mdriver-policy [-hve] [-t <dir>] [-f <file>]...
+ *
+ * Every heap in the matrix below replays every trace: once checking
+ * that blocks are aligned and keep their contents, once for util, the
+ * peak payload over the heap size, and under fsecs for throughput, the
+ * same three passes mdriver makes over mm.c. Each heap then gets one
+ * line of util, Kops and perf index, graded as mdriver grades, and with
+ * -e the IPC and misses per op of its timed runs.
+ *
+ * To try a policy, add its heap to the matrix and rebuild; nothing else
+ * needs to know about it.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+extern "C" {
+#include "config.h"
+#include "fsecs.h"
+#include "memlib.h"
+#include "tracefile.h"
+}
+#include "mmpolicy.hpp"
+
+using namespace mmpolicy;
+
+/* the matrix: mm.c's list policies first, then one change at a time */
+template <class... H> struct matrix {};
+typedef matrix<
+    heap<tlsf_classes<2>, best_fit<32>, lifo_order, immediate>,
+    heap<tlsf_classes<2>, good_fit, lifo_order, immediate>,
+    heap<tlsf_classes<2>, first_fit, lifo_order, immediate>,
+    heap<tlsf_classes<2>, first_fit, address_order, immediate>,
+    heap<tlsf_classes<2>, best_fit<32>, lifo_order, deferred>,
+    heap<tlsf_classes<1>, best_fit<32>, lifo_order, immediate>,
+    heap<tlsf_classes<4>, best_fit<32>, lifo_order, immediate>,
+    heap<pow2_classes, first_fit, lifo_order, immediate>,
+    heap<pow2_classes, first_fit, size_order, immediate>,
+    heap<one_class, first_fit, lifo_order, immediate>,
+    heap<tlsf_classes<2>, best_fit<32>, lifo_order, immediate, 16>,
+    heap<tlsf_classes<2>, best_fit<32>, lifo_order, immediate, 64>
+> policies;
+
+extern "C" {
+int verbose = 0;            /* fsecs.c's, which we keep quiet */
+}
+static int per_trace = 0;   /* -v */
+static int count_events = 0; /* -e */
+
+/* plus heap corner cases mm.c's own paths never reach */
+static const char *default_traces[] = {
+    DEFAULT_TRACEFILES, "grow-tail.rep", NULL
+};
+
+typedef struct {
+    trace_file_t *trace;
+    char **blocks;
+    size_t *sizes;
+} replay_t;
+
+/* the totals of one heap over all traces, as mdriver keeps them */
+typedef struct {
+    double util;            /* weighted sum */
+    double weight;
+    double ops;
+    double secs;
+    int errors;
+    perfctr_t ctrs;         /* summed over the traces, if -e */
+} result_t;
+
+/*
+ * replay - run trace ops through a fresh H, returning the peak payload
+ * bytes, or -1 when H runs out of memory. With check set, also test
+ * every block for alignment and for whether it kept the bytes written
+ * to its two ends.
+ */
+template <class H>
+static long replay(replay_t *r, bool check)
+{
+    static H h;
+    trace_file_t *t = r->trace;
+    size_t payload = 0, peak = 0;
+    int i;
+
+    mem_reset_brk();
+    if (h.init() < 0)
+        return -1;
+    memset(r->blocks, 0, t->num_ids * sizeof(char *));
+    memset(r->sizes, 0, t->num_ids * sizeof(size_t));
+
+    for (i = 0; i < t->num_ops; i++) {
+        trace_op_t *op = &t->ops[i];
+        char *p = r->blocks[op->index];
+        size_t size = op->size;
+
+        if (check && p && (p[0] != (char)op->index ||
+                           p[r->sizes[op->index] - 1] != (char)op->index)) {
+            fprintf(stderr, "%s: %s op %d: block %d lost its contents\n",
+                    H::name(), t->name, i, op->index);
+            return -2;
+        }
+        switch (op->type) {
+        case TRACE_ALLOC:
+            p = (char *)h.malloc(size);
+            break;
+        case TRACE_REALLOC:
+            p = (char *)h.realloc(p, size);
+            if (check && p && r->sizes[op->index] && p[0] != (char)op->index) {
+                fprintf(stderr, "%s: %s op %d: realloc lost block %d\n",
+                        H::name(), t->name, i, op->index);
+                return -2;
+            }
+            break;
+        default:
+            h.free(p);
+            p = NULL;
+            size = 0;
+        }
+        if (size && p == NULL)
+            return -1;
+        payload += size - r->sizes[op->index];
+        if (payload > peak)
+            peak = payload;
+        r->blocks[op->index] = p;
+        r->sizes[op->index] = size;
+        if (check && p) {
+            if ((size_t)p % H::align || H::usable(p) < size) {
+                fprintf(stderr, "%s: %s op %d: block %d misplaced\n",
+                        H::name(), t->name, i, op->index);
+                return -2;
+            }
+            p[0] = p[size - 1] = (char)op->index;
+        }
+    }
+    return peak;
+}
+
+template <class H>
+static void replay_speed(void *arg)
+{
+    replay<H>((replay_t *)arg, false);
+}
+
+template <class H>
+static void run(replay_t *r, result_t *res)
+{
+    long peak;
+    double secs;
+
+    if (replay<H>(r, true) < 0 || (peak = replay<H>(r, false)) < 0) {
+        res->errors++;
+        return;
+    }
+    secs = fsecs(replay_speed<H>, r);
+    if (count_events) {
+        perfctr_t c;
+
+        fsecs_counts(&c);
+        for (int e = 0; e < PERFCTR_EVENTS; e++)
+            if (res->ctrs.count[e] >= 0)
+                res->ctrs.count[e] = c.count[e] < 0 ? -1 :
+                    res->ctrs.count[e] + c.count[e];
+    }
+    res->util += r->trace->weight * ((double)peak / mem_heapsize());
+    res->weight += r->trace->weight;
+    res->ops += r->trace->num_ops;
+    res->secs += secs;
+    if (per_trace)
+        printf("  %-24s %5.1f%% %8.0f Kops\n", r->trace->name,
+               100.0 * peak / mem_heapsize(), r->trace->num_ops / secs / 1e3);
+}
+
+/* print_events - IPC and events per op, '-' for those not counted */
+static void print_events(const perfctr_t *c, double ops)
+{
+    static const int per_op[] = { PERFCTR_INSNS, PERFCTR_L1D_MISSES,
+                                  PERFCTR_LLC_MISSES, PERFCTR_BRANCH_MISSES,
+                                  PERFCTR_DTLB_MISSES, PERFCTR_FAULTS };
+
+    if (c->count[PERFCTR_INSNS] >= 0 && c->count[PERFCTR_CYCLES] > 0)
+        printf(" %5.2f", c->count[PERFCTR_INSNS] / c->count[PERFCTR_CYCLES]);
+    else
+        printf(" %5s", "-");
+    for (int e : per_op) {
+        if (c->count[e] >= 0 && ops > 0)
+            printf(" %7.*f", e == PERFCTR_INSNS ? 0 : 2, c->count[e] / ops);
+        else
+            printf(" %7s", "-");
+    }
+}
+
+/* grade - mdriver's perf index for util and ops per second */
+static double grade(double util, double speed)
+{
+    double p1 = (util - MIN_SPACE) / (MAX_SPACE - MIN_SPACE);
+    double p2 = (speed - MIN_SPEED) / (MAX_SPEED - MIN_SPEED);
+
+    p1 = p1 < 0 ? 0 : p1 > 1 ? 1 : p1;
+    p2 = p2 < 0 ? 0 : p2 > 1 ? 1 : p2;
+    return 100 * (UTIL_WEIGHT * p1 + (1 - UTIL_WEIGHT) * p2);
+}
+
+template <class H>
+static void bench(replay_t *r, int ntraces)
+{
+    result_t res = {0, 0, 0, 0, 0, {{0}}};
+    double util, speed;
+
+    if (per_trace)
+        printf("%s\n", H::name());
+    for (int i = 0; i < ntraces; i++)
+        run<H>(&r[i], &res);
+
+    util = res.weight ? res.util / res.weight : 0;
+    speed = res.secs ? res.ops / res.secs : 0;
+    printf("%-36s %5.1f%% %8.0f %5.1f", H::name(), 100 * util, speed / 1e3,
+           grade(util, speed));
+    if (count_events)
+        print_events(&res.ctrs, res.ops);
+    if (res.errors)
+        printf("  (%d traces failed)", res.errors);
+    printf("\n");
+}
+
+template <class... H>
+static void bench_all(matrix<H...>, replay_t *r, int ntraces)
+{
+    (bench<H>(r, ntraces), ...);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-hve] [-t <dir>] [-f <file>]...\n", prog);
+    fprintf(stderr, "\t-f <file>  Use <file> as a trace, repeatable.\n");
+    fprintf(stderr, "\t-t <dir>   Directory of the default traces.\n");
+    fprintf(stderr, "\t-v         Print util and throughput per trace.\n");
+    fprintf(stderr, "\t-e         Also print IPC and misses per op of the timed runs.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+    char tracedir[1024] = TRACEDIR;
+    static char *names[1024];
+    static trace_file_t traces[1024];
+    replay_t r[1024];
+    int nnames = 0, ntraces = 0, c, i;
+
+    while ((c = getopt(argc, argv, "f:t:veh")) != EOF) {
+        switch (c) {
+        case 'f':
+            if (nnames < 1024)
+                names[nnames++] = strdup(optarg);
+            break;
+        case 't':
+            snprintf(tracedir, sizeof(tracedir), "%s/", optarg);
+            break;
+        case 'v':
+            per_trace = 1;
+            break;
+        case 'e':
+            count_events = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit(c != 'h');
+        }
+    }
+    if (nnames == 0) {
+        for (i = 0; default_traces[i]; i++) {
+            names[nnames] = (char *)malloc(strlen(tracedir) + strlen(default_traces[i]) + 1);
+            sprintf(names[nnames++], "%s%s", tracedir, default_traces[i]);
+        }
+    }
+
+    /* like mdriver, only graded traces count */
+    for (i = 0; i < nnames; i++) {
+        if (trace_load(&traces[ntraces], names[i]) < 0)
+            exit(1);
+        if (traces[ntraces].weight == 0) {
+            trace_unload(&traces[ntraces]);
+            continue;
+        }
+        r[ntraces].trace = &traces[ntraces];
+        r[ntraces].blocks = (char **)calloc(traces[ntraces].num_ids, sizeof(char *));
+        r[ntraces].sizes = (size_t *)calloc(traces[ntraces].num_ids, sizeof(size_t));
+        if (!r[ntraces].blocks || !r[ntraces].sizes) {
+            fprintf(stderr, "out of memory for %s\n", names[i]);
+            exit(1);
+        }
+        ntraces++;
+    }
+
+    mem_init();
+    init_fsecs();
+    if (count_events && init_fsecs_counters() == 0) {
+        fprintf(stderr, "no events to count, perf_event_open is unavailable\n");
+        count_events = 0;
+    }
+    printf("%-36s %6s %8s %5s", "heap", "util", "Kops", "perf");
+    if (count_events)
+        printf(" %5s %7s %7s %7s %7s %7s %7s", "IPC", "insns", "L1d",
+               "LLC", "br-miss", "dTLB", "faults");
+    printf("\n");
+    bench_all(policies(), r, ntraces);
+
+    for (i = 0; i < ntraces; i++) {
+        trace_unload(&traces[i]);
+        free(r[i].blocks);
+        free(r[i].sizes);
+    }
+    mem_deinit();
+    return 0;
+}
@@ -7,9 +7,15 @@
  * Copyright (c) 2004, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* sched_setaffinity */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <float.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -18,12 +24,18 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <malloc.h> /* malloc_usable_size, for -l */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
 #include "config.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -54,25 +66,33 @@
  * Remember that index (-1) is the null pointer.
  */
 
-/* Records the extent of each block's payload */
+/* Records the extent of each block's payload, as a node of a treap
+   ordered by lo */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* ranges below lo */
+    struct range_t *right; /* ranges above hi */
+    unsigned prio;         /* no lower than the children's, a hash of lo */
     int index;             /* same index as free; for debugging */
 } range_t;
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    enum { ALLOC, FREE, REALLOC, MEMALIGN, FREE_SIZED, USABLE, CALLOC } type;
     int index;                        /* index for free() to use later */
-    size_t size;                      /* byte size of alloc/realloc request */
+    size_t size;                      /* byte size of alloc/realloc/memalign/
+                                         calloc request, the block's for
+                                         free_sized */
+    size_t align;                     /* alignment of a memalign request */
 } traceop_t;
 
+#define OP_TYPES (CALLOC + 1)
+
 /* Holds the information for one trace file*/
 typedef struct {
     char filename[MAXLINE];
-    int ignore_ranges;   /* don't check ranges (i.e. this is too big) */
+    int ignore_ranges;   /* was: too big to check ranges; now unused */
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
@@ -92,6 +112,33 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* log2 nanosecond buckets of the per-thread latency histograms */
+#define LAT_BUCKETS 24
+
+/* One thread of a concurrent replay, see eval_threads */
+typedef struct {
+    trace_t *trace;
+    char **blocks;       /* own copy of trace->blocks, or shared if partitioned */
+    int part, nparts;    /* only replay blocks with index % nparts == part */
+    int libc;            /* replay against libc instead of mm */
+    unsigned long *hist; /* if set, time every op into LAT_BUCKETS */
+    int failed;          /* set if the allocator ran out of memory */
+    struct timespec start, end; /* this thread's replay, barrier to last op */
+} replay_t;
+
+/* worst ops kept per op type by eval_mm_latency */
+#define LAT_WORST 3
+
+/* Per-op latency of one trace, one row per op type (-L) */
+typedef struct {
+    int n[OP_TYPES];         /* ops of the type */
+    double p50[OP_TYPES], p99[OP_TYPES], p999[OP_TYPES], max[OP_TYPES]; /* ns */
+    int worst[OP_TYPES][LAT_WORST]; /* opnums of the slowest, -1 if fewer */
+} latency_t;
+
+/* What a worker of run_pool sends back for each trace */
+typedef struct pool_msg_t pool_msg_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -105,10 +152,22 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    int reallocs;    /* realloc calls in the utilization run */
+    int inplace;     /* ... that returned the old pointer, a copy avoided */
+    size_t peak_rss; /* resident heap bytes during the validity run */
+    size_t final_rss; /* ... and after its last op */
+    perfctr_t ctrs;  /* events in one timed run, if -e */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+struct pool_msg_t {
+    int index;       /* which trace */
+    int errors;      /* malloc_errors the worker counted on it */
+    stats_t stats;
+    latency_t lat;   /* if -L */
+};
+
 
 /********************
  * For debugging.  If debug-mode is on, then we have each block start
@@ -119,6 +178,12 @@ typedef struct {
  * randint_t should be a byte, in case students return unaligned memory.
  *******************/
 #define RANDOM_DATA_LEN (1<<16)
+
+/* heap profile samples per trace taken by eval_mm_util (-H) */
+#define PROF_SAMPLES 100
+
+/* ops between two mem_rss samples in eval_mm_valid */
+#define RSS_EVERY 1024
 typedef unsigned char randint_t;
 static const char randint_t_name[] = "byte";
 static randint_t random_data[RANDOM_DATA_LEN];
@@ -137,6 +202,29 @@ int onetime_flag = 0;
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* replay threads for the scaling run (-T), 0 means no scaling run */
+static int max_threads = 0;
+static int partition = 0;  /* threads split one trace by block index (-P) */
+static pthread_barrier_t replay_barrier;
+
+/* per-op latency of each trace, if -L */
+static latency_t *latencies = NULL;
+
+/* where eval_mm_util writes heap profiles (-H), CSV or JSON */
+static FILE *prof_file = NULL;
+static int prof_json = 0;
+static int prof_rows = 0;
+
+/* worker processes the traces are spread over (-j), 0 for none */
+static int pool_workers = 0;
+static int pool_pin = 0;   /* pin worker k to cpu k (-C) */
+
+/* if set, rerun the traces with deferred coalescing and compare (-q) */
+static int compare_deferred = 0;
+
+/* if set, count hardware events around the timed runs (-e) */
+static int count_events = 0;
+
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -158,14 +246,27 @@ static int add_range(range_t **ranges, char *lo, int size,
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
 
+/* These functions track which heap pages may have changed (DBG_EXPENSIVE) */
+static void shadow_init(void);
+static void shadow_deinit(void);
+static void shadow_add(char *lo, size_t size);
+static void shadow_check(const trace_t *trace, int opnum, range_t *ranges);
+
 /* These functions implement the debugging code */
 static void init_random_data(void);
 static void check_index(const trace_t *trace, int opnum, int index);
+static void check_span(const trace_t *trace, int opnum, int index,
+                       size_t from, size_t to);
 static void randomize_block(trace_t *trace, int index);
+static void touch_block(char *p, size_t size);
+static char *first_nonzero(char *p, size_t size);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
+static void alloc_trace(trace_t *trace);
+static void check_op(trace_t *trace, int i);
+static int read_trace_bin(trace_t *trace);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -175,12 +276,30 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static int eval_mm_valid(trace_t *trace, range_t **ranges, stats_t *stats);
+static int check_trace(trace_t *trace, range_t **ranges, stats_t *stats);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, latency_t *lat);
+static void check_limits(void);
+static void prof_open(const char *name);
+static void prof_sample(const trace_t *trace, int opnum);
+static void prof_close(void);
+static double eval_threads(trace_t *trace, int nthreads, int libc,
+                           unsigned long *hist);
+static void *replay_thread(void *ptr);
+static void run_scaling(int n, const char *tracedir, char **tracefiles,
+                        stats_t *stats, int libc);
+static void print_latency(unsigned long *hist, int nthreads);
 
 /* Various helper routines */
+static void run_pool(int num_tracefiles, const char *tracedir,
+                     char **tracefiles, stats_t *mm_stats,
+                     range_t *ranges, speed_t *speed_params);
 static void printresults(int n, stats_t *stats);
+static void printtradeoff(int n, stats_t *eager, stats_t *deferred);
+static void printlatency(int n, stats_t *stats, latency_t *lat);
+static void printcounters(int n, stats_t *stats);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -225,7 +344,7 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         } else {
             if (verbose > 1)
                 printf("Checking mm_malloc for correctness, ");
-            mm_stats[i].valid = eval_mm_valid(trace, &ranges);
+            mm_stats[i].valid = eval_mm_valid(trace, &ranges, &mm_stats[i]);
 
             if (onetime_flag) {
                 free_trace(trace);
@@ -235,12 +354,16 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         if (mm_stats[i].valid) {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+            if (count_events)
+                fsecs_counts(&mm_stats[i].ctrs);
+            if (latencies)
+                eval_mm_latency(trace, &latencies[i]);
         }
 
         free_trace(trace);
@@ -250,6 +373,157 @@ static void run_tests(int num_tracefiles, const char *tracedir,
     }
 }
 
+/*
+ * check_limits - requests around 4 GB, the most a 32-bit header can
+ *     size, must either fail or give a block that holds them, no more
+ *     than a few pages over, and that frees in full: asking again and
+ *     again keeps working. Only regions that could grant them
+ *     (make BIG_HEAP=1) are asked.
+ */
+static void check_limits(void)
+{
+    static const size_t aligns[] = { 0, 16, 4096 };
+    static const size_t edges[] = { 0xfffff000UL, 0x100000000UL };
+    size_t size, usable;
+    char *p;
+    int e, i, k;
+
+    if (MAX_HEAP <= 0xffffffffUL)
+        return;
+    if (verbose > 1)
+        printf("Checking mm_malloc at the 4 GB limit\n");
+    mem_init();
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed before the 4 GB limit check");
+    for (e = 0; e < 2; e++)
+        for (size = edges[e] - 64; size <= edges[e] + 64; size += 4)
+            for (i = 0; i < 3; i++)
+                for (k = 0; k < 2; k++) {
+                    p = aligns[i] ? mm_memalign(aligns[i], size) : mm_malloc(size);
+                    if (p == NULL) {
+                        if (k) {
+                            fprintf(stderr, "ERROR: request of %zu bytes, "
+                                    "aligned %zu, failed after a free\n",
+                                    size, aligns[i]);
+                            errors++;
+                        }
+                        break;
+                    }
+                    usable = mm_usable_size(p);
+                    if ((aligns[i] && (size_t)p % aligns[i]) ||
+                        usable < size || usable > size + aligns[i] + 2 * 4096) {
+                        fprintf(stderr, "ERROR: request of %zu bytes, aligned "
+                                "%zu, got %zu usable at %p\n",
+                                size, aligns[i], usable, p);
+                        errors++;
+                    }
+                    mm_free(p);
+                }
+    mem_deinit();
+}
+
+/*
+ * run_pool - run_tests spread over pool_workers forked processes,
+ *     worker k taking traces k, k + pool_workers, ... Each trace gets a
+ *     fresh memlib in a fresh address space, and a worker that crashes
+ *     costs only its own traces, which are reported invalid.
+ */
+static void run_pool(int num_tracefiles, const char *tracedir,
+                     char **tracefiles, stats_t *mm_stats,
+                     range_t *ranges, speed_t *speed_params)
+{
+    struct pollfd *fds;
+    pool_msg_t msg;
+    latency_t lat;
+    cpu_set_t cpus;
+    int *done, fd[2], i, k, n, open_fds;
+    ssize_t got;
+    pid_t pid;
+
+    if ((fds = calloc(pool_workers, sizeof(struct pollfd))) == NULL ||
+        (done = calloc(num_tracefiles, sizeof(int))) == NULL)
+        unix_error("calloc failed in run_pool");
+
+    /* what is buffered would be printed again by every worker */
+    fflush(stdout);
+    for (k = 0; k < pool_workers; k++) {
+        if (pipe(fd) < 0)
+            unix_error("pipe failed in run_pool");
+        if ((pid = fork()) < 0)
+            unix_error("fork failed in run_pool");
+        if (pid == 0) {
+            close(fd[0]);
+            if (pool_pin) {
+                CPU_ZERO(&cpus);
+                CPU_SET(k % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+                sched_setaffinity(0, sizeof(cpus), &cpus);
+            }
+            if (set_timeout > 0)
+                alarm(set_timeout);
+            if (latencies)
+                latencies = &lat;
+            for (i = k; i < num_tracefiles; i += pool_workers) {
+                memset(&msg, 0, sizeof(msg));
+                errors = 0;
+                run_tests(1, tracedir, &tracefiles[i], &msg.stats,
+                          ranges, speed_params);
+                msg.index = i;
+                msg.errors = errors;
+                if (latencies)
+                    msg.lat = lat;
+                fflush(stdout);
+                if (write(fd[1], &msg, sizeof(msg)) != sizeof(msg))
+                    _exit(1);
+            }
+            _exit(0);
+        }
+        close(fd[1]);
+        fds[k].fd = fd[0];
+        fds[k].events = POLLIN;
+    }
+
+    /* collect results in whatever order the workers finish them */
+    open_fds = pool_workers;
+    while (open_fds > 0) {
+        if (poll(fds, pool_workers, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("poll failed in run_pool");
+        }
+        for (k = 0; k < pool_workers; k++) {
+            if (fds[k].fd < 0 || !fds[k].revents)
+                continue;
+            /* a message is far below PIPE_BUF, so it arrives whole */
+            got = read(fds[k].fd, &msg, sizeof(msg));
+            if (got == sizeof(msg) && msg.index >= 0 && msg.index < num_tracefiles) {
+                mm_stats[msg.index] = msg.stats;
+                if (latencies)
+                    latencies[msg.index] = msg.lat;
+                errors += msg.errors;
+                done[msg.index] = 1;
+            } else if (got <= 0) {
+                close(fds[k].fd);
+                fds[k].fd = -1;
+                open_fds--;
+            }
+        }
+    }
+    while (wait(NULL) > 0)
+        ;
+
+    for (n = 0; n < num_tracefiles; n++) {
+        if (!done[n]) {
+            printf("ERROR [trace %s%s]: worker process died\n", tracedir, tracefiles[n]);
+            errors++;
+            memset(&mm_stats[n], 0, sizeof(stats_t));
+            snprintf(mm_stats[n].filename, MAXLINE, "%s%s", tracedir, tracefiles[n]);
+        }
+    }
+    free(fds);
+    free(done);
+}
+
 /**************
  * Main routine
  **************/
@@ -266,6 +540,7 @@ int main(int argc, char **argv)
     speed_t speed_params;      /* input parameters to the xx_speed routines */
 
     int run_libc = 0;     /* If set, run libc malloc (set by -l) */
+    int latency_flag = 0; /* If set, time each op of mm (set by -L) */
     int autograder = 0;   /* if set then called by autograder (-A) */
 
     /* temporaries used to compute the performance index */
@@ -280,7 +555,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:T:hVAlDqPLej:CH:")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -338,6 +613,46 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'T': /* Replay every trace on up to n threads */
+            max_threads = atoi(optarg);
+            if (max_threads < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+
+        case 'j': /* Spread the traces over n processes */
+            pool_workers = atoi(optarg);
+            if (pool_workers < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+
+        case 'H': /* Write heap profiles to a file */
+            prof_open(optarg);
+            break;
+
+        case 'C': /* Pin the -j processes to cpus */
+            pool_pin = 1;
+            break;
+
+        case 'L': /* Time every op, report tail latency */
+            latency_flag = 1;
+            break;
+
+        case 'P': /* Threads of -T share one trace, split by block */
+            partition = 1;
+            break;
+
+        case 'q': /* Compare against deferred coalescing */
+            compare_deferred = 1;
+            break;
+
+        case 'e': /* Count hardware events per op */
+            count_events = 1;
+            break;
+
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -360,6 +675,10 @@ int main(int argc, char **argv)
 
     /* Initialize the timing package */
     init_fsecs();
+    if (count_events && init_fsecs_counters() == 0) {
+        printf("No events to count, perf_event_open is unavailable\n");
+        count_events = 0;
+    }
 
     /* Initialize the timeout */
     if (set_timeout > 0) {
@@ -391,6 +710,8 @@ int main(int argc, char **argv)
                 if (verbose > 1)
                     printf("and performance.\n");
                 libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+                if (count_events)
+                    fsecs_counts(&libc_stats[i].ctrs);
             }
             free_trace(trace);
         }
@@ -399,6 +720,8 @@ int main(int argc, char **argv)
         if (verbose) {
             printf("\nResults for libc malloc:\n");
             printresults(num_tracefiles, libc_stats);
+            if (count_events)
+                printcounters(num_tracefiles, libc_stats);
         }
     }
 
@@ -413,8 +736,20 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
-    run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
-              ranges, &speed_params);
+    if (latency_flag &&
+        (latencies = calloc(num_tracefiles, sizeof(latency_t))) == NULL)
+        unix_error("latencies calloc in main failed");
+
+    if (prof_file && pool_workers > 0)
+        app_error("-H and -j don't mix, the workers would share the file\n");
+    check_limits();
+    if (pool_workers > 0 && !onetime_flag)
+        run_pool(num_tracefiles, tracedir, tracefiles, mm_stats,
+                 ranges, &speed_params);
+    else
+        run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
+                  ranges, &speed_params);
+    prof_close();
 
 
     /* Display the mm results in a compact table */
@@ -429,6 +764,10 @@ int main(int argc, char **argv)
         } else {
             printf("\nResults for mm malloc:\n");
             printresults(num_tracefiles, mm_stats);
+            if (count_events)
+                printcounters(num_tracefiles, mm_stats);
+            if (latencies)
+                printlatency(num_tracefiles, mm_stats, latencies);
             printf("\n");
         }
     }
@@ -533,6 +872,36 @@ int main(int argc, char **argv)
         printf("Terminated with %d errors\n", errors);
     }
 
+    /*
+     * Optionally rerun the traces with coalescing deferred to see what
+     * it buys in throughput and costs in utilization
+     */
+    if (compare_deferred && !onetime_flag) {
+        stats_t *q_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+        if (q_stats == NULL)
+            unix_error("q_stats calloc in main failed");
+        mm_deferred(1);
+        latencies = NULL;
+        if (pool_workers > 0)
+            run_pool(num_tracefiles, tracedir, tracefiles, q_stats,
+                     ranges, &speed_params);
+        else
+            run_tests(num_tracefiles, tracedir, tracefiles, q_stats,
+                      ranges, &speed_params);
+        mm_deferred(0);
+        printtradeoff(num_tracefiles, mm_stats, q_stats);
+        free(q_stats);
+    }
+
+    /*
+     * Optionally replay the traces concurrently to see how mm scales
+     */
+    if (max_threads > 0 && !onetime_flag) {
+        run_scaling(num_tracefiles, tracedir, tracefiles, mm_stats, 0);
+        if (run_libc)
+            run_scaling(num_tracefiles, tracedir, tracefiles, libc_stats, 1);
+    }
+
     /* Optionally emit autoresult string */
     if (autograder) {
         sprintf(autoresult, "%d:%.0f:%.0f:%.0f",
@@ -546,16 +915,82 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range tree, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks. It is a
+ * treap, so every operation takes O(log n) time on average.
  ****************************************************************/
 
+/* the tree shape follows from the addresses alone, so runs repeat */
+#define RANGE_PRIO(lo) ((unsigned)(((unsigned long)(lo) >> 3) * 2654435761UL))
+
+/*
+ * range_insert - add node n to the tree t, return the new root
+ */
+static range_t *range_insert(range_t *t, range_t *n)
+{
+    range_t *c;
+
+    if (t == NULL)
+        return n;
+    if (n->lo < t->lo) {
+        c = t->left = range_insert(t->left, n);
+        if (c->prio > t->prio) {        /* rotate right */
+            t->left = c->right;
+            c->right = t;
+            return c;
+        }
+    } else {
+        c = t->right = range_insert(t->right, n);
+        if (c->prio > t->prio) {        /* rotate left */
+            t->right = c->left;
+            c->left = t;
+            return c;
+        }
+    }
+    return t;
+}
+
+/*
+ * range_join - join two trees, everything in a below everything in b
+ */
+static range_t *range_join(range_t *a, range_t *b)
+{
+    if (a == NULL)
+        return b;
+    if (b == NULL)
+        return a;
+    if (a->prio > b->prio) {
+        a->right = range_join(a->right, b);
+        return a;
+    }
+    b->left = range_join(a, b->left);
+    return b;
+}
+
+/*
+ * range_floor - the range with the highest lo not above addr, or NULL
+ */
+static range_t *range_floor(range_t *t, char *addr)
+{
+    range_t *best = NULL;
+
+    while (t != NULL) {
+        if (t->lo <= addr) {
+            best = t;
+            t = t->right;
+        } else {
+            t = t->left;
+        }
+    }
+    return best;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range struct for this block and add it to the range tree.
  */
 static int add_range(range_t **ranges, char *lo, int size,
                      const trace_t *trace, int opnum, int index)
@@ -581,34 +1016,36 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* If we can't afford the linear-time loop, we check less thoroughly and
-       just assume the overlap will be caught by writing random bits. */
-    if(trace->ignore_ranges || debug_mode == DBG_NONE) return 1;
+    /* Without debugging we don't keep the tree, and just assume any
+       overlap will be caught by writing random bits. Traces flagged
+       ignore_ranges are checked anyway, the tree is cheap enough. */
+    if(debug_mode == DBG_NONE) return 1;
 
-
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-            malloc_error(trace, opnum,
-                         "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-                         lo, hi, p->lo, p->hi);
-            return 0;
-        }
+    /* The payload must not overlap any other payloads. They don't
+       overlap each other, so only the last one starting at or below
+       hi can reach lo. */
+    if ((p = range_floor(*ranges, hi)) != NULL && p->hi >= lo) {
+        malloc_error(trace, opnum,
+                     "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+                     lo, hi, p->lo, p->hi);
+        return 0;
     }
 
     /*
      * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
         unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
+    p->left = p->right = NULL;
+    p->prio = RANGE_PRIO(lo);
     p->index = index;
-    *ranges = p;
+    *ranges = range_insert(*ranges, p);
 
+    if (debug_mode == DBG_EXPENSIVE)
+        shadow_add(lo, size);
     return 1;
 }
 
@@ -618,15 +1055,12 @@ static int add_range(range_t **ranges, char *lo, int size,
 static void remove_range(range_t **ranges, char *lo)
 {
     range_t *p;
-    range_t **prevpp = ranges;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-            *prevpp = p->next;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    while ((p = *ranges) != NULL && p->lo != lo)
+        ranges = lo < p->lo ? &p->left : &p->right;
+    if (p != NULL) {
+        *ranges = range_join(p->left, p->right);
+        free(p);
     }
 }
 
@@ -635,14 +1069,157 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    if (*ranges == NULL)
+        return;
+    clear_ranges(&(*ranges)->left);
+    clear_ranges(&(*ranges)->right);
+    free(*ranges);
+    *ranges = NULL;
+}
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+/*****************************************************************
+ * The following routines keep a shadow bitmap of the heap pages for
+ * DBG_EXPENSIVE. Rather than checking every block's data before every
+ * request, we keep the pages that hold payloads read-only once they
+ * have been checked. A write to one faults; the handler makes the
+ * page writable again and puts it on the dirty list, and only the
+ * payloads on dirty pages are checked before the next request.
+ *
+ * A page holding a payload is always either clean (read-only and
+ * checked) or dirty (listed).
+ ****************************************************************/
+
+static char *shadow_base;           /* first byte of the heap reservation */
+static size_t shadow_pages;         /* pages in the reservation */
+static size_t shadow_pagesize;
+static unsigned long *shadow_clean; /* bit per page: read-only, checked */
+static unsigned long *shadow_listed;/* bit per page: on the dirty list */
+static size_t *shadow_dirty;        /* the dirty list */
+static size_t shadow_ndirty;
+
+#define SHADOW_WORD (8 * sizeof(unsigned long))
+#define SHADOW_TEST(map, pg) ((map)[(pg) / SHADOW_WORD] >> ((pg) % SHADOW_WORD) & 1)
+#define SHADOW_SET(map, pg) ((map)[(pg) / SHADOW_WORD] |= 1UL << ((pg) % SHADOW_WORD))
+#define SHADOW_CLEAR(map, pg) ((map)[(pg) / SHADOW_WORD] &= ~(1UL << ((pg) % SHADOW_WORD)))
+
+/*
+ * shadow_fault - SIGSEGV handler: a clean page got written, list it.
+ *     Any other fault is a real one, and happens again without us.
+ */
+static void shadow_fault(int sig __attribute__((unused)), siginfo_t *info,
+                         void *ctx __attribute__((unused)))
+{
+    char *addr = (char *)info->si_addr;
+    size_t pg = (addr - shadow_base) / shadow_pagesize;
+
+    if (addr < shadow_base || pg >= shadow_pages || !SHADOW_TEST(shadow_clean, pg)) {
+        signal(SIGSEGV, SIG_DFL);
+        return;
     }
-    *ranges = NULL;
+    mprotect(shadow_base + pg * shadow_pagesize, shadow_pagesize, PROT_WRITE);
+    SHADOW_CLEAR(shadow_clean, pg);
+    SHADOW_SET(shadow_listed, pg);
+    shadow_dirty[shadow_ndirty++] = pg;
+}
+
+/*
+ * shadow_init - start a trace with no clean pages
+ */
+static void shadow_init(void)
+{
+    struct sigaction sa;
+    size_t words;
+
+    shadow_base = (char *)mem_heap_lo();
+    shadow_pagesize = mem_pagesize();
+    shadow_pages = (size_t)MAX_HEAP * (MEM_REGIONS + 1) / shadow_pagesize;
+    words = (shadow_pages + SHADOW_WORD - 1) / SHADOW_WORD;
+    if (shadow_clean == NULL &&
+        ((shadow_clean = malloc(words * sizeof(unsigned long))) == NULL ||
+         (shadow_listed = malloc(words * sizeof(unsigned long))) == NULL ||
+         (shadow_dirty = malloc(shadow_pages * sizeof(size_t))) == NULL))
+        unix_error("malloc error in shadow_init");
+    memset(shadow_clean, 0, words * sizeof(unsigned long));
+    memset(shadow_listed, 0, words * sizeof(unsigned long));
+    shadow_ndirty = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = shadow_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+}
+
+/*
+ * shadow_deinit - make the whole heap writable again for the other runs
+ */
+static void shadow_deinit(void)
+{
+    mprotect(shadow_base, shadow_pages * shadow_pagesize, PROT_WRITE);
+    signal(SIGSEGV, SIG_DFL);
+}
+
+/*
+ * shadow_add - a new payload: list its pages that aren't yet. Clean
+ *     ones list themselves when we fill the payload with random data.
+ */
+static void shadow_add(char *lo, size_t size)
+{
+    size_t pg = (lo - shadow_base) / shadow_pagesize;
+    size_t last = (lo + size - 1 - shadow_base) / shadow_pagesize;
+
+    for (; pg <= last; pg++) {
+        if (!SHADOW_TEST(shadow_clean, pg) && !SHADOW_TEST(shadow_listed, pg)) {
+            SHADOW_SET(shadow_listed, pg);
+            shadow_dirty[shadow_ndirty++] = pg;
+        }
+    }
+}
+
+/*
+ * check_page - check the part of every payload in t that lies on
+ *     [lo, hi)
+ */
+static void check_page(const trace_t *trace, int opnum, range_t *t,
+                       char *lo, char *hi)
+{
+    char *from, *to;
+
+    if (t == NULL)
+        return;
+    if (lo < t->lo)
+        check_page(trace, opnum, t->left, lo, hi);
+    if (t->lo < hi && t->hi >= lo) {
+        from = t->lo > lo ? t->lo : lo;
+        to = t->hi + 1 < hi ? t->hi + 1 : hi;
+        check_span(trace, opnum, t->index, from - t->lo, to - t->lo);
+    }
+    if (hi > t->lo)
+        check_page(trace, opnum, t->right, lo, hi);
+}
+
+/*
+ * shadow_check - check the payloads on every dirty page, then make the
+ *     pages clean
+ */
+static void shadow_check(const trace_t *trace, int opnum, range_t *ranges)
+{
+    size_t i, n, pg;
+    char *page;
+
+    for (i = n = 0; i < shadow_ndirty; i++) {
+        pg = shadow_dirty[i];
+        page = shadow_base + pg * shadow_pagesize;
+        check_page(trace, opnum, ranges, page, page + shadow_pagesize);
+        if (mprotect(page, shadow_pagesize, PROT_READ) < 0) {
+            /* out of mappings, most likely: check it every time */
+            shadow_dirty[n++] = pg;
+            continue;
+        }
+        SHADOW_CLEAR(shadow_listed, pg);
+        SHADOW_SET(shadow_clean, pg);
+    }
+    shadow_ndirty = n;
 }
 
 /**********************************************
@@ -660,6 +1237,27 @@ static void init_random_data(void) {
     }
 }
 
+/*
+ * touch_block - write every page of a block like a program filling it
+ * would, so that mem_rss sees what the trace really keeps resident
+ */
+static void touch_block(char *p, size_t size) {
+    size_t i, page = mem_pagesize();
+
+    for (i = 0; i < size; i += page - (size_t)(p + i) % page)
+        p[i] |= 0;
+}
+
+/* first_nonzero - the first byte of [p, p+size) that is not 0, or NULL */
+static char *first_nonzero(char *p, size_t size) {
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        if (p[i])
+            return p + i;
+    return NULL;
+}
+
 static void randomize_block(trace_t *traces, int index) {
     size_t size;
     size_t i;
@@ -680,21 +1278,27 @@ static void randomize_block(trace_t *traces, int index) {
 }
 
 static void check_index(const trace_t *trace, int opnum, int index) {
-    size_t size;
+    if(index < 0) return; /* we're doing free(NULL) */
+    check_span(trace, opnum, index, 0, trace->block_sizes[index]);
+}
+
+/*
+ * check_span - check bytes [from, to) of block index
+ */
+static void check_span(const trace_t *trace, int opnum, int index,
+                       size_t from, size_t to) {
     size_t i;
     randint_t *block;
     int base;
     int ngarbled = 0;
     int firstgarbled = -1;
 
-    if(index < 0) return; /* we're doing free(NULL) */
     if(debug_mode == DBG_NONE) return;
 
     block = (randint_t*)trace->blocks[index];
-    size = trace->block_sizes[index] / sizeof(*block);
     base = trace->block_rand_base[index];
 
-    for(i = 0; i < size; i++) {
+    for(i = from / sizeof(*block); i < to / sizeof(*block); i++) {
         if(block[i] != random_data[(base + i) % RANDOM_DATA_LEN]) {
             if(firstgarbled == -1) firstgarbled = i;
             ngarbled++;
@@ -720,7 +1324,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     FILE *tracefile;
     trace_t *trace;
     char type[MAXLINE];
-    int index, size;
+    int index, size = 0, align;  /* a request without a size repeats the last */
     int max_index = 0;
     int op_index;
 
@@ -734,6 +1338,8 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     /* Read the trace file header */
     strcpy(trace->filename, tracedir);
     strcat(trace->filename, filename);
+    if (read_trace_bin(trace))
+        goto done;
     if ((tracefile = fopen(trace->filename, "r")) == NULL) {
         unix_error("Could not open %s in read_trace", trace->filename);
     }
@@ -749,26 +1355,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
         app_error("%s: ignore-ranges can only be zero or one", trace->filename);
     }
 
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
-         (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-        unix_error("malloc 2 failed in read_trace");
-
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks =
-         (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
-        unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes =
-         (size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
-        unix_error("malloc 4 failed in read_trace");
-
-    /* and, if we're debugging, the offset into the random data */
-    if ((trace->block_rand_base =
-         calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
-        unix_error("malloc 5 failed in read_trace");
-
+    alloc_trace(trace);
 
     /* read every request line in the trace file */
     index = 0;
@@ -794,10 +1381,36 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
             break;
+        case 'm':
+            fscanf(tracefile, "%u %u %u", &index, &size, &align);
+            trace->ops[op_index].type = MEMALIGN;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].align = align;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 's':
+            fscanf(tracefile, "%u", &index);
+            trace->ops[op_index].type = FREE_SIZED;
+            trace->ops[op_index].index = index;
+            break;
+        case 'u':
+            fscanf(tracefile, "%u", &index);
+            trace->ops[op_index].type = USABLE;
+            trace->ops[op_index].index = index;
+            break;
+        case 'c':
+            fscanf(tracefile, "%u %u", &index, &size);
+            trace->ops[op_index].type = CALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n",
                       type[0], trace->filename);
         }
+        check_op(trace, op_index);
         op_index++;
         if(op_index == trace->num_ops) break;
     }
@@ -805,6 +1418,8 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
 
+ done:
+    reinit_trace(trace);
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
@@ -813,6 +1428,176 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     return trace;
 }
 
+/*
+ * alloc_trace - allocate the request and block arrays of a trace whose
+ *     header has been read
+ */
+static void alloc_trace(trace_t *trace)
+{
+    /* We'll store each request line in the trace in this array */
+    if ((trace->ops =
+         (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+        unix_error("malloc 2 failed in read_trace");
+
+    /* We'll keep an array of pointers to the allocated blocks here... */
+    if ((trace->blocks =
+         (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+        unix_error("malloc 3 failed in read_trace");
+
+    /* ... along with the corresponding byte sizes of each block */
+    if ((trace->block_sizes =
+         (size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
+        unix_error("malloc 4 failed in read_trace");
+
+    /* and, if we're debugging, the offset into the random data */
+    if ((trace->block_rand_base =
+         calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
+        unix_error("malloc 5 failed in read_trace");
+}
+
+/*
+ * check_op - vet request i of a trace being read, with block_sizes
+ *     standing in for the live blocks. A free_sized request learns its
+ *     block's size here, a memalign request must ask for a power of two.
+ */
+static void check_op(trace_t *trace, int i)
+{
+    traceop_t *op = &trace->ops[i];
+
+    switch (op->type) {
+    case ALLOC:
+    case REALLOC:
+    case CALLOC:
+        trace->block_sizes[op->index] = op->size;
+        break;
+    case MEMALIGN:
+        if (op->align == 0 || (op->align & (op->align - 1)))
+            app_error("%s: request %d aligns to %zu, not a power of two",
+                      trace->filename, i, op->align);
+        trace->block_sizes[op->index] = op->size;
+        break;
+    case FREE_SIZED:
+        op->size = op->index < 0 ? 0 : trace->block_sizes[op->index];
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * read_trace_bin - if trace->filename is a binary trace (see trace.h),
+ *     map it, decode it in one pass and return 1. Return 0 for a text
+ *     trace.
+ */
+static int read_trace_bin(trace_t *trace)
+{
+    const unsigned char *map, *p, *end;
+    unsigned long v;
+    struct stat st;
+    long index = 0;
+    int fd, i;
+
+    if ((fd = open(trace->filename, O_RDONLY)) < 0)
+        unix_error("Could not open %s in read_trace", trace->filename);
+    if (fstat(fd, &st) < 0)
+        unix_error("Could not stat %s in read_trace", trace->filename);
+    if (st.st_size < TRACE_MAGIC_LEN) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        unix_error("Could not map %s in read_trace", trace->filename);
+    if (memcmp(map, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        munmap((void *)map, st.st_size);
+        return 0;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+    p = map + TRACE_MAGIC_LEN;
+    end = map + st.st_size;
+    if ((p = get_varint(p, end, &v)) == NULL)
+        goto truncated;
+    if (v > 3)
+        app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
+    trace->weight = v;
+    if ((p = get_varint(p, end, &v)) == NULL)
+        goto truncated;
+    if (v > INT_MAX)
+        app_error("%s: %lu block ids are too many", trace->filename, v);
+    trace->num_ids = v;
+    if ((p = get_varint(p, end, &v)) == NULL)
+        goto truncated;
+    /* every request takes at least a byte */
+    if (v > INT_MAX || v > (unsigned long)(end - p))
+        goto truncated;
+    trace->num_ops = v;
+    if ((p = get_varint(p, end, &v)) == NULL)
+        goto truncated;
+    if (v > 1)
+        app_error("%s: ignore-ranges can only be zero or one", trace->filename);
+    trace->ignore_ranges = v;
+    alloc_trace(trace);
+
+    for (i = 0; i < trace->num_ops; i++) {
+        if ((p = get_varint(p, end, &v)) == NULL)
+            goto truncated;
+        index += unzigzag(v >> 2);
+        if (index < -1 || index >= trace->num_ids)
+            app_error("%s: block index %ld out of range", trace->filename, index);
+        trace->ops[i].index = index;
+        v &= 3;
+        if (v == TRACE_EXT) {
+            if ((p = get_varint(p, end, &v)) == NULL)
+                goto truncated;
+            v += TRACE_EXT;
+        }
+        if (index < 0 && v != TRACE_FREE)
+            app_error("%s: block index %ld out of range", trace->filename, index);
+        switch (v) {
+        case TRACE_ALLOC:
+        case TRACE_REALLOC:
+        case TRACE_MEMALIGN:
+            trace->ops[i].type = v == TRACE_ALLOC ? ALLOC :
+                v == TRACE_REALLOC ? REALLOC : MEMALIGN;
+            if ((p = get_varint(p, end, &v)) == NULL)
+                goto truncated;
+            trace->ops[i].size = v;
+            if (trace->ops[i].type == MEMALIGN) {
+                if ((p = get_varint(p, end, &v)) == NULL)
+                    goto truncated;
+                trace->ops[i].align = v;
+            }
+            break;
+        case TRACE_FREE:
+            trace->ops[i].type = FREE;
+            break;
+        case TRACE_FREE_SIZED:
+            trace->ops[i].type = FREE_SIZED;
+            break;
+        case TRACE_USABLE:
+            trace->ops[i].type = USABLE;
+            break;
+        case TRACE_CALLOC:
+            trace->ops[i].type = CALLOC;
+            if ((p = get_varint(p, end, &v)) == NULL)
+                goto truncated;
+            trace->ops[i].size = v;
+            break;
+        default:
+            app_error("Bogus request type (%lu) in tracefile %s\n",
+                      v, trace->filename);
+        }
+        check_op(trace, i);
+    }
+    munmap((void *)map, st.st_size);
+    return 1;
+
+ truncated:
+    app_error("%s: truncated binary trace\n", trace->filename);
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -844,7 +1629,22 @@ static void free_trace(trace_t *trace)
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
-static int eval_mm_valid(trace_t *trace, range_t **ranges)
+static int eval_mm_valid(trace_t *trace, range_t **ranges, stats_t *stats)
+{
+    int valid;
+
+    if (debug_mode == DBG_EXPENSIVE)
+        shadow_init();
+    valid = check_trace(trace, ranges, stats);
+    if (debug_mode == DBG_EXPENSIVE)
+        shadow_deinit();
+    return valid;
+}
+
+/*
+ * check_trace - the body of eval_mm_valid
+ */
+static int check_trace(trace_t *trace, range_t **ranges, stats_t *stats)
 {
     int i;
     int index;
@@ -857,6 +1657,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
     mem_reset_brk();
     clear_ranges(ranges);
     reinit_trace(trace);
+    stats->peak_rss = 0;
 
     /* Call the mm package's init function */
     if (mm_init() < 0) {
@@ -869,28 +1670,50 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
         index = trace->ops[i].index;
         size = trace->ops[i].size;
 
+        if (i % RSS_EVERY == 0 && mem_rss() > stats->peak_rss)
+            stats->peak_rss = mem_rss();
+
         if(debug_mode == DBG_EXPENSIVE) {
-            range_t *r;
-                        
             /* Let the students check their own heap */
             mm_checkheap(verbose);
 
-            /* Now check that all our allocated blocks have the right data */
-            r = *ranges;
-            while(r) {
-                check_index(trace, i, r->index);
-                r = r->next;
-            }
+            /* Now check that all our allocated blocks have the right
+             * data, those that can have changed since the last time */
+            shadow_check(trace, i, *ranges);
         }
 
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
 
             /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
-                malloc_error(trace, i, "mm_malloc failed.");
-                return 0;
+            if (trace->ops[i].type == ALLOC) {
+                if ((p = mm_malloc(size)) == NULL) {
+                    malloc_error(trace, i, "mm_malloc failed.");
+                    return 0;
+                }
+            } else if (trace->ops[i].type == CALLOC) {
+                if ((p = mm_calloc(1, size)) == NULL) {
+                    malloc_error(trace, i, "mm_calloc failed.");
+                    return 0;
+                }
+                if ((oldp = first_nonzero(p, size)) != NULL) {
+                    malloc_error(trace, i, "mm_calloc block not zeroed "
+                                 "at offset %ld", (long)(oldp - p));
+                    return 0;
+                }
+            } else {
+                if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+                    malloc_error(trace, i, "mm_memalign failed.");
+                    return 0;
+                }
+                if ((size_t)p % trace->ops[i].align) {
+                    malloc_error(trace, i, "mm_memalign returned %p, not "
+                                 "%zu byte aligned", p, trace->ops[i].align);
+                    return 0;
+                }
             }
 
             /*
@@ -907,6 +1730,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 
             /* Set to random data, for debugging. */
             randomize_block(trace, index);
+            touch_block(p, size);
             break;
 
         case REALLOC: /* mm_realloc */
@@ -947,9 +1771,11 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 
             /* Set to random data, for debugging. */
             randomize_block(trace, index);
+            touch_block(newp, size);
             break;
 
         case FREE: /* mm_free */
+        case FREE_SIZED: /* mm_free_sized */
             check_index(trace, i, index);
 
             /* Remove region from list and call student's free function */
@@ -959,7 +1785,28 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
                 p = trace->blocks[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            if (trace->ops[i].type == FREE)
+                mm_free(p);
+            else
+                mm_free_sized(p, size);
+            break;
+
+        case USABLE: /* mm_usable_size */
+            check_index(trace, i, index);
+            p = trace->blocks[index];
+            if ((size = mm_usable_size(p)) < trace->block_sizes[index]) {
+                malloc_error(trace, i, "mm_usable_size says %zu bytes of a "
+                             "%zu byte block", size, trace->block_sizes[index]);
+                return 0;
+            }
+
+            /* the program may now use every byte of it */
+            remove_range(ranges, p);
+            if (add_range(ranges, p, size, trace, i, index) == 0)
+                return 0;
+            trace->block_sizes[index] = size;
+            randomize_block(trace, index);
+            touch_block(p, size);
             break;
 
         default:
@@ -968,6 +1815,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 
     }
 
+    stats->final_rss = mem_rss();
+    if (stats->final_rss > stats->peak_rss)
+        stats->peak_rss = stats->final_rss;
+
     /* As far as we know, this is a valid malloc package */
     return 1;
 }
@@ -983,8 +1834,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   is always the high water mark of the heap.
  *
  *   A higher number is better: 1 is optimal.
+ *
+ *   Also counts in stats how many reallocs were done in place.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
     int i;
     int index;
@@ -993,8 +1846,11 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     int total_size = 0;
     char *p;
     char *newp, *oldp;
+    int prof_every = trace->num_ops / PROF_SAMPLES + 1;
 
     reinit_trace(trace);
+    stats->reallocs = 0;
+    stats->inplace = 0;
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
@@ -1005,10 +1861,15 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL) {
+            p = trace->ops[i].type == ALLOC ? mm_malloc(size)
+                : trace->ops[i].type == CALLOC ? mm_calloc(1, size)
+                : mm_memalign(trace->ops[i].align, size);
+            if (p == NULL) {
                 app_error("trace %d: mm_malloc failed in eval_mm_util",
                           tracenum);
             }
@@ -1030,6 +1891,9 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 app_error("trace %d: mm_realloc failed in eval_mm_util",
                           tracenum);
             }
+            stats->reallocs++;
+            if (newp == oldp)
+                stats->inplace++;
 
             /* Remember region and size */
             trace->blocks[index] = newp;
@@ -1039,6 +1903,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             break;
 
         case FREE: /* mm_free */
+        case FREE_SIZED: /* mm_free_sized */
             index = trace->ops[i].index;
             if(index < 0) {
                 size = 0;
@@ -1048,11 +1913,18 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            if (trace->ops[i].type == FREE)
+                mm_free(p);
+            else
+                mm_free_sized(p, trace->ops[i].size);
 
             total_size -= size;
             break;
 
+        case USABLE: /* mm_usable_size, the payload stays what was asked */
+            mm_usable_size(trace->blocks[trace->ops[i].index]);
+            break;
+
         default:
             app_error("trace %d: Nonexistent request type in eval_mm_util",
                       tracenum);
@@ -1061,6 +1933,9 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
+
+        if (prof_file && (i % prof_every == 0 || i == trace->num_ops - 1))
+            prof_sample(trace, i);
     }
 
     printf(".");
@@ -1097,6 +1972,22 @@ static void eval_mm_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+                app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
+        case CALLOC: /* mm_calloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_calloc(1, size)) == NULL)
+                app_error("mm_calloc error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1116,11 +2007,501 @@ static void eval_mm_speed(void *ptr)
             mm_free(block);
             break;
 
+        case FREE_SIZED: /* mm_free_sized */
+            index = trace->ops[i].index;
+            block = index < 0 ? NULL : trace->blocks[index];
+            mm_free_sized(block, trace->ops[i].size);
+            break;
+
+        case USABLE: /* mm_usable_size */
+            mm_usable_size(trace->blocks[trace->ops[i].index]);
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_speed");
         }
 }
 
+/*
+ * prof_open - start a heap profile file, JSON if the name ends in
+ *     .json and CSV otherwise
+ */
+static void prof_open(const char *name)
+{
+    size_t len = strlen(name);
+    int i;
+
+    if ((prof_file = fopen(name, "w")) == NULL)
+        unix_error("Could not create %s", name);
+    prof_json = len >= 5 && strcmp(name + len - 5, ".json") == 0;
+    if (prof_json) {
+        fprintf(prof_file, "[");
+        return;
+    }
+    fprintf(prof_file, "trace,op,heap,allocated,free,nfree,largest_free,"
+            "frag,searches,search_len,inserts,insert_len");
+    for (i = 0; i < MM_PROF_CLASSES; i++)
+        fprintf(prof_file, ",free_%lu", 16UL << i);
+    fprintf(prof_file, "\n");
+}
+
+/*
+ * prof_sample - write one row of the heap profile, taken after
+ *     request opnum
+ */
+static void prof_sample(const trace_t *trace, int opnum)
+{
+    mm_profile_t prof;
+    double search_len, insert_len;
+    int i;
+
+    mm_profile(&prof);
+    search_len = prof.searches ? (double)prof.search_steps / prof.searches : 0;
+    insert_len = prof.inserts ? (double)prof.insert_steps / prof.inserts : 0;
+    if (prof_json) {
+        fprintf(prof_file, "%s\n{\"trace\":\"%s\",\"op\":%d,\"heap\":%zu,"
+                "\"allocated\":%zu,\"free\":%zu,\"nfree\":%lu,"
+                "\"largest_free\":%zu,\"frag\":%.4f,\"searches\":%lu,"
+                "\"search_len\":%.2f,\"inserts\":%lu,\"insert_len\":%.2f,"
+                "\"free_hist\":[", prof_rows ? "," : "", trace->filename,
+                opnum, prof.heap_bytes, prof.alloc_bytes, prof.free_bytes, prof.nfree,
+                prof.largest_free, prof.frag, prof.searches, search_len,
+                prof.inserts, insert_len);
+        for (i = 0; i < MM_PROF_CLASSES; i++)
+            fprintf(prof_file, "%s%lu", i ? "," : "", prof.free_hist[i]);
+        fprintf(prof_file, "]}");
+    } else {
+        fprintf(prof_file, "%s,%d,%zu,%zu,%zu,%lu,%zu,%.4f,%lu,%.2f,%lu,%.2f",
+                trace->filename, opnum, prof.heap_bytes, prof.alloc_bytes, prof.free_bytes,
+                prof.nfree, prof.largest_free, prof.frag, prof.searches,
+                search_len, prof.inserts, insert_len);
+        for (i = 0; i < MM_PROF_CLASSES; i++)
+            fprintf(prof_file, ",%lu", prof.free_hist[i]);
+        fprintf(prof_file, "\n");
+    }
+    prof_rows++;
+}
+
+/*
+ * prof_close - finish the heap profile file, if any
+ */
+static void prof_close(void)
+{
+    if (prof_file == NULL)
+        return;
+    if (prof_json)
+        fprintf(prof_file, "\n]\n");
+    fclose(prof_file);
+    prof_file = NULL;
+}
+
+/*
+ * cmp_cycles - qsort order of (cycles, opnum) pairs, slowest first
+ */
+static int cmp_cycles(const void *a, const void *b)
+{
+    unsigned x = ((const unsigned *)a)[0], y = ((const unsigned *)b)[0];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * eval_mm_latency - Replay the trace once more, reading the cycle
+ *    counter around every op. The loop only stores the raw counts; the
+ *    sorting into percentiles happens afterwards, so the replay runs at
+ *    close to full speed.
+ */
+static void eval_mm_latency(trace_t *trace, latency_t *lat)
+{
+    unsigned *cyc, *sorted, hi, lo, hi2, lo2, ovh = ~0U;
+    double ns_per_cycle = 1e3 / mhz(0);
+    int i, k, t, n, index;
+    char *p;
+
+    if ((cyc = malloc(trace->num_ops * sizeof(unsigned))) == NULL ||
+        (sorted = malloc(2 * trace->num_ops * sizeof(unsigned))) == NULL)
+        unix_error("malloc failed in eval_mm_latency");
+
+    /* what two back to back reads cost, to take off every sample */
+    for (i = 0; i < 100; i++) {
+        access_counter(&hi, &lo);
+        access_counter(&hi2, &lo2);
+        if (lo2 - lo < ovh)
+            ovh = lo2 - lo;
+    }
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        access_counter(&hi, &lo);
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case CALLOC: /* mm_calloc */
+            if ((p = mm_calloc(1, trace->ops[i].size)) == NULL)
+                app_error("mm_calloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+            if (p == NULL && trace->ops[i].size != 0)
+                app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(index < 0 ? NULL : trace->blocks[index]);
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            p = mm_memalign(trace->ops[i].align, trace->ops[i].size);
+            if (p == NULL)
+                app_error("mm_memalign error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE_SIZED: /* mm_free_sized */
+            mm_free_sized(index < 0 ? NULL : trace->blocks[index],
+                          trace->ops[i].size);
+            break;
+
+        case USABLE: /* mm_usable_size */
+            mm_usable_size(trace->blocks[index]);
+            break;
+        }
+        access_counter(&hi2, &lo2);
+        /* no op takes 2^32 cycles, so the low words are enough */
+        cyc[i] = lo2 - lo > ovh ? lo2 - lo - ovh : 0;
+    }
+
+    /* one (cycles, opnum) pair per op of each type, slowest first */
+    for (t = ALLOC; t < OP_TYPES; t++) {
+        for (i = n = 0; i < trace->num_ops; i++) {
+            if ((int)trace->ops[i].type == t) {
+                sorted[2 * n] = cyc[i];
+                sorted[2 * n + 1] = i;
+                n++;
+            }
+        }
+        qsort(sorted, n, 2 * sizeof(unsigned), cmp_cycles);
+        lat->n[t] = n;
+        if (n > 0) {
+            lat->max[t] = sorted[0] * ns_per_cycle;
+            lat->p999[t] = sorted[2 * (int)(n * 0.001)] * ns_per_cycle;
+            lat->p99[t] = sorted[2 * (int)(n * 0.01)] * ns_per_cycle;
+            lat->p50[t] = sorted[2 * (int)(n * 0.5)] * ns_per_cycle;
+        }
+        for (k = 0; k < LAT_WORST; k++)
+            lat->worst[t][k] = k < n ? (int)sorted[2 * k + 1] : -1;
+    }
+    free(cyc);
+    free(sorted);
+}
+
+/*
+ * eval_threads - Replay the trace on nthreads threads at once against
+ *    one shared mm heap, or libc. Each thread either replays the whole
+ *    trace with its own copy of the block array or, with -P, the blocks
+ *    whose index falls to it. If hist is set it gets LAT_BUCKETS counts
+ *    per thread. Returns the wall clock seconds of the whole replay, or
+ *    -1 if some thread ran out of memory.
+ */
+static double eval_threads(trace_t *trace, int nthreads, int libc,
+                           unsigned long *hist)
+{
+    replay_t *replays;
+    pthread_t *tids;
+    char **shared = NULL;
+    double start = 0, end = 0, t;
+    int i, j, failed = 0;
+
+    if ((replays = calloc(nthreads, sizeof(replay_t))) == NULL ||
+        (tids = calloc(nthreads, sizeof(pthread_t))) == NULL)
+        unix_error("calloc failed in eval_threads");
+    if (partition &&
+        (shared = calloc(trace->num_ids, sizeof(char *))) == NULL)
+        unix_error("calloc failed in eval_threads");
+
+    if (!libc) {
+        mem_reset_brk();
+        if (mm_init() < 0)
+            app_error("mm_init failed in eval_threads");
+    }
+
+    /* everybody, including us, starts at the barrier */
+    pthread_barrier_init(&replay_barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++) {
+        replays[i].trace = trace;
+        replays[i].libc = libc;
+        replays[i].hist = hist ? hist + i * LAT_BUCKETS : NULL;
+        if (partition) {
+            replays[i].blocks = shared;
+            replays[i].part = i;
+            replays[i].nparts = nthreads;
+        } else {
+            replays[i].nparts = 1;
+            if ((replays[i].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL)
+                unix_error("calloc failed in eval_threads");
+        }
+        if ((errno = pthread_create(&tids[i], NULL, replay_thread, &replays[i])))
+            unix_error("pthread_create failed in eval_threads");
+    }
+    pthread_barrier_wait(&replay_barrier);
+
+    /* the replay spans from the first thread to start to the last to end;
+     * each thread takes its own clock since we may not run in between */
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        failed |= replays[i].failed;
+        t = replays[i].start.tv_sec + replays[i].start.tv_nsec / 1e9;
+        if (i == 0 || t < start)
+            start = t;
+        t = replays[i].end.tv_sec + replays[i].end.tv_nsec / 1e9;
+        if (i == 0 || t > end)
+            end = t;
+    }
+
+    /* mm_init throws the mm heap away, but libc keeps what it is not
+     * given back */
+    for (i = 0; i < (partition ? 1 : nthreads); i++) {
+        if (libc) {
+            for (j = 0; j < trace->num_ids; j++)
+                free(replays[i].blocks[j]);
+        }
+        free(replays[i].blocks);
+    }
+    pthread_barrier_destroy(&replay_barrier);
+    free(replays);
+    free(tids);
+
+    if (failed)
+        return -1;
+    return end - start;
+}
+
+/*
+ * replay_thread - One thread of eval_threads, same loop as
+ *    eval_mm_speed but on its own blocks. Frees clear the block so
+ *    eval_threads can tell what libc still holds.
+ */
+static void *replay_thread(void *ptr)
+{
+    replay_t *r = (replay_t *)ptr;
+    trace_t *trace = r->trace;
+    struct timespec t0, t1;
+    long ns;
+    int i, b, index;
+    char *p;
+
+    pthread_barrier_wait(&replay_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        if (r->nparts > 1 && (index < 0 ? 0 : index) % r->nparts != r->part)
+            continue;
+        if (r->hist)
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* malloc */
+            p = r->libc ? malloc(trace->ops[i].size) : mm_malloc(trace->ops[i].size);
+            if (p == NULL) {
+                r->failed = 1;
+                return NULL;
+            }
+            r->blocks[index] = p;
+            break;
+
+        case CALLOC: /* calloc */
+            p = r->libc ? calloc(1, trace->ops[i].size)
+                : mm_calloc(1, trace->ops[i].size);
+            if (p == NULL) {
+                r->failed = 1;
+                return NULL;
+            }
+            r->blocks[index] = p;
+            break;
+
+        case REALLOC: /* realloc */
+            p = r->libc ? realloc(r->blocks[index], trace->ops[i].size)
+                : mm_realloc(r->blocks[index], trace->ops[i].size);
+            if (p == NULL && trace->ops[i].size != 0) {
+                r->failed = 1;
+                return NULL;
+            }
+            r->blocks[index] = p;
+            break;
+
+        case MEMALIGN: /* memalign */
+            p = r->libc ? aligned_alloc(trace->ops[i].align, trace->ops[i].size)
+                : mm_memalign(trace->ops[i].align, trace->ops[i].size);
+            if (p == NULL) {
+                r->failed = 1;
+                return NULL;
+            }
+            r->blocks[index] = p;
+            break;
+
+        case FREE: /* free */
+        case FREE_SIZED: /* free_sized, which libc may not have */
+            p = index < 0 ? NULL : r->blocks[index];
+            if (r->libc)
+                free(p);
+            else if (trace->ops[i].type == FREE)
+                mm_free(p);
+            else
+                mm_free_sized(p, trace->ops[i].size);
+            if (index >= 0)
+                r->blocks[index] = NULL;
+            break;
+
+        case USABLE: /* malloc_usable_size */
+            if (r->libc)
+                malloc_usable_size(r->blocks[index]);
+            else
+                mm_usable_size(r->blocks[index]);
+            break;
+        }
+        if (r->hist) {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+            for (b = 0; b < LAT_BUCKETS - 1 && ns >= (2L << b); b++)
+                ;
+            r->hist[b]++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &r->end);
+    return NULL;
+}
+
+/*
+ * run_scaling - Replay every valid trace on 1, 2, 4, ... max_threads
+ *    threads and print the aggregate throughput for each thread count,
+ *    plus the speedup of the largest over a single thread. A last,
+ *    timed-per-op run at max_threads adds to the latency histograms
+ *    printed at the end.
+ */
+static void run_scaling(int n, const char *tracedir, char **tracefiles,
+                        stats_t *stats, int libc)
+{
+    stats_t tstats;
+    trace_t *trace;
+    unsigned long *hist;
+    double secs, best, kops, base;
+    int i, t, k;
+
+    if ((hist = calloc(max_threads * LAT_BUCKETS, sizeof(unsigned long))) == NULL)
+        unix_error("calloc failed in run_scaling");
+
+    printf("\nScaling for %s malloc (Kops/s, %s):\n", libc ? "libc" : "mm",
+           partition ? "threads split the trace by block"
+           : "every thread replays the whole trace");
+    printf("%-24s", "trace");
+    for (t = 1; t <= max_threads; t = (t * 2 > max_threads && t < max_threads) ? max_threads : t * 2)
+        printf("%7d thr", t);
+    printf("%9s\n", "speedup");
+
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        if (!libc)
+            mem_init();
+        trace = read_trace(&tstats, tracedir, tracefiles[i]);
+        printf("%-24s", tracefiles[i]);
+        base = kops = 0;
+        for (t = 1; t <= max_threads; t = (t * 2 > max_threads && t < max_threads) ? max_threads : t * 2) {
+            /* best of three, one run is at the mercy of the scheduler */
+            best = -1;
+            for (k = 0; k < 3; k++) {
+                secs = eval_threads(trace, t, libc, NULL);
+                if (secs < 0) {
+                    best = -1;
+                    break;
+                }
+                if (best < 0 || secs < best)
+                    best = secs;
+            }
+            if (best < 0) {
+                printf("%11s", "nomem");
+                kops = 0;
+                continue;
+            }
+            kops = (trace->num_ops * (partition ? 1 : t) / 1e3) / best;
+            if (t == 1)
+                base = kops;
+            printf("%11.0f", kops);
+        }
+        if (base > 0 && kops > 0)
+            printf("%8.2fx\n", kops / base);
+        else
+            printf("%9s\n", "-");
+        eval_threads(trace, max_threads, libc, hist);
+        free_trace(trace);
+        if (!libc)
+            mem_deinit();
+    }
+
+    printf("\nLatency for %s malloc on %d threads, all traces (ops per bucket):\n",
+           libc ? "libc" : "mm", max_threads);
+    print_latency(hist, max_threads);
+    free(hist);
+}
+
+/*
+ * print_latency - print one histogram row per thread, with columns
+ *    for the buckets that some thread used. The column heads are
+ *    bucket upper bounds.
+ */
+static void print_latency(unsigned long *hist, int nthreads)
+{
+    int i, b, lo = LAT_BUCKETS, hi = -1;
+    unsigned long ns;
+    char label[24];
+
+    for (i = 0; i < nthreads; i++) {
+        for (b = 0; b < LAT_BUCKETS; b++) {
+            if (hist[i * LAT_BUCKETS + b]) {
+                if (b < lo)
+                    lo = b;
+                if (b > hi)
+                    hi = b;
+            }
+        }
+    }
+    if (hi < 0)
+        return;
+
+    printf("%-8s", "thread");
+    for (b = lo; b <= hi; b++) {
+        ns = 2UL << b;
+        if (b == LAT_BUCKETS - 1)
+            sprintf(label, "more");
+        else if (ns < 1000)
+            sprintf(label, "<%luns", ns);
+        else if (ns < 1000000)
+            sprintf(label, "<%luus", ns / 1000);
+        else
+            sprintf(label, "<%lums", ns / 1000000);
+        printf("%9s", label);
+    }
+    printf("\n");
+    for (i = 0; i < nthreads; i++) {
+        printf("%-8d", i);
+        for (b = lo; b <= hi; b++)
+            printf("%9lu", hist[i * LAT_BUCKETS + b]);
+        printf("\n");
+    }
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1145,6 +2526,14 @@ static int eval_libc_valid(trace_t *trace)
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case CALLOC: /* calloc */
+            if ((p = calloc(1, trace->ops[i].size)) == NULL) {
+                malloc_error(trace, i, "libc calloc failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1155,7 +2544,16 @@ static int eval_libc_valid(trace_t *trace)
             trace->blocks[trace->ops[i].index] = newp;
             break;
 
+        case MEMALIGN: /* aligned_alloc */
+            if ((p = aligned_alloc(trace->ops[i].align, trace->ops[i].size)) == NULL) {
+                malloc_error(trace, i, "libc aligned_alloc failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case FREE: /* free */
+        case FREE_SIZED:
             if(trace->ops[i].index >= 0) {
                 free(trace->blocks[trace->ops[i].index]);
             } else {
@@ -1163,6 +2561,10 @@ static int eval_libc_valid(trace_t *trace)
             }
             break;
 
+        case USABLE: /* malloc_usable_size */
+            malloc_usable_size(trace->blocks[trace->ops[i].index]);
+            break;
+
         default:
             app_error("invalid operation type  in eval_libc_valid");
         }
@@ -1195,6 +2597,13 @@ static void eval_libc_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case CALLOC: /* calloc */
+            index = trace->ops[i].index;
+            if ((p = calloc(1, trace->ops[i].size)) == NULL)
+                unix_error("calloc failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1205,7 +2614,15 @@ static void eval_libc_speed(void *ptr)
             trace->blocks[index] = newp;
             break;
 
+        case MEMALIGN: /* aligned_alloc */
+            index = trace->ops[i].index;
+            if ((p = aligned_alloc(trace->ops[i].align, trace->ops[i].size)) == NULL)
+                unix_error("aligned_alloc failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case FREE: /* free */
+        case FREE_SIZED:
             index = trace->ops[i].index;
             if(index >= 0) {
                 block = trace->blocks[index];
@@ -1214,6 +2631,10 @@ static void eval_libc_speed(void *ptr)
                 free(0);
             }
             break;
+
+        case USABLE: /* malloc_usable_size */
+            malloc_usable_size(trace->blocks[trace->ops[i].index]);
+            break;
         }
     }
 }
@@ -1328,6 +2749,127 @@ static void printresults(int n, stats_t *stats)
                "-");
     }
 
+    /* Print how many reallocs got away without a copy */
+    for (i=0; i < n; i++) {
+        if (stats[i].valid && stats[i].reallocs > 0)
+            printf("realloc: %6d of %6d in place (%3.0f%% copies avoided) %s\n",
+                   stats[i].inplace, stats[i].reallocs,
+                   100.0 * stats[i].inplace / stats[i].reallocs,
+                   stats[i].filename);
+    }
+
+    /* Print the heap's resident size at its worst and at the end */
+    for (i=0; i < n; i++) {
+        if (stats[i].valid && stats[i].peak_rss > 0)
+            printf("rss: peak %8.1fK final %8.1fK %s\n",
+                   stats[i].peak_rss / 1024.0, stats[i].final_rss / 1024.0,
+                   stats[i].filename);
+    }
+}
+
+/*
+ * printtradeoff - prints util and throughput per trace with eager and
+ *     with deferred coalescing side by side
+ */
+static void printtradeoff(int n, stats_t *eager, stats_t *deferred)
+{
+    int i;
+
+    printf("\nDeferred coalescing (eager -> deferred):\n");
+    printf("%6s %6s %8s %8s  %s\n", "util", "", "Kops", "", "trace");
+    for (i = 0; i < n; i++) {
+        if (!eager[i].valid || !deferred[i].valid) {
+            printf("%6s %6s %8s %8s  %s\n", "-", "-", "-", "-",
+                   eager[i].filename);
+            continue;
+        }
+        printf("%5.0f%% %5.0f%% %8.0f %8.0f  %s\n",
+               eager[i].util * 100.0, deferred[i].util * 100.0,
+               (eager[i].ops / 1e3) / eager[i].secs,
+               (deferred[i].ops / 1e3) / deferred[i].secs,
+               eager[i].filename);
+    }
+}
+
+/*
+ * printlatency - prints the per-op latency percentiles of every trace,
+ *     and the trace lines of the slowest ops
+ */
+static void printlatency(int n, stats_t *stats, latency_t *lat)
+{
+    static const char *names[] = { "malloc", "free", "realloc", "memalign",
+                                   "free_sz", "usable", "calloc" };
+    int i, t, k;
+
+    printf("\nLatency per op (ns):\n");
+    printf("%-8s%8s%8s%8s%8s%10s  %-20s %s\n", "op", "count", "p50",
+           "p99", "p99.9", "max", "slowest lines", "trace");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        for (t = ALLOC; t < OP_TYPES; t++) {
+            if (lat[i].n[t] == 0)
+                continue;
+            printf("%-8s%8d%8.0f%8.0f%8.0f%10.0f ", names[t], lat[i].n[t],
+                   lat[i].p50[t], lat[i].p99[t], lat[i].p999[t], lat[i].max[t]);
+            for (k = 0; k < LAT_WORST; k++) {
+                if (lat[i].worst[t][k] >= 0)
+                    printf(" %6d", LINENUM(lat[i].worst[t][k]));
+                else
+                    printf(" %6s", "");
+            }
+            printf("  %s\n", stats[i].filename);
+        }
+    }
+}
+
+/*
+ * printcounters - prints IPC and the events per op of every trace's
+ *     timed run, '-' for events the machine didn't count
+ */
+static void printcounters(int n, stats_t *stats)
+{
+    static const int per_op[] = { PERFCTR_INSNS, PERFCTR_L1D_MISSES,
+                                  PERFCTR_LLC_MISSES, PERFCTR_BRANCH_MISSES,
+                                  PERFCTR_DTLB_MISSES, PERFCTR_FAULTS };
+    perfctr_t sum;
+    double sumops = 0;
+    int i, k, e;
+
+    for (e = 0; e < PERFCTR_EVENTS; e++)
+        sum.count[e] = 0;
+    printf("\nEvents per op:\n");
+    printf("%6s%9s%8s%8s%9s%8s%8s  %s\n", "IPC", "insns", "L1d",
+           "LLC", "br-miss", "dTLB", "faults", "trace");
+    for (i = 0; i <= n; i++) {
+        const perfctr_t *c = i < n ? &stats[i].ctrs : &sum;
+        double ops = i < n ? stats[i].ops : sumops;
+
+        if (i < n) {
+            if (!stats[i].valid)
+                continue;
+            for (e = 0; e < PERFCTR_EVENTS; e++)
+                if (sum.count[e] >= 0)
+                    sum.count[e] = c->count[e] < 0 ? -1 :
+                        sum.count[e] + c->count[e];
+            sumops += ops;
+        } else if (sumops == 0)
+            break;
+
+        if (c->count[PERFCTR_INSNS] >= 0 && c->count[PERFCTR_CYCLES] > 0)
+            printf("%6.2f", c->count[PERFCTR_INSNS] / c->count[PERFCTR_CYCLES]);
+        else
+            printf("%6s", "-");
+        for (k = 0; k < (int)(sizeof(per_op) / sizeof(per_op[0])); k++) {
+            int width = k == 0 || k == 3 ? 9 : 8;
+            if (c->count[per_op[k]] >= 0)
+                printf("%*.*f", width, k == 0 ? 0 : 2,
+                       c->count[per_op[k]] / ops);
+            else
+                printf("%*s", width, "-");
+        }
+        printf("  %s\n", i < n ? stats[i].filename : "Total");
+    }
 }
 
 /*
@@ -1375,7 +2917,7 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+    fprintf(stderr, "Usage: mdriver [-hlVdDqPLCe] [-j <n>] [-H <file>] [-f <file>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1387,4 +2929,14 @@ static void usage(void)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-T <n>     Also replay each trace on 1..n threads, report scaling.\n");
+    fprintf(stderr, "\t-P         With -T, split each trace among the threads by block.\n");
+    fprintf(stderr, "\t-j <n>     Run the traces in n worker processes at once.\n");
+    fprintf(stderr, "\t-C         With -j, pin each worker process to its own cpu.\n");
+    fprintf(stderr, "\t-H <file>  Sample the heap layout during the util run into <file>,\n");
+    fprintf(stderr, "\t           as JSON if it ends in .json, CSV otherwise.\n");
+    fprintf(stderr, "\t-L         Time every op, report p50/p99/p99.9/max and the slowest.\n");
+    fprintf(stderr, "\t-q         Also run with deferred coalescing, compare util and Kops.\n");
+    fprintf(stderr, "\t-e         Count hardware events in the timed runs, report IPC and\n");
+    fprintf(stderr, "\t           misses per op.\n");
 }
@@ -12,42 +12,72 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/* mem_map hands out pages of this size from the region after the others */
+#define MAP_PAGE  4096
+#define MAP_PAGES (MAX_HEAP / MAP_PAGE)
+
 /* private variables */
-static char *heap;
-static char *mem_brk;
-static char *mem_max_addr;
+static char *heap;                     /* start of region 0 */
+static char *mem_brk[MEM_REGIONS];     /* each region is MAX_HEAP bytes */
+static char *mem_dirty[MEM_REGIONS];   /* highest brk since mem_init */
+static char *map_base;                 /* start of the mapped region */
+static unsigned long map_used[MAP_PAGES / 64]; /* set bit = page mapped */
+static size_t map_top;                 /* pages below this may be mapped */
+static size_t map_bytes;               /* currently mapped */
+static size_t mem_peak;                /* most ever held, brk and mapped */
+static unsigned char rss_vec[MAP_PAGES]; /* for mincore */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t mem_held(void);
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model. All regions are
+ *		reserved up front, back to back, so the heap stays one range,
+ *		followed by the region mem_map takes pages from.
  */
 void mem_init(void){
+	int i;
 	int dev_zero = open("/dev/zero", O_RDWR);
 	heap = mmap((void *)0x800000000, /* suggested start*/
-			MAX_HEAP,				/* length */
+			(size_t)MAX_HEAP * (MEM_REGIONS + 1),	/* length */
 			PROT_WRITE,				/* permissions */
-			MAP_PRIVATE,			/* private or shared? */
+			MAP_PRIVATE | MAP_NORESERVE,	/* private or shared? */
 			dev_zero,				/* fd */
 			0);						/* offset (dunno) */
-	mem_max_addr = heap + MAX_HEAP;
-	mem_brk = heap;					/* heap is empty initially */
+	close(dev_zero);
+	for (i = 0; i < MEM_REGIONS; i++)
+		mem_brk[i] = mem_dirty[i] = heap + (size_t)i * MAX_HEAP; /* heap is empty initially */
+	map_base = heap + (size_t)MEM_REGIONS * MAX_HEAP;
+	memset(map_used, 0, sizeof(map_used));
+	map_top = map_bytes = mem_peak = 0;
 }
 
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void){
-	munmap(heap, MAX_HEAP);
+	munmap(heap, (size_t)MAX_HEAP * (MEM_REGIONS + 1));
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers to make an empty heap.
+ *		Pages still mapped go back like mem_unmap's, brk memory keeps
+ *		its contents below mem_clean.
  */
 void mem_reset_brk(){
-	mem_brk = heap;
+	int i;
+	for (i = 0; i < MEM_REGIONS; i++)
+		mem_brk[i] = heap + (size_t)i * MAX_HEAP;
+	if (map_bytes)
+		madvise(map_base, map_top * MAP_PAGE, MADV_DONTNEED);
+	/* nothing at or above map_top was ever mapped */
+	memset(map_used, 0, (map_top + 63) / 64 * sizeof(unsigned long));
+	map_top = map_bytes = mem_peak = 0;
 }
 
 /* 
@@ -55,21 +85,144 @@ void mem_reset_brk(){
  *		by incr bytes and returns the start address of the new area. In
  *		this model, the heap cannot be shrunk.
  */
-void *mem_sbrk(int incr) {
-	char *old_brk = mem_brk;
+void *mem_sbrk(intptr_t incr) {
+	return mem_region_sbrk(0, incr);
+}
+
+/* 
+ * mem_region_sbrk - mem_sbrk for one of the MEM_REGIONS regions, each
+ *		with its own brk. Safe to call from several threads.
+ */
+void *mem_region_sbrk(int region, intptr_t incr) {
+	char *old_brk;
+	char *max_addr = heap + (size_t)(region + 1) * MAX_HEAP;
 
+	pthread_mutex_lock(&mem_lock);
+	old_brk = mem_brk[region];
     // call sbrk() in an attempt to have similar semantics as a real allocator.
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr) ||
+	if ( (incr < 0) || ((old_brk + incr) > max_addr) ||
             sbrk(incr) == (void *) -1) {
+		pthread_mutex_unlock(&mem_lock);
 		errno = ENOMEM;
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 		return (void *)-1;
 	}
 
-	mem_brk += incr;
+	mem_brk[region] += incr;
+	if (mem_brk[region] > mem_dirty[region])
+		mem_dirty[region] = mem_brk[region];
+	if (mem_held() > mem_peak)
+		mem_peak = mem_held();
+	pthread_mutex_unlock(&mem_lock);
 	return (void *)old_brk;
 }
 
+/*
+ * mem_clean - the lowest address of a region that no brk has reached
+ *		since mem_init; brk growth from there on reads zeros, as fresh
+ *		sbrk memory does.
+ */
+void *mem_clean(int region) {
+	return mem_dirty[region];
+}
+
+/*
+ * mem_map - model of an anonymous mmap: len bytes (rounded up to whole
+ *		pages) from the mapped region, first fit, or (void *)-1. Unlike
+ *		brk memory the pages can be given back with mem_unmap.
+ */
+void *mem_map(size_t len) {
+	size_t n = (len + MAP_PAGE - 1) / MAP_PAGE;
+	size_t pg, run = 0;
+
+	pthread_mutex_lock(&mem_lock);
+	for (pg = 0; pg < MAP_PAGES && run < n; pg++) {
+		if (map_used[pg / 64] == ~0UL && pg % 64 == 0) {
+			run = 0;
+			pg += 63;
+		} else if (map_used[pg / 64] >> (pg % 64) & 1) {
+			run = 0;
+		} else {
+			run++;
+		}
+	}
+	if (run < n) {
+		pthread_mutex_unlock(&mem_lock);
+		errno = ENOMEM;
+		fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+		return (void *)-1;
+	}
+	for (pg -= n; run-- > 0; pg++)
+		map_used[pg / 64] |= 1UL << (pg % 64);
+	if (pg > map_top)
+		map_top = pg;
+	map_bytes += n * MAP_PAGE;
+	if (mem_held() > mem_peak)
+		mem_peak = mem_held();
+	pthread_mutex_unlock(&mem_lock);
+	return map_base + (pg - n) * MAP_PAGE;
+}
+
+/*
+ * mem_unmap - give back the pages of a mem_map(len) at p. Their
+ *		contents are gone, a later mem_map of them reads zeros, as
+ *		every fresh mapping does.
+ */
+void mem_unmap(void *p, size_t len) {
+	size_t n = (len + MAP_PAGE - 1) / MAP_PAGE;
+	size_t pg = ((char *)p - map_base) / MAP_PAGE;
+
+	madvise(p, n * MAP_PAGE, MADV_DONTNEED);
+	pthread_mutex_lock(&mem_lock);
+	map_bytes -= n * MAP_PAGE;
+	while (n-- > 0) {
+		map_used[pg / 64] &= ~(1UL << (pg % 64));
+		pg++;
+	}
+	pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * mem_release - model of madvise(MADV_DONTNEED): the whole pages inside
+ *		[p, p+len) stop being resident and read as zeros when touched
+ *		again. They stay part of the heap.
+ */
+void mem_release(void *p, size_t len) {
+	char *lo = (char *)(((size_t)p + MAP_PAGE - 1) & ~(size_t)(MAP_PAGE - 1));
+	char *hi = (char *)(((size_t)p + len) & ~(size_t)(MAP_PAGE - 1));
+
+	if (lo < hi)
+		madvise(lo, hi - lo, MADV_DONTNEED);
+}
+
+/*
+ * mem_rss - bytes of the brk regions and mapped pages that are resident
+ */
+size_t mem_rss(void) {
+	size_t rss = 0, n, j;
+	char *lo;
+	int i;
+
+	pthread_mutex_lock(&mem_lock);
+	for (i = 0; i <= MEM_REGIONS; i++) {
+		lo = heap + (size_t)i * MAX_HEAP;
+		n = i < MEM_REGIONS ? (size_t)(mem_brk[i] - lo + MAP_PAGE - 1) / MAP_PAGE : map_top;
+		if (n == 0 || mincore(lo, n * MAP_PAGE, rss_vec) < 0)
+			continue;
+		for (j = 0; j < n; j++)
+			rss += (rss_vec[j] & 1) * MAP_PAGE;
+	}
+	pthread_mutex_unlock(&mem_lock);
+	return rss;
+}
+
+/*
+ * mem_region - return the region p lies in, MEM_REGIONS for mapped pages
+ */
+int mem_region(const void *p) {
+	return (int)(((const char *)p - heap) / MAX_HEAP);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -78,17 +231,34 @@ void *mem_heap_lo(){
 }
 
 /* 
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last heap byte, in the highest
+ *		region that has any, mapped pages included
  */
 void *mem_heap_hi(){
-	return (void *)(mem_brk - 1);
+	int i;
+	if (map_top)
+		return (void *)(map_base + map_top * MAP_PAGE - 1);
+	for (i = MEM_REGIONS - 1; i > 0; i--)
+		if (mem_brk[i] != heap + (size_t)i * MAX_HEAP)
+			break;
+	return (void *)(mem_brk[i] - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes: the most ever held
+ *		over all regions at once, counting mapped pages while mapped
  */
 size_t mem_heapsize() {
-	return (size_t)((void *)mem_brk - (void *)heap);
+	return mem_peak;
+}
+
+/* mem_held - brk bytes over all regions plus mapped bytes, lock held */
+static size_t mem_held(void) {
+	size_t size = map_bytes;
+	int i;
+	for (i = 0; i < MEM_REGIONS; i++)
+		size += (size_t)(mem_brk[i] - (heap + (size_t)i * MAX_HEAP));
+	return size;
 }
 
 /*
@@ -1,8 +1,18 @@
 #include <unistd.h>
 
+/* independent heap regions memlib hands out, MAX_HEAP bytes each */
+#define MEM_REGIONS 8
+
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
+void *mem_region_sbrk(int region, intptr_t incr);
+void *mem_clean(int region);     /* reads zero from here to the region end */
+int mem_region(const void *p);   /* MEM_REGIONS for mapped pages */
+void *mem_map(size_t len);
+void mem_unmap(void *p, size_t len);
+void mem_release(void *p, size_t len);
+size_t mem_rss(void);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
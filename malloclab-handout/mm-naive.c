@@ -35,6 +35,10 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define aligned_alloc mm_aligned_alloc
+#define malloc_usable_size mm_usable_size
+#define free_sized mm_free_sized
 #endif /* def DRIVER */
 
 /* single word (4) or double word (8) alignment */
@@ -56,6 +60,23 @@ int mm_init(void)
   return 0;
 }
 
+/*
+ * mm_profile - every block is allocated, and nothing is ever searched
+ */
+void mm_profile(mm_profile_t *prof)
+{
+  memset(prof, 0, sizeof(*prof));
+  prof->heap_bytes = prof->alloc_bytes = mem_heapsize();
+}
+
+/*
+ * mm_deferred - nothing is ever coalesced, so nothing to defer
+ */
+void mm_deferred(int on)
+{
+  (void)on;
+}
+
 /*
  * malloc - Allocate a block by incrementing the brk pointer.
  *      Always allocate a block whose size is a multiple of the alignment.
@@ -138,6 +159,50 @@ void *calloc (size_t nmemb, size_t size)
   return newptr;
 }
 
+/*
+ * memalign - Over-allocate by the alignment and round up, leaving the
+ *      size word just before the rounded pointer.
+ */
+void *memalign(size_t alignment, size_t size)
+{
+  unsigned char *p;
+
+  if (alignment & (alignment - 1))
+    return NULL;
+  if (alignment <= ALIGNMENT)
+    return malloc(size);
+  if ((p = malloc(size + alignment)) == NULL)
+    return NULL;
+  p += -(size_t)p & (alignment - 1);
+  *SIZE_PTR(p) = size;
+  return p;
+}
+
+/*
+ * aligned_alloc - Same as memalign.
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+  return memalign(alignment, size);
+}
+
+/*
+ * malloc_usable_size - Just the size the block was asked for.
+ */
+size_t malloc_usable_size(void *ptr)
+{
+  return ptr ? *SIZE_PTR(ptr) : 0;
+}
+
+/*
+ * free_sized - Ignored, like free.
+ */
+void free_sized(void *ptr, size_t size)
+{
+  (void)size;
+  free(ptr);
+}
+
 /*
  * mm_checkheap - There are no bugs in my code, so I don't need to check,
  *      so nah!
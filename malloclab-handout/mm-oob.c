@@ -0,0 +1,692 @@
+/*
+ * mm-oob.c - mm.c's interface, with every bit of block metadata out of band
+ *
+ * Blocks have no header or footer. The heap is a row of 8 byte granules
+ * and a block is a run of them, ending where the next block starts. What
+ * the allocator knows about the blocks lives apart from them, in memlib
+ * region 1, one page_t for every 4 KB page of heap:
+ *
+ *   start[]   a set bit for every granule a block starts on
+ *   alloc[]   a set bit for every block start that is allocated
+ *   maxfree   the largest free block starting in the page, in granules
+ *
+ * and, for every group of 64 pages, the largest maxfree in grp_max and
+ * a bit per page that holds any block start in grp_starts. A
+ * block's size is the distance to the next start bit and its neighbours
+ * are the start bits either side, so freeing and coalescing only flip
+ * bits. A fit search walks grp_max, then maxfree, then one page's
+ * bitmaps: first fit in address order, without a load from any payload
+ * page. Free blocks coalesce right away. An aligned block leaves the
+ * granules in front of it as a free block of any size, there being no
+ * header to make room for.
+ *
+ * The metadata is 2 bits per granule and 8 bytes per page, about 3%,
+ * where mm.c spends a 4 byte header per block. Requests round up to 8
+ * bytes with nothing added, a payload overrun cannot corrupt the heap,
+ * and searches stay on a few dense cache lines. The price is a bit scan
+ * for every size, which grp_starts keeps short across big blocks.
+ *
+ * make mdriver-oob builds the driver against this file instead of mm.c.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/single_threaded.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "config.h" /* MAX_HEAP, the size of a memlib region */
+
+/* do not change the following! */
+#ifdef DRIVER
+/* create aliases for driver tests */
+#define malloc mm_malloc
+#define free mm_free
+#define realloc mm_realloc
+#define calloc mm_calloc
+#define memalign mm_memalign
+#define aligned_alloc mm_aligned_alloc
+#define malloc_usable_size mm_usable_size
+#define free_sized mm_free_sized
+#endif /* def DRIVER */
+
+/* single word (4) or double word (8) alignment */
+#define ALIGNMENT 8
+
+#define GRAIN_SHIFT 3                        /* log2 of ALIGNMENT */
+#define PAGE_BYTES  4096                     /* heap bytes per page_t */
+#define PAGE_GRAINS (PAGE_BYTES >> GRAIN_SHIFT)
+#define PAGE_WORDS  (PAGE_GRAINS / 64)
+#define GROUP       64                       /* pages per grp_max entry */
+#define GROUPS      (MAX_HEAP / PAGE_BYTES / GROUP + 1)
+#define CHUNKSIZE   (1<<8)                   /* least bytes the heap grows by */
+#define NIL         ((size_t)-1)             /* no granule */
+
+#define BIT(g) (1UL << ((g) % 64))
+
+/* the metadata of one page of heap */
+typedef struct {
+    unsigned long start[PAGE_WORDS]; /* set bit = a block starts here */
+    unsigned long alloc[PAGE_WORDS]; /* set bit = that block is allocated */
+    unsigned maxfree;        /* largest free block starting here, granules */
+    unsigned pad;
+} page_t;
+
+static char *heap_lo;        /* granule 0 */
+static page_t *pages;        /* metadata, region 1 */
+static size_t npages;        /* pages with metadata */
+static size_t top;           /* granules in the heap */
+static unsigned grp_max[GROUPS]; /* largest maxfree per group of pages */
+static unsigned long grp_starts[GROUPS]; /* set bit = a block starts in that page */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long searches;   /* find_fit calls, for mm_profile */
+static unsigned long search_steps; /* pages they looked at */
+
+static size_t find_fit(size_t n);
+static size_t find_aligned_fit(size_t n, size_t align, size_t *at);
+static size_t aligned_granule(size_t g, size_t align);
+static size_t extend_heap(size_t n);
+static int grow_meta(size_t grains);
+static void place(size_t g, size_t n);
+static void free_block(size_t g);
+static void note_free(size_t g, size_t size);
+static void note_taken(size_t g, size_t size);
+static void recount(size_t pg);
+
+/*
+ * Bitmap access, by granule or by word of either map
+ */
+static inline unsigned long *start_word(size_t w) {
+    return &pages[w / PAGE_WORDS].start[w % PAGE_WORDS];
+}
+
+static inline unsigned long *alloc_word(size_t w) {
+    return &pages[w / PAGE_WORDS].alloc[w % PAGE_WORDS];
+}
+
+static inline int is_alloc(size_t g) {
+    return (*alloc_word(g / 64) & BIT(g)) != 0;
+}
+
+static inline size_t page_of(size_t g) { return g / PAGE_GRAINS; }
+
+static inline void set_start(size_t g) {
+    *start_word(g / 64) |= BIT(g);
+    grp_starts[page_of(g) / GROUP] |= BIT(page_of(g));
+}
+
+static inline void clear_start(size_t g) {
+    size_t pg = page_of(g), w;
+    unsigned long any = 0;
+
+    *start_word(g / 64) &= ~BIT(g);
+    for (w = 0; w < PAGE_WORDS; w++)
+        any |= pages[pg].start[w];
+    if (!any)
+        grp_starts[pg / GROUP] &= ~BIT(pg);
+}
+
+static inline void set_alloc(size_t g)   { *alloc_word(g / 64) |= BIT(g); }
+static inline void clear_alloc(size_t g) { *alloc_word(g / 64) &= ~BIT(g); }
+
+/*
+ * next_start - the block start after granule g, or top. Pages with no
+ * start are skipped through grp_starts, so big blocks cost little more.
+ */
+static inline size_t next_start(size_t g) {
+    size_t w, pg;
+    unsigned long bits;
+
+    if (++g >= top)
+        return top;
+    w = g / 64;
+    for (bits = *start_word(w) & (~0UL << (g % 64)); !bits; bits = *start_word(w))
+        if (++w % PAGE_WORDS == 0)
+            break;
+    if (!bits) {
+        pg = w / PAGE_WORDS;
+        for (bits = grp_starts[pg / GROUP] & (~0UL << (pg % GROUP)); !bits;
+             bits = grp_starts[pg / GROUP])
+            if ((pg = (pg / GROUP + 1) * GROUP) >= npages)
+                return top;
+        w = (pg / GROUP * GROUP + __builtin_ctzl(bits)) * PAGE_WORDS;
+        while (!(bits = *start_word(w)))
+            w++;
+    }
+    g = w * 64 + __builtin_ctzl(bits);
+    return g < top ? g : top;
+}
+
+/* prev_start - the start of the block granule g - 1 is in, g > 0 */
+static inline size_t prev_start(size_t g) {
+    size_t w = --g / 64, pg;
+    unsigned long bits;
+
+    for (bits = *start_word(w) & (~0UL >> (63 - g % 64)); !bits; bits = *start_word(w))
+        if (w-- % PAGE_WORDS == 0)
+            break;
+    if (!bits) {
+        /* granule 0 always starts a block, so one comes */
+        pg = page_of(g) - 1;
+        for (bits = grp_starts[pg / GROUP] & (~0UL >> (63 - pg % GROUP)); !bits;
+             bits = grp_starts[pg / GROUP])
+            pg = pg / GROUP * GROUP - 1;
+        w = (pg / GROUP * GROUP + 63 - __builtin_clzl(bits) + 1) * PAGE_WORDS - 1;
+        while (!(bits = *start_word(w)))
+            w--;
+    }
+    return w * 64 + 63 - __builtin_clzl(bits);
+}
+
+static inline size_t block_size(size_t g) {
+    return next_start(g) - g;
+}
+
+static inline void lock_heap(void) {
+    if (!__libc_single_threaded)
+        pthread_mutex_lock(&lock);
+}
+
+static inline void unlock_heap(void) {
+    if (!__libc_single_threaded)
+        pthread_mutex_unlock(&lock);
+}
+
+/*
+ * mm_init - Called when a new trace starts: an empty heap in region 0
+ * and no metadata yet in region 1.
+ */
+int mm_init(void) {
+    heap_lo = mem_sbrk(0);
+    pages = mem_region_sbrk(1, 0);
+    if (heap_lo == (void *)-1 || pages == (void *)-1)
+        return -1;
+    npages = top = 0;
+    memset(grp_max, 0, sizeof(grp_max));
+    memset(grp_starts, 0, sizeof(grp_starts));
+    searches = search_steps = 0;
+    return 0;
+}
+
+/*
+ * mm_deferred - blocks always coalesce right away here; coalescing is
+ * a few bit flips, with no list to batch the work of
+ */
+void mm_deferred(int on) {
+    (void)on;
+}
+
+/*
+ * malloc - first fit from the bottom of the heap, or fresh granules
+ */
+void *malloc(size_t size) {
+    size_t n, g;
+
+    if (heap_lo == NULL)
+        mm_init();
+    if (size == 0 || size > MAX_HEAP)
+        return NULL;
+    n = (size + ALIGNMENT - 1) >> GRAIN_SHIFT;
+
+    lock_heap();
+    if ((g = find_fit(n)) == NIL && (g = extend_heap(n)) == NIL) {
+        unlock_heap();
+        return NULL;
+    }
+    place(g, n);
+    unlock_heap();
+    return heap_lo + (g << GRAIN_SHIFT);
+}
+
+/*
+ * free - clear the alloc bit and merge with free neighbours
+ */
+void free(void *ptr) {
+    size_t g;
+
+    if (ptr == NULL)
+        return;
+    g = ((char *)ptr - heap_lo) >> GRAIN_SHIFT;
+    lock_heap();
+    clear_alloc(g);
+    free_block(g);
+    unlock_heap();
+}
+
+/*
+ * memalign - first fit for a block starting on an alignment boundary,
+ * a power of two, split out of the middle of a free block if need be
+ */
+void *memalign(size_t alignment, size_t size) {
+    size_t n, g, at, old;
+
+    if (alignment & (alignment - 1))
+        return NULL;
+    if (alignment <= ALIGNMENT)
+        return malloc(size);
+    if (heap_lo == NULL)
+        mm_init();
+    if (size == 0 || size > MAX_HEAP || alignment > MAX_HEAP)
+        return NULL;
+    n = (size + ALIGNMENT - 1) >> GRAIN_SHIFT;
+
+    lock_heap();
+    if ((g = find_aligned_fit(n, alignment, &at)) == NIL) {
+        /* where extend_heap's block will start */
+        if (!top || is_alloc(g = prev_start(top)))
+            g = top;
+        at = aligned_granule(g, alignment);
+        if (extend_heap(at - g + n) == NIL) {
+            unlock_heap();
+            return NULL;
+        }
+    }
+    if (at > g) {
+        old = block_size(g);
+        set_start(at);
+        place(at, n);
+        note_taken(g, old);
+    } else {
+        place(g, n);
+    }
+    unlock_heap();
+    return heap_lo + (at << GRAIN_SHIFT);
+}
+
+/*
+ * aligned_alloc - C11's memalign, size need not be a multiple
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+/*
+ * malloc_usable_size - the granules up to the next block start
+ */
+size_t malloc_usable_size(void *ptr) {
+    size_t size;
+
+    if (ptr == NULL)
+        return 0;
+    lock_heap();
+    size = block_size(((char *)ptr - heap_lo) >> GRAIN_SHIFT) << GRAIN_SHIFT;
+    unlock_heap();
+    return size;
+}
+
+/*
+ * free_sized - the size buys nothing here, there is no header to skip
+ */
+void free_sized(void *ptr, size_t size) {
+    (void)size;
+    free(ptr);
+}
+
+/*
+ * realloc - shrink in place, grow into a free next block or past the
+ * top of the heap, and only then move
+ */
+void *realloc(void *oldptr, size_t size) {
+    size_t g, n, cur, next, total, bytes;
+    void *newptr;
+
+    if (size == 0) {
+        free(oldptr);
+        return NULL;
+    }
+    if (oldptr == NULL)
+        return malloc(size);
+    if (size > MAX_HEAP)
+        return NULL;
+
+    g = ((char *)oldptr - heap_lo) >> GRAIN_SHIFT;
+    n = (size + ALIGNMENT - 1) >> GRAIN_SHIFT;
+    lock_heap();
+    cur = block_size(g);
+    next = g + cur;
+
+    if (n <= cur) {
+        if (n < cur) {
+            set_start(g + n);
+            free_block(g + n);
+        }
+        unlock_heap();
+        return oldptr;
+    }
+
+    if (next < top && !is_alloc(next) && cur + block_size(next) >= n) {
+        /* what follows a free block is allocated, nothing to merge */
+        total = cur + block_size(next);
+        clear_start(next);
+        note_taken(next, total - cur);
+        if (total > n) {
+            set_start(g + n);
+            note_free(g + n, total - n);
+        }
+        unlock_heap();
+        return oldptr;
+    }
+
+    if (next == top) {
+        bytes = (n - cur) << GRAIN_SHIFT;
+        if (bytes < CHUNKSIZE)
+            bytes = CHUNKSIZE;
+        if (grow_meta(top + (bytes >> GRAIN_SHIFT)) == 0 &&
+            mem_sbrk(bytes) != (void *)-1) {
+            top += bytes >> GRAIN_SHIFT;
+            if (g + n < top) {
+                set_start(g + n);
+                note_free(g + n, top - g - n);
+            }
+            unlock_heap();
+            return oldptr;
+        }
+    }
+    unlock_heap();
+
+    if ((newptr = malloc(size)) == NULL)
+        return NULL;
+    memcpy(newptr, oldptr, cur << GRAIN_SHIFT);
+    free(oldptr);
+    return newptr;
+}
+
+/*
+ * calloc - Allocate the block and set it to zero.
+ */
+void *calloc(size_t nmemb, size_t size) {
+    size_t bytes;
+    void *newptr;
+
+    if (size && nmemb > (size_t)-1 / size)
+        return NULL;
+    bytes = nmemb * size;
+    if ((newptr = malloc(bytes)) != NULL)
+        memset(newptr, 0, bytes);
+    return newptr;
+}
+
+/*
+ * find_fit - the lowest free block of at least n granules, or NIL
+ */
+static size_t find_fit(size_t n) {
+    size_t q, pg, w, g, ngroups = (npages + GROUP - 1) / GROUP;
+    unsigned long bits;
+
+    searches++;
+    for (q = 0; q < ngroups; q++) {
+        if (grp_max[q] < n)
+            continue;
+        for (pg = q * GROUP; pg < (q + 1) * GROUP && pg < npages; pg++) {
+            search_steps++;
+            if (pages[pg].maxfree < n)
+                continue;
+            for (w = pg * PAGE_WORDS; w < (pg + 1) * PAGE_WORDS; w++) {
+                bits = *start_word(w) & ~*alloc_word(w);
+                for (; bits; bits &= bits - 1) {
+                    g = w * 64 + __builtin_ctzl(bits);
+                    if (block_size(g) >= n)
+                        return g;
+                }
+            }
+        }
+    }
+    return NIL;
+}
+
+/*
+ * find_aligned_fit - the lowest free block with n granules from an
+ * align boundary on, or NIL; *at is set to that boundary's granule
+ */
+static size_t find_aligned_fit(size_t n, size_t align, size_t *at) {
+    size_t q, pg, w, g, ngroups = (npages + GROUP - 1) / GROUP;
+    unsigned long bits;
+
+    searches++;
+    for (q = 0; q < ngroups; q++) {
+        if (grp_max[q] < n)
+            continue;
+        for (pg = q * GROUP; pg < (q + 1) * GROUP && pg < npages; pg++) {
+            search_steps++;
+            if (pages[pg].maxfree < n)
+                continue;
+            for (w = pg * PAGE_WORDS; w < (pg + 1) * PAGE_WORDS; w++) {
+                bits = *start_word(w) & ~*alloc_word(w);
+                for (; bits; bits &= bits - 1) {
+                    g = w * 64 + __builtin_ctzl(bits);
+                    *at = aligned_granule(g, align);
+                    if (*at - g + n <= block_size(g))
+                        return g;
+                }
+            }
+        }
+    }
+    return NIL;
+}
+
+/* aligned_granule - the first granule from g on whose address is aligned */
+static size_t aligned_granule(size_t g, size_t align) {
+    size_t addr = (size_t)heap_lo + (g << GRAIN_SHIFT);
+
+    return g + ((-addr & (align - 1)) >> GRAIN_SHIFT);
+}
+
+/*
+ * extend_heap - grow the heap so a free block of at least n granules
+ * ends it, topping up a free block already there. Returns its start,
+ * or NIL.
+ */
+static size_t extend_heap(size_t n) {
+    size_t g = top, want = n, bytes;
+
+    if (top && !is_alloc(g = prev_start(top)))
+        want = n - (top - g);
+    else
+        g = top;
+    bytes = want << GRAIN_SHIFT;
+    if (bytes < CHUNKSIZE)
+        bytes = CHUNKSIZE;
+
+    if (grow_meta(top + (bytes >> GRAIN_SHIFT)) < 0 ||
+        mem_sbrk(bytes) == (void *)-1)
+        return NIL;
+    if (g == top)
+        set_start(g);
+    top += bytes >> GRAIN_SHIFT;
+    note_free(g, top - g);
+    return g;
+}
+
+/*
+ * grow_meta - have zeroed metadata for the first grains granules. The
+ * region may hold old bits from before mem_reset_brk.
+ */
+static int grow_meta(size_t grains) {
+    size_t want = (grains + PAGE_GRAINS - 1) / PAGE_GRAINS;
+
+    if (want <= npages)
+        return 0;
+    if (mem_region_sbrk(1, (want - npages) * sizeof(page_t)) == (void *)-1)
+        return -1;
+    memset(&pages[npages], 0, (want - npages) * sizeof(page_t));
+    npages = want;
+    return 0;
+}
+
+/*
+ * place - allocate the first n granules of the free block at g
+ */
+static void place(size_t g, size_t n) {
+    size_t size = block_size(g);
+
+    set_alloc(g);
+    if (size > n)
+        set_start(g + n);
+    note_taken(g, size);
+    if (size > n)
+        note_free(g + n, size - n);
+}
+
+/*
+ * free_block - merge the free block starting at g with free neighbours
+ * and bring the pages whose starts changed up to date
+ */
+static void free_block(size_t g) {
+    size_t next = next_start(g), nsize = 0, s = g, p;
+
+    /* flip every bit first, so a recount sees the heap as it will be */
+    if (next < top && !is_alloc(next)) {
+        nsize = next_start(next) - next;
+        clear_start(next);
+    }
+    if (g > 0 && !is_alloc(p = prev_start(g))) {
+        clear_start(g);
+        s = p;
+    }
+    if (nsize)
+        note_taken(next, nsize);
+    note_free(s, block_size(s));
+}
+
+/*
+ * note_free - the free block at g is now size granules long, which
+ * can only raise its page's maxfree
+ */
+static void note_free(size_t g, size_t size) {
+    size_t pg = page_of(g);
+    unsigned n = size > UINT_MAX ? UINT_MAX : size;
+
+    if (n > pages[pg].maxfree) {
+        pages[pg].maxfree = n;
+        if (n > grp_max[pg / GROUP])
+            grp_max[pg / GROUP] = n;
+    }
+}
+
+/*
+ * note_taken - the free block of size granules at g was allocated or
+ * merged away. Its page needs a recount only if it was the largest.
+ */
+static void note_taken(size_t g, size_t size) {
+    if (size >= pages[page_of(g)].maxfree)
+        recount(page_of(g));
+}
+
+/*
+ * recount - find the largest free block starting in page pg again, and
+ * pass it on to the page's group
+ */
+static void recount(size_t pg) {
+    size_t w, g, size, q = pg / GROUP;
+    unsigned old = pages[pg].maxfree, best = 0;
+    unsigned long bits;
+
+    for (w = pg * PAGE_WORDS; w < (pg + 1) * PAGE_WORDS; w++)
+        for (bits = *start_word(w) & ~*alloc_word(w); bits; bits &= bits - 1) {
+            g = w * 64 + __builtin_ctzl(bits);
+            if ((size = block_size(g)) > best)
+                best = size > UINT_MAX ? UINT_MAX : size;
+        }
+    pages[pg].maxfree = best;
+
+    if (best >= grp_max[q]) {
+        grp_max[q] = best;
+    } else if (old == grp_max[q]) {
+        /* this page may have been the group's largest */
+        for (best = 0, pg = q * GROUP; pg < (q + 1) * GROUP && pg < npages; pg++)
+            if (pages[pg].maxfree > best)
+                best = pages[pg].maxfree;
+        grp_max[q] = best;
+    }
+}
+
+/*
+ * mm_profile - walk the blocks through the start bitmap
+ */
+void mm_profile(mm_profile_t *prof) {
+    size_t g, size;
+    int cls;
+
+    memset(prof, 0, sizeof(*prof));
+    lock_heap();
+    for (g = 0; g < top; g += size) {
+        size = block_size(g);
+        if (is_alloc(g)) {
+            prof->alloc_bytes += size << GRAIN_SHIFT;
+            continue;
+        }
+        prof->free_bytes += size << GRAIN_SHIFT;
+        if (size << GRAIN_SHIFT > prof->largest_free)
+            prof->largest_free = size << GRAIN_SHIFT;
+        prof->nfree++;
+        cls = 63 - __builtin_clzl(size << GRAIN_SHIFT) - 4;
+        prof->free_hist[cls < 0 ? 0 : cls < MM_PROF_CLASSES ? cls : MM_PROF_CLASSES - 1]++;
+    }
+    prof->heap_bytes = top << GRAIN_SHIFT;
+    if (prof->free_bytes)
+        prof->frag = 1 - (double)prof->largest_free / prof->free_bytes;
+    prof->searches = searches;
+    prof->search_steps = search_steps;
+    unlock_heap();
+}
+
+/*
+ * mm_checkheap - the bitmaps agree with each other, no two free blocks
+ * touch, and maxfree, grp_max and grp_starts say what the bitmaps say
+ */
+void mm_checkheap(int verbose) {
+    size_t g, size, w, pg = 0, q;
+    unsigned best = 0, grp = 0;
+    unsigned long any = 0;
+    int prev_free = 0;
+
+    if (top && !(*start_word(0) & 1))
+        printf("Error: granule 0 starts no block\n");
+    for (w = 0; w < npages * PAGE_WORDS; w++) {
+        if (*alloc_word(w) & ~*start_word(w))
+            printf("Error: alloc bits off block starts in word %zu\n", w);
+        if (w * 64 + 64 > top &&
+            *start_word(w) & (top > w * 64 ? ~0UL << (top - w * 64) : ~0UL))
+            printf("Error: block starts past the top in word %zu\n", w);
+        any |= *start_word(w);
+        if ((w + 1) % PAGE_WORDS == 0) {
+            pg = w / PAGE_WORDS;
+            if (!any != !(grp_starts[pg / GROUP] & BIT(pg)))
+                printf("Error: grp_starts wrong for page %zu\n", pg);
+            any = 0;
+        }
+    }
+    pg = 0;
+
+    /* blocks come in address order, so pages and groups close in order */
+    for (g = 0; g <= top; g += size) {
+        while (pg < npages && (g == top || page_of(g) > pg)) {
+            if (pages[pg].maxfree != best)
+                printf("Error: page %zu maxfree %u, should be %u\n",
+                       pg, pages[pg].maxfree, best);
+            grp = best > grp ? best : grp;
+            best = 0;
+            if (++pg % GROUP == 0 || pg == npages) {
+                q = (pg - 1) / GROUP;
+                if (grp_max[q] != grp)
+                    printf("Error: group %zu max %u, should be %u\n",
+                           q, grp_max[q], grp);
+                grp = 0;
+            }
+        }
+        if (g == top)
+            break;
+        size = block_size(g);
+        if (verbose)
+            printf("%p: %zu bytes %s\n", heap_lo + (g << GRAIN_SHIFT),
+                   size << GRAIN_SHIFT, is_alloc(g) ? "allocated" : "free");
+        if (!is_alloc(g) && prev_free)
+            printf("Error: free blocks touch at %p\n", heap_lo + (g << GRAIN_SHIFT));
+        prev_free = !is_alloc(g);
+        if (prev_free && size > best)
+            best = size > UINT_MAX ? UINT_MAX : size;
+    }
+}
@@ -4,15 +4,17 @@
  * 64 bit memory allocator. 
  *
  * General Idea: 
- * Segregated free list. 
+ * Segregated free list, two level (TLSF) index. 
  * Boundary tag coalescing.
- * First fit.
+ * Good fit in O(1).
  * 
  * Specific optimization: 
  * 1. Minimum block size
  *    Minimum block size is 4 bytes. I use 4 byte header and footer. Allocated 
- *    blocks has no footer. We store the offset to heap_listp for forward and 
- *    backward free pointers. 
+ *    blocks has no footer. We store forward and backward free pointers as
+ *    32-bit offsets from the arena base in 8 byte units, so one arena can
+ *    grow to 32 GB (make BIG_HEAP=1) while a block is still sized by its
+ *    4 byte header, under 4 GB.
  * 
  *    For allocated block, the format is as follows:
  *    | 4 byte heade r|        payload         |     padding(optional)  | 
@@ -27,16 +29,92 @@
  * 3. Less macro
  *    Macro is evil for debugging and alomost everything. So we choose static inline
  *    function instead.
- * 
+ *
+ * 4. Threads
+ *    The heap is split into arenas, one per cpu up to MEM_REGIONS, each with
+ *    its own free list table, tail and memlib region, guarded by its own
+ *    lock. Locks are only taken once the process has gone multi-threaded,
+ *    so the single threaded driver pays nothing and only ever uses arena 0.
+ *    A thread binds to the arena of the cpu it first allocates on. Blocks
+ *    always go back to the arena whose region they lie in: a thread freeing
+ *    another arena's block pushes it on that arena's lock-free remote stack,
+ *    which the owner drains the next time it allocates.
+ *
+ *    In front of the arenas every thread keeps a small cache of blocks per
+ *    size class (up to TCACHE_MAX bytes). Cached blocks stay marked
+ *    allocated; a miss refills TCACHE_BATCH blocks under one lock round
+ *    trip and a full bin hands TCACHE_BATCH back the same way.
+ *
+ * 5. Slabs
+ *    Requests of at most SLAB_MAX bytes are carved out of runs, ordinary
+ *    allocated blocks of SLAB_RUN bytes whose payload is page aligned and
+ *    holds objects of one size class (multiple of 8). The arena keeps a
+ *    bitmap of the pages that are runs, so whether a pointer is a slab
+ *    object is a bit test and its run is found by masking; objects carry
+ *    no header at all. A run starts with a bitmap of its free slots, so
+ *    allocation is a find first set over at most SLAB_MAPW words. A run
+ *    that empties out goes back to the heap and coalesces like any block.
+ *    Runs only start once the arena has grown past SLAB_HEAP: a partial
+ *    run per class costs more than it saves in a small heap, and since
+ *    runs never serve another class they hold on to memory the heap
+ *    would have coalesced. Small requests whose header fits in the
+ *    alignment padding anyway stay in the heap for the same reason.
+ *
+ * 6. Large blocks
+ *    Requests of MMAP_MIN bytes or more get pages of their own from
+ *    mem_map, with the usual 4 byte header in front, and free hands the
+ *    pages straight back (the mapping starts at the header's page), so
+ *    a large transient block does not leave a hole in the heap for good.
+ *    Free blocks of RELEASE_MIN bytes or more that are still free when
+ *    an arena looks (every RELEASE_EVERY frees) keep their boundary tags
+ *    and links but give their pages back with mem_release; they fault in
+ *    again as zeros when used. The header bit RELEASED spares them later
+ *    looks; it goes with any change of size and when the block is used.
+ *
+ * 7. Deferred coalescing
+ *    Optional (mm_deferred), like dlmalloc's fastbins: a freed block of
+ *    at most QUICK_MAX bytes stays marked allocated and goes on a quick
+ *    list of its exact size, where the next malloc of that size finds it
+ *    without touching the free lists. All quick blocks are coalesced in
+ *    one go when a fit search fails or QUICK_LIMIT of them pile up.
+ *
+ * 8. Aligned blocks
+ *    memalign looks for a free block with room for the request past its
+ *    first aligned spot, or grows the heap by just enough. The gap in
+ *    front is freed again and the tail split off as usual, so an aligned
+ *    block is an ordinary block and costs no padding. free_sized uses
+ *    the caller's size where the header would only have told us the
+ *    same: a mapped block's length and a cached block's bin.
+ *
+ * 9. Zeroed memory
+ *    Mapped pages always come zeroed, so a mapped calloc costs nothing
+ *    extra. In the heap, each arena keeps zero_lo: from there up to the
+ *    epilogue nothing has ever been handed out, and apart from the tags
+ *    of the tail block everything reads zero. Heap growth that memlib
+ *    says is fresh (mem_clean) carries the zone on, any other growth
+ *    starts it over past the dirty part; releasing the pages of the tail
+ *    block pulls it back down. place moves it up past every block it
+ *    hands out, so calloc only clears what lies below the mark and the
+ *    tags the block had while free.
+ *
  */
+#define _GNU_SOURCE /* sched_getcpu */
 #include <assert.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/single_threaded.h>
 
 #include "mm.h"
+#include "mmlayout.h" /* what mmtune.c models: classes, runs */
 #include "memlib.h"
+#include "config.h" /* MAX_HEAP, the size of an arena region */
+#ifdef MM_CONFIG
+#include MM_CONFIG /* tuned SL_BITS, CHUNKSIZE and SLAB_MAX, see mmtune.c */
+#endif
 /*************************************
  * Constants and Helpers
  ************************************/
@@ -47,63 +125,187 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define aligned_alloc mm_aligned_alloc
+#define malloc_usable_size mm_usable_size
+#define free_sized mm_free_sized
 #endif /* def DRIVER */
 
-/* single word (4) or double word (8) alignment */
-#define ALIGNMENT 8
-
 /* minimum allocated block is 4 words */
 #define MINSIZE 2
 
-/* number of levels of segregated list */ 
-#define SEG_LEVLL 16
+/*
+ * Two level segregated fit. A size maps to first level fl = log2(size)
+ * and second level sl = the next SL_BITS bits below the top one. Every
+ * (fl, sl) class has its own unordered list, and a bitmap per level says
+ * which lists are non-empty, so finding a class that must fit is two
+ * find-first-set operations. The index lives at the start of the arena:
+ * | fl bitmap(4) | sl bitmaps(4 * FL_COUNT) | heads(4 * FL_COUNT * SL_COUNT) |
+ * and heads are 32-bit offsets from the arena base in ALIGNMENT units,
+ * like the free list links (NIL for an empty list).
+ */
+#ifndef SL_BITS
+#define SL_BITS   2
+#endif
+#define SL_COUNT  (1 << SL_BITS)
+#define TBL_SIZE  ALIGN(4 * (1 + FL_COUNT + FL_COUNT * SL_COUNT))
 
 /* Basic constants and macros */
 #define WSIZE       8       /* Word and header/footer size (bytes) */
 #define DSIZE       16      /* Doubleword size (bytes) */
+#ifndef CHUNKSIZE
 #define CHUNKSIZE  (1<<8)   /* Extend heap by this amount (bytes) */
+#endif
 
 /* rounds up to the nearest multiple of ALIGNMENT */
 #define ALIGN(p) (((size_t)(p) + (ALIGNMENT-1)) & ~0x7)
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))  
+#define MIN(x, y) ((x) < (y)? (x) : (y))
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)  ((size) | (alloc))
  /* also pack whether previous block is free */
 #define PACK3(size, prev_free, alloc)  ((size) | (prev_free) | (alloc)) 
+ /* header bit of a free block whose pages release_free gave back */
+#define RELEASED 0x4
+
+/* Thread cache */
+#define TCACHE_MAX   256 /* largest usable size (bytes) kept per thread */
+#define TCACHE_BINS  (TCACHE_MAX / ALIGNMENT)
+#define TCACHE_FILL  32  /* max blocks in one bin */
+#define TCACHE_BATCH 16  /* blocks moved per refill or flush */
+
+/* Slabs */
+#ifndef SLAB_MAX
+#define SLAB_MAX     128  /* largest request served from a run */
+#endif
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)
+#define RUN_PAGES    (MAX_HEAP / SLAB_RUN)
+
+/* a 4 byte header sizes blocks up to this, page aligned for map_alloc;
+ * the heap as a whole can be bigger, see MAX_HEAP and NIL */
+#define BLOCK_MAX     0xfffff000UL
+#define NIL           0xffffffffu  /* free list offset of no block */
+
+/* Large blocks */
+#define MMAP_MIN      (128<<10)  /* requests from here on get their own pages */
+#define RELEASE_MIN   (256<<10) /* free blocks from here on lose their pages */
+#define RELEASE_EVERY 1024      /* frees between looks for such blocks */
+
+/* Deferred coalescing */
+#define QUICK_MAX    128 /* largest block size put on a quick list */
+#define QUICK_BINS   ((QUICK_MAX - MINSIZE * WSIZE) / ALIGNMENT + 1)
+#define QUICK_LIMIT  256 /* quick blocks per arena before all coalesce */
+
+/* One heap, living in its own memlib region */
+typedef struct {
+    char *heap_listp;        /* Pointer to first block */
+    char *flist_tbl;         /* Pointer to free list table, base of list offsets */
+    char *heap_tailp;        /* Pointer to last block(except epilogue) */
+    int region;              /* memlib region backing this arena */
+    pthread_mutex_t lock;
+    char *remote;            /* blocks freed by other threads, lock-free stack */
+    run_t *partial[SLAB_CLASSES]; /* runs with a free slot, per class */
+    unsigned long runs[RUN_PAGES / 64]; /* set bit = page holds a run */
+    size_t runs_top;         /* runs[] words from here on are all clear */
+    unsigned frees;          /* counts up to the next release_free */
+    char *zero_lo;           /* reads zero from here on, see 9. above */
+    char *zero_was;          /* zero_lo before the last place, for calloc */
+    char *quick[QUICK_BINS]; /* freed, not yet coalesced, by exact size */
+    int nquick;
+    unsigned long searches;  /* find_fit calls, for mm_profile */
+    unsigned long search_steps; /* free blocks looked at by them */
+    unsigned long inserts;   /* insert_node calls */
+} arena_t;
+
+typedef struct {
+    unsigned gen;            /* heap generation these blocks belong to */
+    arena_t *arena;          /* arena this thread allocates from */
+    int count[TCACHE_BINS];
+    char *bin[TCACHE_BINS];  /* singly linked through the payload */
+} tcache_t;
 
 /* Global variables */
-static char *heap_listp = 0;      /* Pointer to first block */  
-static char *flist_tbl = NULL;    /* Pointer to free list table */
-static char *heap_tailp = NULL;   /* Pointer to last block(except epilogue) */
+static arena_t arenas[MEM_REGIONS];
+static int narenas = 1;           /* arenas in use, one per cpu */
+static unsigned heap_gen = 0;     /* bumped by mm_init, stale caches are dropped */
+static int deferred = 0;          /* quick lists in use, see mm_deferred */
+static int deferred_next = 0;     /* ... from the next mm_init on */
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;  /* only for its destructor, flushes on exit */
+static pthread_once_t mm_once = PTHREAD_ONCE_INIT;
 
 /* Function prototypes for internal helper routines */
-static void *extend_heap(size_t words);
-static void place(void *bp, size_t asize);
-static void *find_fit(size_t asize);
-static void *coalesce(void *bp);
-static void printblock(void *bp); 
+static void *malloc_locked(arena_t *a, size_t size);
+static void *memalign_locked(arena_t *a, size_t align, size_t size);
+static void free_hinted(void *bp, size_t size);
+static void free_locked(arena_t *a, void *bp);
+static void free_block(arena_t *a, void *bp);
+static void quick_flush(arena_t *a);
+static int resize_locked(arena_t *a, void *bp, size_t size);
+static int arena_init(arena_t *a);
+static inline arena_t *arena_of(void *bp); /* arena owning a block */
+static inline int lock_arena(arena_t *a);
+static inline void unlock_arena(arena_t *a, int locked);
+static void remote_push(arena_t *a, void *bp);
+static void remote_drain(arena_t *a);
+static void mm_once_init(void);
+static tcache_t *tcache_self(void);
+static void *tcache_get(size_t size);
+static int tcache_put(void *bp, size_t usable);
+static void tcache_flush(tcache_t *tc, int bin, int n);
+static void tcache_destroy(void *p);
+static void *slab_alloc(arena_t *a, size_t size);
+static void slab_free(arena_t *a, void *bp);
+static run_t *run_new(arena_t *a, int cls);
+static inline int is_slab(arena_t *a, const void *bp);
+static inline run_t *run_of(const void *bp);
+static inline void mark_run(arena_t *a, run_t *r, int on);
+static inline size_t usable_size(arena_t *a, void *bp); /* payload bytes of a block */
+static inline size_t sized_usable(arena_t *a, void *bp, size_t size);
+static void *map_alloc(size_t size, size_t align);
+static void map_free(void *bp, size_t size);
+static inline int is_mapped(const void *bp);
+static inline char *map_start(const void *bp); /* first page of a mapped block */
+static inline size_t map_usable(void *bp);
+static void release_free(arena_t *a);
+static void release_tail(arena_t *a);
+static void zero_stale(arena_t *a, char *lo, char *hi);
+static void calloc_fill(void *bp, size_t size, char *zero);
+static void *extend_heap(arena_t *a, size_t words);
+static void place(arena_t *a, void *bp, size_t asize);
+static void *find_fit(arena_t *a, size_t asize);
+static void *find_aligned_fit(arena_t *a, size_t asize, size_t align, size_t *gap);
+static inline size_t align_gap(const void *bp, size_t align);
+static void *coalesce(arena_t *a, void *bp);
+static void printblock(arena_t *a, void *bp); 
 static int checkblock(void *bp);
-static inline void mm_checkfreetbl();
-static inline void init_free_list(); /* intialize free list index table  */
-
-static inline char** get_head(int level); /* get pointer to free list table entry, head */
-static inline char** get_tail(int level); /* get pointer to free list table entry, tail */
-static inline void* prev_free(void * bp); /* previous free block */
-static inline void* next_free(void * bp); /* next free block */
-static inline void set_prev_free(void * bp, char * p); /* set previous free block pointer */
-static inline void set_next_free(void * bp, char * p); /* set next free block pointer */
-static inline void insert_node(int level, void * bp);  /* insert free block into list */
-static inline void delete_node(int level, void * bp);  /* delete free block into list */
+static void mm_checkarena(arena_t *a, int verbose);
+static void mm_checkslabs(arena_t *a);
+static inline void mm_checkfreetbl(arena_t *a);
+static inline void init_free_list(arena_t *a); /* intialize free list index table  */
+
+static inline unsigned *get_head(arena_t *a, int fl, int sl); /* get pointer to free list table entry, head */
+static inline unsigned to_off(arena_t *a, const char *p); /* block pointer to list offset */
+static inline char *from_off(arena_t *a, unsigned off); /* list offset to block pointer */
+static inline unsigned* fl_map(arena_t *a); /* bitmap of non-empty first levels */
+static inline unsigned* sl_map(arena_t *a, int fl); /* bitmap of non-empty lists in a level */
+static inline void* prev_free(arena_t *a, void * bp); /* previous free block */
+static inline void* next_free(arena_t *a, void * bp); /* next free block */
+static inline void set_prev_free(arena_t *a, void * bp, char * p); /* set previous free block pointer */
+static inline void set_next_free(arena_t *a, void * bp, char * p); /* set next free block pointer */
+static inline void insert_node(arena_t *a, void * bp);  /* insert free block into list */
+static inline void delete_node(arena_t *a, void * bp);  /* delete free block into list */
 
 static inline int in_heap(const void *p);
-static inline int get_level(size_t s);
+static inline void get_class(size_t s, int *fl, int *sl);
 
 static inline int IS_VALID(size_t s);
 static inline unsigned GET(void * p); /* Read and write a word at address p */
 static inline void PUT(void * p, unsigned val);
 static inline unsigned GET_SIZE(void * p); /* Read the size and allocated fields from address p */
+static inline unsigned LOAD_SIZE(void * p); /* GET_SIZE without the arena lock */
 static inline void SET_SIZE(void * hp, size_t s);
 static inline void MARK_FREE(void * hp); /* mark block as free */
 static inline void MARK_ALLOC(void * hp); /* mark block as allocated */
@@ -123,21 +325,70 @@ static inline int IS_PREV_ALLOC(void * hp); /* whether previous block is free */
  * Initialize: return -1 on error, 0 on success.
  */
 int mm_init(void) {
+    int i;
+
+    pthread_once(&mm_once, mm_once_init);
+
+    /* every thread cache now points into the old heap */
+    heap_gen++;
+    deferred = deferred_next;
+
+    narenas = sysconf(_SC_NPROCESSORS_CONF);
+    if (narenas < 1)
+        narenas = 1;
+    if (narenas > MEM_REGIONS)
+        narenas = MEM_REGIONS;
+    for (i = 0; i < MEM_REGIONS; i++) {
+        arenas[i].heap_listp = NULL;
+        arenas[i].flist_tbl = NULL;
+        arenas[i].heap_tailp = NULL;
+        arenas[i].region = i;
+        arenas[i].remote = NULL;
+        memset(arenas[i].partial, 0, sizeof(arenas[i].partial));
+        memset(arenas[i].runs, 0, arenas[i].runs_top * sizeof(unsigned long));
+        arenas[i].runs_top = 0;
+        arenas[i].frees = 0;
+        memset(arenas[i].quick, 0, sizeof(arenas[i].quick));
+        arenas[i].nquick = 0;
+        arenas[i].searches = arenas[i].search_steps = arenas[i].inserts = 0;
+    }
+
+    /* arena 0 now, the others when a thread first binds to them */
+    return arena_init(&arenas[0]);
+}
+
+/*
+ * mm_deferred - turn deferred coalescing on or off, from the next
+ * mm_init on
+ */
+void mm_deferred(int on) {
+    deferred_next = on;
+}
+
+/*
+ * arena_init - create the initial empty heap of an arena in its region.
+ * Return -1 on error, 0 on success.
+ */
+static int arena_init(arena_t *a) {
     /* Create the initial empty heap */
-    if ((heap_listp = mem_sbrk(WSIZE + SEG_LEVLL * DSIZE)) == (void *)-1) 
+    if ((a->heap_listp = mem_region_sbrk(a->region, WSIZE + TBL_SIZE)) == (void *)-1) {
+        a->heap_listp = NULL;
         return -1;
-    flist_tbl = heap_listp;
-    init_free_list();
-    int table_off = 2 * SEG_LEVLL * WSIZE;
-    PUT(heap_listp + table_off, PACK(4, 1));     /* Prologue header */ 
-    PUT(heap_listp + table_off + 4, PACK(0, 1));     /* Epilogue header */
-
-    FLAG(heap_listp + table_off);
-    FLAG(heap_listp + table_off + 4);                /* set the alloc FLAG in next block */
-    heap_listp += table_off + 4;
+    }
+    a->flist_tbl = a->heap_listp;
+    init_free_list(a);
+    int table_off = TBL_SIZE;
+    PUT(a->heap_listp + table_off, PACK(4, 1));     /* Prologue header */ 
+    PUT(a->heap_listp + table_off + 4, PACK(0, 1));     /* Epilogue header */
+
+    FLAG(a->heap_listp + table_off);
+    FLAG(a->heap_listp + table_off + 4);                /* set the alloc FLAG in next block */
+    a->heap_listp += table_off + 4;
+    a->heap_tailp = NULL;
+    a->zero_lo = (char *)-1; /* nothing known until extend_heap */
 
     /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-    char *freeb = extend_heap(CHUNKSIZE/WSIZE);
+    char *freeb = extend_heap(a, CHUNKSIZE/WSIZE);
     if (freeb == NULL) {    
         return -1;
     }
@@ -148,27 +399,75 @@ int mm_init(void) {
  * malloc
  */
 void *malloc (size_t size) {
-    size_t asize;      /* Adjusted block size */
-    size_t extendsize; /* Amount to extend heap if no fit */
     char *bp;      
+    arena_t *a;
+    int locked;
 
-    if (heap_listp == 0){
+    if (arenas[0].heap_listp == 0){
         mm_init();
     }
     /* Ignore spurious requests */
-    if (size == 0)
+    if (size == 0 || size > BLOCK_MAX - WSIZE)
         return NULL;
 
+    if (size >= MMAP_MIN && (bp = map_alloc(size, ALIGNMENT)) != NULL)
+        return bp;
+
+    if (__libc_single_threaded) {
+        a = &arenas[0];
+    } else {
+        if (size <= TCACHE_MAX)
+            return tcache_get(size);
+        a = tcache_self()->arena;
+    }
+
+    locked = lock_arena(a);
+    bp = malloc_locked(a, size);
+    unlock_arena(a, locked);
+    return bp;
+}
+
+/*
+ * malloc_locked - the heap side of malloc, a run slot for small sizes
+ * and a block from the free lists for the rest
+ */
+static void *malloc_locked(arena_t *a, size_t size) {
+    size_t asize;      /* Adjusted block size */
+    size_t extendsize; /* Amount to extend heap if no fit */
+    char *bp;      
+
+    if (!a->heap_listp && arena_init(a) < 0)
+        return NULL;
+    if (a->remote)
+        remote_drain(a);
+
     asize = ALIGN(size + 4); /* the overhead is payload + header(4 byte) + padding(optional) */
     asize = MAX(asize, MINSIZE * WSIZE); /* require minimum size */
 
-    /* Search the free list for a fit */
-    if ((bp = find_fit(asize)) != NULL) {  
+    /* a run slot only pays when the header would cost a word of its own */
+    if (size <= SLAB_MAX && ALIGN(size) < asize && (bp = slab_alloc(a, size)) != NULL)
+        return bp;
+
+    if (asize <= QUICK_MAX && a->quick[(asize - MINSIZE * WSIZE) / ALIGNMENT]) {
+        bp = a->quick[(asize - MINSIZE * WSIZE) / ALIGNMENT];
+        a->quick[(asize - MINSIZE * WSIZE) / ALIGNMENT] = *(char **)bp;
+        a->nquick--;
+        return bp;
+    }
+
+    /* Search the free list for a fit, coalescing deferred frees first
+     * if there is none */
+    bp = find_fit(a, asize);
+    if (bp == NULL && a->nquick) {
+        quick_flush(a);
+        bp = find_fit(a, asize);
+    }
+    if (bp != NULL) {  
 #ifdef DEBUG    
         printf("malloc: before alloc.\n");
         mm_checkheap(1);
 #endif            
-        place(bp, asize);                  
+        place(a, bp, asize);                  
 #ifdef DEBUG
         printf("malloc: after alloc.\n");        
         mm_checkheap(1);
@@ -178,15 +477,102 @@ void *malloc (size_t size) {
     }
 
     /* No fit found. Get more memory and place the block */
-    int tail_free = 0; // the free space we have in the tail of heap
-    if (heap_tailp && !GET_ALLOC(HDRP(heap_tailp))) {
-        tail_free = GET_SIZE(HDRP(heap_tailp));
+    size_t tail_free = 0; // the free space we have in the tail of heap
+    if (a->heap_tailp && !GET_ALLOC(HDRP(a->heap_tailp))) {
+        tail_free = GET_SIZE(HDRP(a->heap_tailp));
     }
     extendsize = MAX(asize - tail_free,CHUNKSIZE);
-    bp = extend_heap(extendsize/WSIZE);
+    bp = extend_heap(a, extendsize/WSIZE);
     if (bp == NULL) 
         return NULL;
-    place(bp, asize);
+    place(a, bp, asize);
+    return bp;
+}
+
+/*
+ * memalign - a block whose payload starts on an alignment boundary, a
+ * power of two. Sizes that would be mapped get their own pages, the
+ * rest is cut out of the heap, see memalign_locked.
+ */
+void *memalign(size_t alignment, size_t size) {
+    char *bp;
+    arena_t *a;
+    int locked;
+
+    if (alignment & (alignment - 1))
+        return NULL;
+    if (alignment <= ALIGNMENT)
+        return malloc(size);
+    if (arenas[0].heap_listp == 0){
+        mm_init();
+    }
+    if (size == 0 || size > BLOCK_MAX - WSIZE || alignment > BLOCK_MAX - WSIZE - size)
+        return NULL;
+
+    if (size >= MMAP_MIN && (bp = map_alloc(size, alignment)) != NULL)
+        return bp;
+
+    a = __libc_single_threaded ? &arenas[0] : tcache_self()->arena;
+    locked = lock_arena(a);
+    bp = memalign_locked(a, alignment, size);
+    unlock_arena(a, locked);
+    return bp;
+}
+
+/*
+ * aligned_alloc - C11's memalign. Like glibc we do not insist that
+ * size is a multiple of alignment.
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+/*
+ * memalign_locked - the heap side of memalign. The block comes out of
+ * the first free block with room for it past an aligned spot, or out of
+ * the top of the heap grown by just what is missing there. The gap in
+ * front of it, if any, is freed again.
+ */
+static void *memalign_locked(arena_t *a, size_t align, size_t size) {
+    size_t asize = MAX(ALIGN(size + 4), MINSIZE * WSIZE);
+    size_t gap, tail_free = 0;
+    char *bp;
+
+    if (!a->heap_listp && arena_init(a) < 0)
+        return NULL;
+    if (a->remote)
+        remote_drain(a);
+
+    bp = find_aligned_fit(a, asize, align, &gap);
+    if (bp == NULL && a->nquick) {
+        quick_flush(a);
+        bp = find_aligned_fit(a, asize, align, &gap);
+    }
+    if (bp == NULL) {
+        /* the block would start where the free tail, or the epilogue, is */
+        bp = a->heap_tailp;
+        if (GET_ALLOC(HDRP(bp)))
+            bp = NEXT_BLKP(bp);
+        else
+            tail_free = GET_SIZE(HDRP(bp));
+        gap = align_gap(bp, align);
+        if (gap + asize > tail_free) {
+            if ((bp = extend_heap(a, MAX(gap + asize - tail_free, CHUNKSIZE) / WSIZE)) == NULL)
+                return NULL;
+            /* a tail too big to coalesce with may have stayed apart */
+            gap = align_gap(bp, align);
+            if (gap + asize > GET_SIZE(HDRP(bp)))
+                return NULL;
+        }
+    }
+
+    if (gap) {
+        place(a, bp, gap);
+        place(a, NEXT_BLKP(bp), asize);
+        free_block(a, bp);
+        return bp + gap;
+    }
+    place(a, bp, asize);
     return bp;
 }
 
@@ -194,20 +580,99 @@ void *malloc (size_t size) {
  * free
  */
 void free (void *bp) {
+    free_hinted(bp, 0);
+}
+
+/*
+ * free_sized - free for callers that know the size of the block, either
+ * what they asked for or the usable size
+ */
+void free_sized(void *bp, size_t size) {
+    free_hinted(bp, size);
+}
+
+/*
+ * malloc_usable_size - the payload bytes of an allocated block, which
+ * may be more than were asked for and can all be used
+ */
+size_t malloc_usable_size(void *bp) {
+    if (bp == NULL)
+        return 0;
+    if (is_mapped(bp))
+        return map_usable(bp);
+    return usable_size(arena_of(bp), bp);
+}
+
+/*
+ * free_hinted - free, given the size of the block if the caller knows
+ * it or 0. The heap reads the header to coalesce anyway; what the size
+ * saves is the header read for a mapped block's length and for the
+ * tcache bin of a block another thread may have touched last.
+ */
+static void free_hinted(void *bp, size_t size) {
+    arena_t *a;
+    int locked;
+
     if(bp == 0) 
         return;
 
-    if (heap_listp == 0){
+    if (arenas[0].heap_listp == 0){
         mm_init();
     }
 
+    if (is_mapped(bp)) {
+        map_free(bp, size);
+        return;
+    }
+
+    a = arena_of(bp);
+    if (!__libc_single_threaded) {
+        if (tcache_put(bp, size ? sized_usable(a, bp, size) : usable_size(a, bp)))
+            return;
+        if (a != tcache_self()->arena) {
+            remote_push(a, bp);
+            return;
+        }
+    }
+
+    locked = lock_arena(a);
+    free_locked(a, bp);
+    unlock_arena(a, locked);
+}
+
+/*
+ * free_locked - the heap side of free
+ */
+static void free_locked(arena_t *a, void *bp) {
+    size_t size;
+
+    if (is_slab(a, bp)) {
+        slab_free(a, bp);
+        return;
+    }
+    if (deferred && (size = GET_SIZE(HDRP(bp))) <= QUICK_MAX) {
+        *(char **)bp = a->quick[(size - MINSIZE * WSIZE) / ALIGNMENT];
+        a->quick[(size - MINSIZE * WSIZE) / ALIGNMENT] = bp;
+        if (++a->nquick >= QUICK_LIMIT)
+            quick_flush(a);
+        return;
+    }
+    free_block(a, bp);
+}
+
+/*
+ * free_block - free a heap block and coalesce it right away
+ */
+static void free_block(arena_t *a, void *bp) {
 #ifdef DEBUG    
     printf("free: before.\n");
     mm_checkheap(1);
 #endif
     MARK_FREE(HDRP(bp));
     PUT(FTRP(bp), GET(HDRP(bp)));
-    coalesce(bp);
+    coalesce(a, bp);
+    if (++a->frees >= RELEASE_EVERY)
+        release_free(a);
 #ifdef DEBUG    
     printf("free: after.\n");        
     mm_checkheap(1);
@@ -216,11 +681,14 @@ void free (void *bp) {
 }
 
 /*
- * realloc - you may want to look at mm-naive.c
+ * realloc - resize in place when the block or its neighbourhood allows
+ * it (see resize_locked), otherwise move it.
  */
 void *realloc(void *ptr, size_t size) {
     size_t oldsize;
     void *newptr;
+    arena_t *a;
+    int locked, done;
 
     /* If size == 0 then this is just free, and we return NULL. */
     if(size == 0) {
@@ -233,6 +701,24 @@ void *realloc(void *ptr, size_t size) {
         return malloc(size);
     }
 
+    /* too big for any header, the block stays as it is */
+    if (size > BLOCK_MAX - WSIZE)
+        return NULL;
+
+    if (is_mapped(ptr)) {
+        a = NULL;
+        oldsize = map_usable(ptr);
+        done = size <= oldsize && size >= MMAP_MIN;
+    } else if (a = arena_of(ptr), oldsize = usable_size(a, ptr), is_slab(a, ptr)) {
+        done = size <= oldsize;
+    } else {
+        locked = lock_arena(a);
+        done = resize_locked(a, ptr, size);
+        unlock_arena(a, locked);
+    }
+    if (done)
+        return ptr;
+
     newptr = malloc(size);
 
     /* If realloc() fails the original block is left untouched  */
@@ -241,7 +727,6 @@ void *realloc(void *ptr, size_t size) {
     }
 
     /* Copy the old data. */
-    oldsize = GET_SIZE(HDRP(ptr));
     if(size < oldsize) 
         oldsize = size;
     memcpy(newptr, ptr, oldsize);
@@ -253,21 +738,147 @@ void *realloc(void *ptr, size_t size) {
 }
 
 /*
- * calloc - you may want to look at mm-naive.c
- * This function is not tested by mdriver, but it is
- * needed to run the traces.
+ * quick_flush - coalesce every block on the quick lists, lock held
+ */
+static void quick_flush(arena_t *a) {
+    char *bp;
+    int i;
+
+    for (i = 0; i < QUICK_BINS; i++) {
+        while ((bp = a->quick[i]) != NULL) {
+            a->quick[i] = *(char **)bp;
+            free_block(a, bp);
+        }
+    }
+    a->nquick = 0;
+}
+
+/*
+ * resize_locked - make heap block bp hold size bytes without moving it,
+ * lock held. Shrinking splits the tail off, growing absorbs a free
+ * successor, and a block at the end of the heap grows the heap under
+ * it. Returns 0 if the block has to move.
+ */
+static int resize_locked(arena_t *a, void *bp, size_t size) {
+    size_t asize = MAX(ALIGN(size + 4), MINSIZE * WSIZE);
+    size_t csize = GET_SIZE(HDRP(bp));
+    size_t nsize;
+    char *next = NEXT_BLKP(bp);
+    char *rem;
+    int t;
+
+    if (asize <= csize) {
+        if (IS_VALID(csize - asize)) {
+            t = (bp == a->heap_tailp);
+            SET_SIZE(HDRP(bp), asize);
+            rem = NEXT_BLKP(bp);
+            PUT(HDRP(rem), PACK3(csize - asize, 2, 0));
+            PUT(FTRP(rem), PACK3(csize - asize, 2, 0));
+            rem = coalesce(a, rem);
+            if (t)
+                a->heap_tailp = rem;
+        }
+        return 1;
+    }
+
+    nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+    if (csize + nsize < asize) {
+        /* only the last block can grow past its free successor */
+        if (GET_SIZE(HDRP(nsize ? NEXT_BLKP(next) : next)) != 0)
+            return 0;
+        /* just what is missing: a tail left over here would be handed
+         * to the next small malloc and pin the block down */
+        if (extend_heap(a, (asize - csize - nsize) / WSIZE) == NULL)
+            return 0;
+        next = NEXT_BLKP(bp);
+        nsize = GET_SIZE(HDRP(next));
+    }
+
+    t = (next == a->heap_tailp);
+    delete_node(a, next);
+    csize += nsize;
+    if (IS_VALID(csize - asize)) {
+        SET_SIZE(HDRP(bp), asize);
+        rem = NEXT_BLKP(bp);
+        PUT(HDRP(rem), PACK3(csize - asize, 2, 0));
+        PUT(FTRP(rem), PACK3(csize - asize, 2, 0));
+        insert_node(a, rem);
+        if (t)
+            a->heap_tailp = rem;
+    } else {
+        SET_SIZE(HDRP(bp), csize);
+        FLAG(HDRP(NEXT_BLKP(bp)));
+        if (t)
+            a->heap_tailp = bp;
+    }
+    if (NEXT_BLKP(bp) > a->zero_lo)
+        a->zero_lo = NEXT_BLKP(bp);
+    return 1;
+}
+
+/*
+ * calloc - malloc, then clear only what may not read zero already: a
+ * mapped block not at all, a heap block not above the arena's zero_lo
  */
 void *calloc (size_t nmemb, size_t size) {
-  size_t bytes = nmemb * size;
-  void *newptr;
+    size_t bytes;
+    char *bp, *zero;
+    arena_t *a;
+    int locked;
+
+    if (nmemb && size > (size_t)-1 / nmemb)
+        return NULL;
+    bytes = nmemb * size;
+
+    if (arenas[0].heap_listp == 0)
+        mm_init();
+    if (bytes == 0 || bytes > BLOCK_MAX - WSIZE)
+        return NULL;
+
+    if (bytes >= MMAP_MIN && (bp = map_alloc(bytes, ALIGNMENT)) != NULL)
+        return bp;
 
-  newptr = malloc(bytes);
-  memset(newptr, 0, bytes);
+    if (__libc_single_threaded) {
+        a = &arenas[0];
+    } else if (bytes <= TCACHE_MAX) {
+        if ((bp = tcache_get(bytes)) != NULL)
+            memset(bp, 0, bytes);
+        return bp;
+    } else {
+        a = tcache_self()->arena;
+    }
 
-  return newptr;
+    locked = lock_arena(a);
+    a->zero_was = NULL;
+    bp = malloc_locked(a, bytes);
+    zero = bp && !is_slab(a, bp) ? a->zero_was : NULL;
+    unlock_arena(a, locked);
+    if (bp)
+        calloc_fill(bp, bytes, zero);
+    return bp;
 }
 
-static void printblock(void *bp) 
+/*
+ * calloc_fill - clear the first size bytes of heap block bp, where zero
+ * is the arena's zero_lo from before it was placed, or NULL if nothing
+ * in it is known to be zero. Above zero only its free links and footer
+ * can be set.
+ */
+static void calloc_fill(void *bp, size_t size, char *zero) {
+    char *p = bp, *end = p + size, *lo, *tags;
+
+    if (zero == NULL || end <= zero) {
+        memset(p, 0, size);
+        return;
+    }
+    lo = MIN(MAX(zero, p + 4), end);
+    tags = MAX(NEXT_BLKP(bp) - 12, lo);
+    memset(p, 0, lo - p);
+    if (tags < end)
+        memset(tags, 0, end - tags);
+}
+
+static void printblock(arena_t *a, void *bp) 
 {
     size_t hsize, halloc;
 
@@ -285,7 +896,7 @@ static void printblock(void *bp)
     } else {
         printf("%p: header: [%u:%c], footer: [%u, %c], prev[%p], next[%p], prev_alloc: [%d]\n", 
             bp, (unsigned)hsize, (halloc ? 'a' : 'f'), GET_SIZE(FTRP(bp)), (GET_ALLOC(FTRP(bp)) ? 'a' : 'f'), 
-            prev_free(bp), next_free(bp), IS_PREV_ALLOC(HDRP(bp)));
+            prev_free(a, bp), next_free(a, bp), IS_PREV_ALLOC(HDRP(bp)));
     }
 
 }
@@ -305,11 +916,21 @@ static int checkblock(void *bp)
     return 0;
 }
 
-static void mm_checkfreetbl() {
+static void mm_checkfreetbl(arena_t *a) {
     printf("Show free table\n");
-    for (int i = 0; i < SEG_LEVLL; ++i) {
-        char * bp = flist_tbl + (i * DSIZE);
-        printf("Level %d: head[%p], tail[%p]\n", i, *(char **)bp, *(char **)(bp + WSIZE));
+    for (int i = 0; i < FL_COUNT; ++i) {
+        for (int j = 0; j < SL_COUNT; ++j) {
+            char *head = from_off(a, *get_head(a, i, j));
+            int listed = head != NULL;
+            int marked = (*sl_map(a, i) >> j) & 1;
+            if (listed != marked)
+                printf("Error: bitmap of class (%d, %d) is wrong.\n", i, j);
+            if (head)
+                printf("Class (%d, %d): head[%p]\n", i, j, head);
+        }
+        int used = *sl_map(a, i) != 0;
+        if (used != (int)((*fl_map(a) >> i) & 1))
+            printf("Error: bitmap of level %d is wrong.\n", i);
     }
 }
 
@@ -317,84 +938,587 @@ static void mm_checkfreetbl() {
  * mm_checkheap
  */
 void mm_checkheap(int verbose) {
-    mm_checkfreetbl();
-    char *bp = heap_listp;
+    int i;
+
+    for (i = 0; i < MEM_REGIONS; i++) {
+        if (arenas[i].heap_listp) {
+            if (verbose)
+                printf("Arena %d:\n", i);
+            mm_checkarena(&arenas[i], verbose);
+            mm_checkslabs(&arenas[i]);
+        }
+    }
+}
+
+/* mm_checkslabs - partial runs are runs, with the free slots they say */
+static void mm_checkslabs(arena_t *a) {
+    run_t *r;
+    int cls, w, n;
+
+    for (cls = 0; cls < SLAB_CLASSES; cls++) {
+        for (r = a->partial[cls]; r; r = r->next) {
+            for (n = w = 0; w < SLAB_MAPW; w++)
+                n += __builtin_popcountl(r->map[w]);
+            if (!is_slab(a, r) || !GET_ALLOC(HDRP(r)))
+                printf("Error: run %p is not an allocated run block\n", r);
+            if (r->size != (cls + 1) * ALIGNMENT)
+                printf("Error: run %p of class %d has size %d\n", r, cls, r->size);
+            if (n != r->nfree || n == 0)
+                printf("Error: run %p has %d free slots, counted %d\n", r, r->nfree, n);
+        }
+    }
+}
+
+static void mm_checkarena(arena_t *a, int verbose) {
+    mm_checkfreetbl(a);
+    char *bp = a->heap_listp;
+    int i, n = 0;
+
+    for (i = 0; i < QUICK_BINS; i++) {
+        for (bp = a->quick[i]; bp; bp = *(char **)bp, n++) {
+            if (!GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) != (unsigned)(MINSIZE * WSIZE + i * ALIGNMENT))
+                printf("Error: quick block %p is free or of the wrong size\n", bp);
+        }
+    }
+    if (n != a->nquick)
+        printf("Error: %d quick blocks, counted %d\n", a->nquick, n);
+    bp = a->heap_listp;
 
     if (verbose)
-        printf("Heap (%p):\n", heap_listp);
+        printf("Heap (%p):\n", a->heap_listp);
 
-    if ((GET_SIZE(HDRP(heap_listp)) != 4) || !GET_ALLOC(HDRP(heap_listp)))
+    if ((GET_SIZE(HDRP(a->heap_listp)) != 4) || !GET_ALLOC(HDRP(a->heap_listp)))
         printf("Bad prologue header\n");
 
     if (verbose) {
-        printblock(heap_listp);
+        printblock(a, a->heap_listp);
     }
 
-    for (bp = NEXT_BLKP(heap_listp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+    for (bp = NEXT_BLKP(a->heap_listp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
         if (verbose) 
-            printblock(bp);
+            printblock(a, bp);
         checkblock(bp);
     }
 
     if (verbose)
-        printblock(bp);
+        printblock(a, bp);
     if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
         printf("Bad epilogue header\n");    
+
+    /* past zero_lo, only the tail block's free tags may be set */
+    char *t = a->heap_tailp, *p;
+    for (p = MAX(a->zero_lo, a->heap_listp); p < HDRP(bp); p += 4) {
+        if (GET(p) && (GET_ALLOC(HDRP(t)) ||
+                       (p != HDRP(t) && p != t && p < FTRP(t) - 4)))
+            printf("Error: %p above zero_lo %p is not zero\n", p, a->zero_lo);
+    }
 }
 
 
+/*
+ * mm_profile - walk every arena and sum up its layout. Blocks on the
+ * thread caches and quick lists count as allocated, which they are as
+ * far as the heap is concerned. insert_node pushes at the head of its
+ * list, so there is no insert walk to report.
+ */
+void mm_profile(mm_profile_t *prof) {
+    arena_t *a;
+    char *bp;
+    size_t size;
+    int i, fl, sl;
+
+    memset(prof, 0, sizeof(*prof));
+    for (i = 0; i < MEM_REGIONS; i++) {
+        a = &arenas[i];
+        if (a->heap_listp == NULL)
+            continue;
+        for (bp = NEXT_BLKP(a->heap_listp); (size = GET_SIZE(HDRP(bp))) > 0; bp = NEXT_BLKP(bp)) {
+            prof->heap_bytes += size;
+            if (GET_ALLOC(HDRP(bp))) {
+                prof->alloc_bytes += size;
+                continue;
+            }
+            prof->free_bytes += size;
+            prof->nfree++;
+            if (size > prof->largest_free)
+                prof->largest_free = size;
+            get_class(size, &fl, &sl);
+            prof->free_hist[fl]++;
+        }
+        prof->searches += a->searches;
+        prof->search_steps += a->search_steps;
+        prof->inserts += a->inserts;
+    }
+    prof->frag = prof->free_bytes ? 1.0 - (double)prof->largest_free / prof->free_bytes : 0;
+}
+
 /* 
  * The remaining routines are internal helper routines 
  */
 
+/*
+ * lock_arena - take the arena lock if other threads may be around.
+ * Going multi-threaded only happens in pthread_create, never while this
+ * thread is inside the allocator, so the answer cannot change between
+ * lock_arena and unlock_arena; it is passed along anyway.
+ */
+static inline int lock_arena(arena_t *a) {
+    if (__libc_single_threaded)
+        return 0;
+    pthread_mutex_lock(&a->lock);
+    return 1;
+}
+
+static inline void unlock_arena(arena_t *a, int locked) {
+    if (locked)
+        pthread_mutex_unlock(&a->lock);
+}
+
+/* the arena of a block is the one whose region it lies in */
+static inline arena_t *arena_of(void *bp) {
+    return &arenas[mem_region(bp)];
+}
+
+/*
+ * remote_push - hand a block to another arena without taking its lock.
+ * The stack is only ever emptied as a whole, so there is no ABA problem.
+ */
+static void remote_push(arena_t *a, void *bp) {
+    char *top = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+
+    do {
+        *(char **)bp = top;
+    } while (!__atomic_compare_exchange_n(&a->remote, &top, (char *)bp, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* remote_drain - free everything other threads left us, lock held */
+static void remote_drain(arena_t *a) {
+    char *bp = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+    char *next;
+
+    while (bp) {
+        next = *(char **)bp;
+        free_locked(a, bp);
+        bp = next;
+    }
+}
+
+static void mm_once_init(void) {
+    int i;
+
+    for (i = 0; i < MEM_REGIONS; i++)
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * tcache_self - this thread's cache, emptied first if mm_init has
+ * thrown away the heap its blocks came from. That is also when the
+ * thread (re)binds to the arena of the cpu it is running on.
+ */
+static tcache_t *tcache_self(void) {
+    tcache_t *tc = &tcache;
+    int cpu;
+
+    if (tc->gen != heap_gen) {
+        memset(tc, 0, sizeof(tcache_t));
+        tc->gen = heap_gen;
+        cpu = sched_getcpu();
+        tc->arena = &arenas[(cpu < 0 ? 0 : cpu) % narenas];
+        pthread_setspecific(tcache_key, tc);
+    }
+    return tc;
+}
+
+/*
+ * tcache_get - pop a block for size bytes from this thread's bin,
+ * refilling TCACHE_BATCH of them from our arena when the bin is empty.
+ * Bin i holds blocks with at least 8 * (i + 1) usable bytes.
+ */
+static void *tcache_get(size_t size) {
+    tcache_t *tc = tcache_self();
+    int i = ALIGN(size) / ALIGNMENT - 1;
+    char *bp;
+    int locked, n;
+
+    if (!tc->bin[i]) {
+        locked = lock_arena(tc->arena);
+        for (n = 0; n < TCACHE_BATCH; n++) {
+            if ((bp = malloc_locked(tc->arena, (i + 1) * ALIGNMENT)) == NULL)
+                break;
+            *(char **)bp = tc->bin[i];
+            tc->bin[i] = bp;
+            tc->count[i]++;
+        }
+        unlock_arena(tc->arena, locked);
+        if (!tc->bin[i])
+            return NULL;
+    }
+    bp = tc->bin[i];
+    tc->bin[i] = *(char **)bp;
+    tc->count[i]--;
+    return bp;
+}
+
+/*
+ * tcache_put - keep a freed block with usable bytes in this thread's
+ * bin, whichever arena it came from. A full bin first returns
+ * TCACHE_BATCH blocks. Returns 0 if the block is too big to be cached.
+ */
+static int tcache_put(void *bp, size_t usable) {
+    tcache_t *tc;
+    int i;
+
+    if (usable >= TCACHE_MAX + ALIGNMENT)
+        return 0;
+    tc = tcache_self();
+    i = usable / ALIGNMENT - 1;
+    if (tc->count[i] >= TCACHE_FILL)
+        tcache_flush(tc, i, TCACHE_BATCH);
+    *(char **)bp = tc->bin[i];
+    tc->bin[i] = bp;
+    tc->count[i]++;
+    return 1;
+}
+
+/*
+ * tcache_flush - give n blocks of a bin back, to our arena under one
+ * lock and to other arenas through their remote stacks
+ */
+static void tcache_flush(tcache_t *tc, int i, int n) {
+    int locked = lock_arena(tc->arena);
+    arena_t *a;
+    char *bp;
+
+    while (n-- > 0 && (bp = tc->bin[i]) != NULL) {
+        tc->bin[i] = *(char **)bp;
+        tc->count[i]--;
+        a = arena_of(bp);
+        if (a == tc->arena)
+            free_locked(a, bp);
+        else
+            remote_push(a, bp);
+    }
+    unlock_arena(tc->arena, locked);
+}
+
+/* tcache_destroy - thread exit, hand every cached block back */
+static void tcache_destroy(void *p) {
+    tcache_t *tc = p;
+    int i;
+
+    if (tc->gen != heap_gen)
+        return;
+    for (i = 0; i < TCACHE_BINS; i++)
+        tcache_flush(tc, i, tc->count[i]);
+}
+
+/*
+ * slab_alloc - take a free slot of the run class for size, lock held.
+ * Returns NULL while the arena is still small, or out of memory.
+ */
+static void *slab_alloc(arena_t *a, size_t size) {
+    int cls = ALIGN(size) / ALIGNMENT - 1;
+    run_t *r;
+    int w, bit;
+
+    if (a->heap_tailp - a->flist_tbl < SLAB_HEAP)
+        return NULL;
+    if ((r = a->partial[cls]) == NULL && (r = run_new(a, cls)) == NULL)
+        return NULL;
+
+    for (w = 0; !r->map[w]; w++)
+        ;
+    bit = __builtin_ctzl(r->map[w]);
+    r->map[w] &= r->map[w] - 1;
+    if (--r->nfree == 0) {
+        /* full runs are on no list, slab_free puts them back */
+        a->partial[cls] = r->next;
+        if (r->next)
+            r->next->prev = NULL;
+    }
+    return (char *)r + r->first + (size_t)(w * 64 + bit) * r->size;
+}
+
+/*
+ * slab_free - give a slot back to its run, lock held. A run that
+ * empties out is freed, unless it is the only partial run of its class.
+ */
+static void slab_free(arena_t *a, void *bp) {
+    run_t *r = run_of(bp);
+    int cls = r->size / ALIGNMENT - 1;
+    int i = ((char *)bp - (char *)r - r->first) / r->size;
+
+    r->map[i / 64] |= 1UL << (i % 64);
+    if (r->nfree++ == 0) {
+        r->prev = NULL;
+        r->next = a->partial[cls];
+        if (r->next)
+            r->next->prev = r;
+        a->partial[cls] = r;
+    } else if (r->nfree == r->nobjs && (r->prev || r->next)) {
+        if (r->prev)
+            r->prev->next = r->next;
+        else
+            a->partial[cls] = r->next;
+        if (r->next)
+            r->next->prev = r->prev;
+        mark_run(a, r, 0);
+        free_locked(a, r);
+    }
+}
+
+/*
+ * run_new - carve a run for class cls out of the heap and make it the
+ * only partial run of the class. The run block is allocated with room
+ * to slide its payload up to the next SLAB_RUN boundary; the gap in
+ * front is freed again.
+ */
+static run_t *run_new(arena_t *a, int cls) {
+    size_t want = 2 * SLAB_RUN + MINSIZE * WSIZE;
+    size_t gap;
+    char *bp;
+    run_t *r;
+    int i;
+
+    if ((bp = find_fit(a, want)) == NULL) {
+        i = 0; /* the free space we have in the tail of heap */
+        if (a->heap_tailp && !GET_ALLOC(HDRP(a->heap_tailp)))
+            i = GET_SIZE(HDRP(a->heap_tailp));
+        if ((bp = extend_heap(a, MAX(want - i, CHUNKSIZE) / WSIZE)) == NULL)
+            return NULL;
+    }
+    gap = align_gap(bp, SLAB_RUN);
+    if (gap) {
+        place(a, bp, gap);
+        r = (run_t *)NEXT_BLKP(bp);
+        place(a, r, SLAB_RUN);
+        free_locked(a, bp);
+    } else {
+        r = (run_t *)bp;
+        place(a, r, SLAB_RUN);
+    }
+    mark_run(a, r, 1);
+
+    r->next = r->prev = NULL;
+    r->size = (cls + 1) * ALIGNMENT;
+    r->first = ALIGN(sizeof(run_t));
+    r->nobjs = (SLAB_RUN - 4 - r->first) / r->size;
+    r->nfree = r->nobjs;
+    memset(r->map, 0, sizeof(r->map));
+    for (i = 0; i < r->nobjs / 64; i++)
+        r->map[i] = ~0UL;
+    if (r->nobjs % 64)
+        r->map[i] = (1UL << (r->nobjs % 64)) - 1;
+    a->partial[cls] = r;
+    return r;
+}
+
+/* is_slab - whether bp lies in a run; the arena base is region aligned.
+ * Frees ask without the arena lock, so the bitmap words are atomic. */
+static inline int is_slab(arena_t *a, const void *bp) {
+    size_t pg = ((const char *)bp - a->flist_tbl) / SLAB_RUN;
+    return (__atomic_load_n(&a->runs[pg / 64], __ATOMIC_RELAXED) >> (pg % 64)) & 1;
+}
+
+static inline run_t *run_of(const void *bp) {
+    return (run_t *)((size_t)bp & ~(size_t)(SLAB_RUN - 1));
+}
+
+static inline void mark_run(arena_t *a, run_t *r, int on) {
+    size_t pg = ((char *)r - a->flist_tbl) / SLAB_RUN;
+    if (on) {
+        __atomic_fetch_or(&a->runs[pg / 64], 1UL << (pg % 64), __ATOMIC_RELAXED);
+        if (pg / 64 >= a->runs_top)
+            a->runs_top = pg / 64 + 1;
+    } else
+        __atomic_fetch_and(&a->runs[pg / 64], ~(1UL << (pg % 64)), __ATOMIC_RELAXED);
+}
+
+static inline size_t usable_size(arena_t *a, void *bp) {
+    if (is_slab(a, bp))
+        return run_of(bp)->size;
+    return LOAD_SIZE(HDRP(bp)) - 4;
+}
+
+/*
+ * sized_usable - usable_size from the size the block was asked for with
+ * (or its usable size) and no header: a lower bound where the block got
+ * more than it needed, which is all a tcache bin promises
+ */
+static inline size_t sized_usable(arena_t *a, void *bp, size_t size) {
+    if (is_slab(a, bp))
+        return ALIGN(size);
+    return MAX(ALIGN(size + 4), MINSIZE * WSIZE) - 4;
+}
+
+/*
+ * map_alloc - a block of its own pages. bp is the first align boundary
+ * at least a 4 byte header into them, the header holds the length of
+ * the mapping from the header's page on; whole pages in front of that
+ * or past the block go back at once.
+ */
+static void *map_alloc(size_t size, size_t align) {
+    size_t len = size + MAX(align, WSIZE);
+    char *p, *bp, *start, *end;
+
+    if ((p = mem_map(len)) == (void *)-1)
+        return NULL;
+    len = (len + SLAB_RUN - 1) & ~(size_t)(SLAB_RUN - 1); /* what mem_map took */
+    bp = (char *)(((size_t)p + 4 + align - 1) & ~(align - 1));
+    start = map_start(bp);
+    end = (char *)(((size_t)bp + size + SLAB_RUN - 1) & ~(size_t)(SLAB_RUN - 1));
+    if ((size_t)(end - start) > BLOCK_MAX) {
+        /* more than the header can size; the heap may still fit it */
+        mem_unmap(p, len);
+        return NULL;
+    }
+    if (start > p)
+        mem_unmap(p, start - p);
+    if (end < p + len)
+        mem_unmap(end, p + len - end);
+    PUT(HDRP(bp), PACK(end - start, 1));
+    return bp;
+}
+
+/* map_free - unmap a mapped block, whose size the caller may know */
+static void map_free(void *bp, size_t size) {
+    char *start = map_start(bp);
+
+    if (size)
+        mem_unmap(start, (((size_t)bp + size + SLAB_RUN - 1) & ~(size_t)(SLAB_RUN - 1)) - (size_t)start);
+    else
+        mem_unmap(start, GET_SIZE(HDRP(bp)));
+}
+
+static inline char *map_start(const void *bp) {
+    return (char *)(((size_t)bp - 4) & ~(size_t)(SLAB_RUN - 1));
+}
+
+static inline size_t map_usable(void *bp) {
+    return map_start(bp) + GET_SIZE(HDRP(bp)) - (char *)bp;
+}
+
+/* mapped blocks are the ones past the last heap region */
+static inline int is_mapped(const void *bp) {
+    return mem_region(bp) == MEM_REGIONS;
+}
+
+/*
+ * release_free - give back the pages of every free block of RELEASE_MIN
+ * bytes or more not released yet, lock held. Only what lies between the
+ * first free link and the second one goes, the list and boundary tags
+ * stay intact.
+ */
+static void release_free(arena_t *a) {
+    int fl, sl;
+    char *bp;
+
+    a->frees = 0;
+    get_class(RELEASE_MIN, &fl, &sl);
+    for (; fl < FL_COUNT; fl++) {
+        for (sl = 0; sl < SL_COUNT; sl++) {
+            for (bp = from_off(a, *get_head(a, fl, sl)); bp; bp = next_free(a, bp))
+                if (GET_SIZE(HDRP(bp)) >= RELEASE_MIN &&
+                    !(GET(HDRP(bp)) & RELEASED)) {
+                    mem_release(bp + 4, GET_SIZE(HDRP(bp)) - DSIZE);
+                    PUT(HDRP(bp), GET(HDRP(bp)) | RELEASED);
+                    if (bp == a->heap_tailp)
+                        release_tail(a);
+                }
+        }
+    }
+}
+
+/*
+ * release_tail - the tail block's pages were just released, so zero_lo
+ * can come down to the first of them once the bytes between the last
+ * one and the footer tags are cleared as well
+ */
+static void release_tail(arena_t *a) {
+    char *bp = a->heap_tailp;
+    char *lo = (char *)(((size_t)bp + 4 + SLAB_RUN - 1) & ~(size_t)(SLAB_RUN - 1));
+    char *hi = (char *)((size_t)(FTRP(bp) + 4) & ~(size_t)(SLAB_RUN - 1));
+
+    if (lo >= hi || lo >= a->zero_lo)
+        return;
+    if (FTRP(bp) - 4 > hi)
+        memset(hi, 0, FTRP(bp) - 4 - hi);
+    a->zero_lo = lo;
+}
+
+/*
+ * zero_stale - clear the part of [lo, hi) above zero_lo, tags that just
+ * became payload of a bigger free block
+ */
+static void zero_stale(arena_t *a, char *lo, char *hi) {
+    if (hi > a->zero_lo) {
+        lo = MAX(lo, a->zero_lo);
+        memset(lo, 0, hi - lo);
+    }
+}
+
 /*
  * coalesce
  * Boundary tag coalescing. Return ptr to coalesced block
  * delete or insert entry of free list.
  */
-static void *coalesce(void *bp) 
+static void *coalesce(arena_t *a, void *bp) 
 {
     size_t prev_alloc = IS_PREV_ALLOC(HDRP(bp));
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE(HDRP(bp));
 
+    /* a heap bigger than a header can size may hold free neighbours
+     * too big to merge; they stay apart, each on its own list */
+    if (MAX_HEAP > BLOCK_MAX) {
+        if (!next_alloc && size + GET_SIZE(HDRP(NEXT_BLKP(bp))) > BLOCK_MAX)
+            next_alloc = 1;
+        if (!prev_alloc && size + GET_SIZE(HDRP(PREV_BLKP(bp))) +
+            (next_alloc ? 0 : GET_SIZE(HDRP(NEXT_BLKP(bp)))) > BLOCK_MAX)
+            prev_alloc = 1;
+    }
+
     if (prev_alloc && next_alloc) {            /* Case 1 */
         /* nop */
     }
     else if (prev_alloc && !next_alloc) {      /* Case 2 */
-        if (heap_tailp == NEXT_BLKP(bp)) {
-            heap_tailp = bp;
+        if (a->heap_tailp == NEXT_BLKP(bp)) {
+            a->heap_tailp = bp;
         }
-        delete_node(get_level(GET_SIZE(HDRP(NEXT_BLKP(bp)))), NEXT_BLKP(bp));
+        delete_node(a, NEXT_BLKP(bp));
+        zero_stale(a, HDRP(NEXT_BLKP(bp)), NEXT_BLKP(bp) + 4);
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
         PUT(HDRP(bp), PACK3(size, 2, 0));
         PUT(FTRP(bp), PACK3(size, 2, 0));
     }
     else if (!prev_alloc && next_alloc) {      /* Case 3 */
-        int t = (bp == heap_tailp);
-        delete_node(get_level(GET_SIZE(HDRP(PREV_BLKP(bp)))), PREV_BLKP(bp));
+        int t = (bp == a->heap_tailp);
+        delete_node(a, PREV_BLKP(bp));
         size += GET_SIZE(HDRP(PREV_BLKP(bp)));
         SET_SIZE(FTRP(bp), size);
         SET_SIZE(HDRP(PREV_BLKP(bp)), size);
         bp = PREV_BLKP(bp);
         if (t) {
-            heap_tailp = bp;
+            a->heap_tailp = bp;
         }
     }
     else {                                     /* Case 4 */
-        int t = (NEXT_BLKP(bp) == heap_tailp);
-        delete_node(get_level(GET_SIZE(HDRP(PREV_BLKP(bp)))), PREV_BLKP(bp));
-        delete_node(get_level(GET_SIZE(HDRP(NEXT_BLKP(bp)))), NEXT_BLKP(bp));
+        int t = (NEXT_BLKP(bp) == a->heap_tailp);
+        delete_node(a, PREV_BLKP(bp));
+        delete_node(a, NEXT_BLKP(bp));
+        zero_stale(a, HDRP(NEXT_BLKP(bp)), NEXT_BLKP(bp) + 4);
         size += GET_SIZE(HDRP(PREV_BLKP(bp))) +  GET_SIZE(FTRP(NEXT_BLKP(bp)));
         SET_SIZE(HDRP(PREV_BLKP(bp)), size);
         SET_SIZE(FTRP(NEXT_BLKP(bp)), size);
         bp = PREV_BLKP(bp);
         if (t) {
-            heap_tailp = bp;
+            a->heap_tailp = bp;
         }
     }
     UNFLAG(HDRP(NEXT_BLKP(bp)));    
-    insert_node(get_level(GET_SIZE(HDRP(bp))), bp);
+    insert_node(a, bp);
     return bp;
 }
 
@@ -404,52 +1528,66 @@ static void *coalesce(void *bp)
  * Return:
  *      the new free block pointer
  */
-static void *extend_heap(size_t words) 
+static void *extend_heap(arena_t *a, size_t words) 
 {
     char *bp;
+    char *clean = mem_clean(a->region);
     size_t size;
 
     /* single-word alignment */
     size = (words + 1) * WSIZE; 
-    if ((long)(bp = mem_sbrk(size)) == -1)  
+    if ((long)(bp = mem_region_sbrk(a->region, size)) == -1)  
         return NULL;                                        
 
+    /* fresh memory carries the zeroed tail on, else it starts over */
+    if (clean > bp || a->zero_lo > bp)
+        a->zero_lo = MIN(MAX(clean, bp), bp + size);
+
     int prev_alloc = IS_PREV_ALLOC(HDRP(bp));
 
     /* Initialize free block header/footer and the epilogue header */
     PUT(HDRP(bp), PACK3(size, prev_alloc << 1, 0));         /* Free block header */   
     PUT(FTRP(bp), PACK3(size, prev_alloc << 1, 0));         /* Free block footer */   
-    set_prev_free(bp, NULL);
-    set_next_free(bp, NULL);
+    set_prev_free(a, bp, NULL);
+    set_next_free(a, bp, NULL);
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */ 
 
-    /* Coalesce if the previous block was free */
-    heap_tailp = coalesce(bp);
-    return heap_tailp;
+    /* Coalesce if the previous block was free, whose next link and
+     * footer are then payload, as are our header and prev link */
+    a->heap_tailp = coalesce(a, bp);
+    if (a->heap_tailp != bp)
+        zero_stale(a, bp - 12, bp + 4);
+    return a->heap_tailp;
 }
 
 /* 
  * place - Place block of asize bytes at start of free block bp 
  *         and split if remainder would be at least minimum block size
  */
-static void place(void *bp, size_t asize){
+static void place(arena_t *a, void *bp, size_t asize){
     size_t csize = GET_SIZE(HDRP(bp));   
+    char *end = (char *)bp + (IS_VALID(csize - asize) ? asize : csize);
+
+    /* whatever the block held, it is the program's now */
+    a->zero_was = a->zero_lo;
+    if (end > a->zero_lo)
+        a->zero_lo = end;
 
     if (IS_VALID(csize - asize)) {  
         /* we want to make sure the new free block satisfy the minimum requirement */            
-        int t = (bp == heap_tailp);
-        delete_node(get_level(GET_SIZE(HDRP(bp))), bp); /* remove the record in the free block list */
+        int t = (bp == a->heap_tailp);
+        delete_node(a, bp); /* remove the record in the free block list */
         SET_SIZE(HDRP(bp), asize);
         MARK_ALLOC(HDRP(bp));
         bp = NEXT_BLKP(bp);
         PUT(HDRP(bp), PACK3(csize-asize, 2, 0));
         PUT(FTRP(bp), PACK3(csize-asize, 2, 0));  
-        insert_node(get_level(GET_SIZE(HDRP(bp))), bp);
+        insert_node(a, bp);
         if (t) {
-            heap_tailp = bp;
+            a->heap_tailp = bp;
         }
     }else { 
-        delete_node(get_level(GET_SIZE(HDRP(bp))), bp);
+        delete_node(a, bp);
         MARK_ALLOC(HDRP(bp));
         FLAG(HDRP(NEXT_BLKP(bp)));
     }
@@ -458,82 +1596,128 @@ static void place(void *bp, size_t asize){
 /* 
  * find_fit - Find a fit for a block with asize bytes 
  */
-static void *find_fit(size_t asize){
-    /* First fit search */
-    void *bp;
-    char *flist_head;
-
-    int level = get_level(asize);
+static void *find_fit(arena_t *a, size_t asize){
+    void *bp, *fit;
+    unsigned map;
+    int fl, sl, n;
+
+    get_class(asize, &fl, &sl);
+    a->searches++;
+
+    /* the request's own class also holds smaller blocks, try a few and
+     * take the lowest addressed fit, as address-ordered lists would; the
+     * last class has nothing above it, so it is searched all the way */
+    int last = (fl == FL_COUNT - 1 && sl == SL_COUNT - 1);
+    fit = NULL;
+    bp = from_off(a, *get_head(a, fl, sl));
+    for (n = 0; bp && (last || n < FIT_SCAN); bp = next_free(a, bp), n++)
+        if (asize <= GET_SIZE(HDRP(bp)) && (fit == NULL || bp < fit))
+            fit = bp;
+    a->search_steps += n;
+    if (fit)
+        return fit;
+
+    /* any block of a higher class fits, take the smallest such class
+     * and the lowest addressed of its first few blocks */
+    map = sl + 1 < SL_COUNT ? *sl_map(a, fl) & (~0u << (sl + 1)) : 0;
+    if (!map) {
+        map = fl + 1 < FL_COUNT ? *fl_map(a) & (~0u << (fl + 1)) : 0;
+        if (!map)
+            return NULL; /* No fit */
+        fl = __builtin_ctz(map);
+        map = *sl_map(a, fl);
+    }
+    sl = __builtin_ctz(map);
+    bp = from_off(a, *get_head(a, fl, sl));
+    for (fit = bp, n = 0; bp && n < FIT_SCAN; bp = next_free(a, bp), n++)
+        if (bp < fit)
+            fit = bp;
+    a->search_steps += n;
+    return fit;
+}
 
-    while (level < SEG_LEVLL) { // serach in the size-class from small to large
-        flist_head = *(get_head(level));
-        for (bp = flist_head; bp && GET_SIZE(HDRP(bp)) > 0; bp = next_free(bp)) {
-            if (asize <= GET_SIZE(HDRP(bp))) {
-                return bp;
+/*
+ * find_aligned_fit - a free block with room for asize bytes past its
+ * first align boundary that leaves a valid free block in front, or none.
+ * Looks at up to FIT_SCAN blocks of every class from asize's up. *gap is
+ * set to the bytes in front.
+ */
+static void *find_aligned_fit(arena_t *a, size_t asize, size_t align, size_t *gap){
+    char *bp;
+    unsigned map;
+    int fl, sl, n;
+
+    get_class(asize, &fl, &sl);
+    a->searches++;
+    for (; fl < FL_COUNT; fl++, sl = 0) {
+        for (map = *sl_map(a, fl) & (~0u << sl); map; map &= map - 1) {
+            bp = from_off(a, *get_head(a, fl, __builtin_ctz(map)));
+            for (n = 0; bp && n < FIT_SCAN; bp = next_free(a, bp), n++) {
+                *gap = align_gap(bp, align);
+                if (*gap + asize <= GET_SIZE(HDRP(bp))) {
+                    a->search_steps += n + 1;
+                    return bp;
+                }
             }
+            a->search_steps += n;
         }
-        level++;
     }
-    return NULL; /* No fit */
+    return NULL;
+}
+
+/* align_gap - bytes from bp to the first align boundary that leaves
+ * either nothing or a valid block in front */
+static inline size_t align_gap(const void *bp, size_t align) {
+    size_t gap = -(size_t)bp & (align - 1);
+
+    if (gap && !IS_VALID(gap))
+        gap += align;
+    return gap;
 }
 
 // Macro is evil, inline function is more reliable.
-static inline void insert_node(int level, void * bp) {
-    char **flist_head = get_head(level);
-    char **flist_tail = get_tail(level);
-    if (!(*flist_head)) {
+static inline void insert_node(arena_t *a, void * bp) {
+    int fl, sl;
+    unsigned *head;
+
+    get_class(GET_SIZE(HDRP(bp)), &fl, &sl);
+    head = get_head(a, fl, sl);
+    a->inserts++;
+    set_prev_free(a, bp, NULL);
+    if (*head == NIL) {
         // empty list
-        *flist_head = bp;
-        *flist_tail = bp;
-        set_prev_free(bp, NULL);
-        set_next_free(bp, NULL);
+        set_next_free(a, bp, NULL);
+        *sl_map(a, fl) |= 1u << sl;
+        *fl_map(a) |= 1u << fl;
     } else {
-        if ((char *)bp < (*flist_head)) {
-            // insert at head
-            set_prev_free(*flist_head, bp);
-            set_next_free(bp, *flist_head);
-            set_prev_free(bp, NULL);
-            *flist_head = bp;
-        } else if ((*flist_tail) < (char *)bp) {
-            // insert to tail
-            set_next_free(*flist_tail, bp);
-            set_prev_free(bp, *flist_tail);
-            set_next_free(bp, NULL);
-            *flist_tail = bp;
-        } else {
-            // find some place in the list
-            char * c = *flist_head;
-            while (c < (char *)bp) {
-                c = next_free(c);
-            }
-            set_next_free(prev_free(c), bp);
-            set_prev_free(bp, prev_free(c));
-            set_prev_free(c, bp);
-            set_next_free(bp, c);
-        }
+        // push at head
+        set_next_free(a, bp, from_off(a, *head));
+        set_prev_free(a, from_off(a, *head), bp);
     }
+    *head = to_off(a, bp);
 }
 
-static inline void delete_node(int level, void * bp) {
-    char **flist_head = get_head(level);
-    char **flist_tail = get_tail(level);    
-    if (bp == *flist_head) {
-        *flist_head = next_free(bp);
-        if (*flist_head) {
-            set_prev_free(*flist_head, NULL);
-        } else {
-            *flist_tail = NULL;
-        }
-    } else if (bp == *flist_tail) {
-        *flist_tail = prev_free(bp);
-        if (*flist_tail) {
-            set_next_free(*flist_tail, NULL);
-        } else {
-            *flist_head = NULL;
-        }
+static inline void delete_node(arena_t *a, void * bp) {
+    char *prev = prev_free(a, bp);
+    char *next = next_free(a, bp);
+    int fl, sl;
+    unsigned *head;
+
+    if (prev) {
+        set_next_free(a, prev, next);
     } else {
-        set_next_free(prev_free(bp), next_free(bp));
-        set_prev_free(next_free(bp), prev_free(bp));
+        get_class(GET_SIZE(HDRP(bp)), &fl, &sl);
+        head = get_head(a, fl, sl);
+        *head = to_off(a, next);
+        if (!next) {
+            // list is empty now
+            *sl_map(a, fl) &= ~(1u << sl);
+            if (!*sl_map(a, fl))
+                *fl_map(a) &= ~(1u << fl);
+        }
+    }
+    if (next) {
+        set_prev_free(a, next, prev);
     }
 }
 
@@ -541,30 +1725,48 @@ static inline int IS_VALID(size_t s){
     return s >= (MINSIZE * WSIZE);
 }
 
-static inline void init_free_list() {
-    memset(flist_tbl, 0, SEG_LEVLL * DSIZE);
+static inline void init_free_list(arena_t *a) {
+    memset(a->flist_tbl, 0, 4 * (1 + FL_COUNT));             /* bitmaps */
+    memset(a->flist_tbl + 4 * (1 + FL_COUNT), 0xff, 4 * FL_COUNT * SL_COUNT); /* heads, NIL */
 }
 
-static inline char **get_head(int level) {
-    char * bp = flist_tbl + (level * DSIZE);
-    return (char **)(bp);
+static inline unsigned *fl_map(arena_t *a) {
+    return (unsigned *)a->flist_tbl;
 }
 
-static inline char **get_tail(int level) {
-    char * bp = flist_tbl + (level * DSIZE) + WSIZE;
-    return (char **)(bp);    
+static inline unsigned *sl_map(arena_t *a, int fl) {
+    return (unsigned *)a->flist_tbl + 1 + fl;
+}
+
+static inline unsigned *get_head(arena_t *a, int fl, int sl) {
+    return (unsigned *)a->flist_tbl + 1 + FL_COUNT + fl * SL_COUNT + sl;
+}
+
+/*
+ * Free list heads and links are 32-bit offsets from the arena base in
+ * ALIGNMENT units, which reach 32 GB; NIL ends a list. Block pointers
+ * are ALIGNMENT aligned and so is the base, so nothing is lost.
+ */
+static inline unsigned to_off(arena_t *a, const char *p) {
+    return p ? (unsigned)((size_t)(p - a->flist_tbl) / ALIGNMENT) : NIL;
+}
+
+static inline char *from_off(arena_t *a, unsigned off) {
+    return off == NIL ? NULL : a->flist_tbl + (size_t)off * ALIGNMENT;
 }
 
 /*
- * This works for all positive number. 
+ * get_class - first and second level of a block size (>= MINSIZE words)
  */
-static inline int get_level(size_t size) {
-    int r = 0, s = 16;
-    while ((int)size > s - 1 && r < SEG_LEVLL) {
-        s <<= 1;
-        r += 1;
+static inline void get_class(size_t size, int *fl, int *sl) {
+    int f = 31 - __builtin_clz((unsigned)size);
+    if (f >= FL_MIN + FL_COUNT) {
+        *fl = FL_COUNT - 1;
+        *sl = SL_COUNT - 1;
+        return;
     }
-    return r - 1;
+    *fl = f - FL_MIN;
+    *sl = (size >> (f - SL_BITS)) & (SL_COUNT - 1);
 }
 
 static inline int in_heap(const void *p) {
@@ -572,29 +1774,23 @@ static inline int in_heap(const void *p) {
 }
 
 /* previous free block */
-static inline void* prev_free(void * bp) {
-    int off = GET(bp);
-    if (off < 0) return NULL;
-    return heap_listp + off;
+static inline void* prev_free(arena_t *a, void * bp) {
+    return from_off(a, GET(bp));
 }
 
 /* next free block */
-static inline void* next_free(void * bp) {
-    int off = GET((char*)FTRP(bp) - 4);
-    if (off < 0) return NULL;
-    return heap_listp + off;
+static inline void* next_free(arena_t *a, void * bp) {
+    return from_off(a, GET((char*)FTRP(bp) - 4));
 }
 
 /* set previous free block pointer */
-static inline void set_prev_free(void * bp, char * p) {
-    int off = p ? p - heap_listp : -1;
-    PUT(bp, off);
+static inline void set_prev_free(arena_t *a, void * bp, char * p) {
+    PUT(bp, to_off(a, p));
 }
 
 /* set next free block pointer */
-static inline void set_next_free(void * bp, char * p) {
-    int off = p ? p - heap_listp : -1;
-    PUT((char*)FTRP(bp) - 4, off);
+static inline void set_next_free(arena_t *a, void * bp, char * p) {
+    PUT((char*)FTRP(bp) - 4, to_off(a, p));
 }
 
 static inline void SET_SIZE(void * hp, size_t s) {
@@ -607,7 +1803,7 @@ static inline void MARK_FREE(void * hp) {
 }
 
 static inline void MARK_ALLOC(void * hp) {
-    PUT(hp, (GET(hp) | 1));
+    PUT(hp, (GET(hp) | 1) & ~RELEASED);
 }
 
 /* Read and write a word at address p */
@@ -619,10 +1815,20 @@ static inline void PUT(void * hp, unsigned val) {
     (*(unsigned *)(hp) = (val));
 }
 
-/* Read the size and allocated fields from address p */
+/* Read the size and allocated fields from address p. Only free blocks
+   carry RELEASED, and only the allocated prologue has a size of 4 */
 static inline unsigned GET_SIZE(void * hp) {
-    return (GET(hp) & ~0x3);
+    unsigned w = GET(hp);
+    return w & (w & 1 ? ~0x3 : ~(0x3 | RELEASED));
 }               
+
+/* The arena sets and clears the prev_alloc bit of allocated blocks under
+ * its lock while their owners may read the size without it, so both
+ * sides of that header word go through atomics. */
+static inline unsigned LOAD_SIZE(void * hp) {
+    unsigned w = __atomic_load_n((unsigned *)hp, __ATOMIC_RELAXED);
+    return w & (w & 1 ? ~0x3 : ~(0x3 | RELEASED));
+}
 static inline int GET_ALLOC(void * hp) {
     return (GET(hp) & 0x1);
 }
@@ -647,11 +1853,11 @@ static inline char* PREV_BLKP(void * bp) {
 }
 
 static inline void FLAG(void * hp) {
-    PUT(hp, GET(hp) | 0x2);
+    __atomic_store_n((unsigned *)hp, GET(hp) | 0x2, __ATOMIC_RELAXED);
 }
 
 static inline void UNFLAG(void * hp) {
-    PUT(hp, GET(hp) & ~0x2);
+    __atomic_store_n((unsigned *)hp, GET(hp) & ~0x2, __ATOMIC_RELAXED);
 }
 
 static inline int IS_PREV_ALLOC(void * hp) {
@@ -1,3 +1,6 @@
+#ifndef __MM_H__
+#define __MM_H__
+
 #include <stdio.h>
 
 #ifdef DRIVER
@@ -7,6 +10,10 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern size_t mm_usable_size(void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
 
 #else
 
@@ -15,11 +22,47 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern size_t malloc_usable_size(void *ptr);
+extern void free_sized(void *ptr, size_t size);
 
 #endif
 
+/* memalign wants a power of two alignment, and aligned_alloc is the same
+   call. free_sized takes any size from the one asked for up to what
+   the usable size query says. */
+
 extern int mm_init(void);
 
+/* Coalesce freed small blocks in batches rather than right away, from
+   the next mm_init on. Off by default. */
+extern void mm_deferred(int on);
+
+/* free blocks are counted per power of two of their size, from 16 bytes;
+   the last class takes everything above */
+#define MM_PROF_CLASSES 20
+
+/* A snapshot of the heap layout and of the search work done so far,
+   filled in by mm_profile */
+typedef struct {
+    size_t heap_bytes;    /* in heap blocks, mapped blocks excluded */
+    size_t alloc_bytes;   /* ... of them allocated, slab runs included */
+    size_t free_bytes;    /* ... of them free */
+    size_t largest_free;  /* the biggest free block */
+    unsigned long nfree;  /* free blocks */
+    double frag;          /* external fragmentation, 1 - largest / free */
+    unsigned long free_hist[MM_PROF_CLASSES]; /* free blocks per class */
+    unsigned long searches;      /* fit searches since mm_init */
+    unsigned long search_steps;  /* free blocks they looked at */
+    unsigned long inserts;       /* blocks put on a free list */
+    unsigned long insert_steps;  /* list nodes walked to place them */
+} mm_profile_t;
+
+extern void mm_profile(mm_profile_t *prof);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
+
+#endif /* __MM_H__ */
@@ -0,0 +1,36 @@
+/*
+ * mmlayout.h - The parts of mm.c's layout that mmtune models
+ *
+ * mm.c builds on these and mmtune replays traces against a model of
+ * them, so the two can't drift apart.
+ */
+#ifndef __MMLAYOUT_H__
+#define __MMLAYOUT_H__
+
+#include "mm.h" /* MM_PROF_CLASSES */
+
+/* single word (4) or double word (8) alignment */
+#define ALIGNMENT 8
+
+/* Free index, see mm.c */
+#define FL_MIN    4   /* log2 of the minimum block size */
+#define FL_COUNT  MM_PROF_CLASSES /* 20, the last takes everything from 2^23 up */
+#define FIT_SCAN  32  /* blocks of the request's own class looked at */
+
+/* Slabs */
+#define SLAB_RUN     4096 /* block size of a run, payload aligned to this */
+#define SLAB_MAPW    8    /* bitmap words, enough for the 8 byte class */
+#define SLAB_HEAP    (1<<20) /* arena size before runs are worth it */
+
+/* a run header, at the start of the run payload, then its objects */
+typedef struct run {
+    struct run *next;        /* partial runs of the same class */
+    struct run *prev;
+    unsigned short size;     /* object size */
+    unsigned short first;    /* offset of the first object */
+    unsigned short nobjs;
+    unsigned short nfree;
+    unsigned long map[SLAB_MAPW]; /* set bit = free slot */
+} run_t;
+
+#endif /* __MMLAYOUT_H__ */
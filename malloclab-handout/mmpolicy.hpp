@@ -0,0 +1,492 @@
+/*
+ * mmpolicy.hpp - mm.c's heap with its policy choices as template parameters
+ *
+ *   mmpolicy::heap<Classes, Fit, Order, Coalesce, Align>
+ *
+ * is a segregated free list allocator over memlib region 0 with the same
+ * block format as mm.c: a 4 byte header of size | prev alloc | alloc in
+ * front of every block, and two 4 byte list links and a footer in free
+ * blocks only. What mm.c fixes with #defines is picked per instantiation:
+ *
+ *   Classes   which free list a block size goes on: one_class,
+ *             pow2_classes, tlsf_classes<SL_BITS>
+ *   Fit       how a list is searched: first_fit, best_fit<SCAN>,
+ *             good_fit
+ *   Order     where a freed block joins its list: lifo_order,
+ *             address_order, size_order
+ *   Coalesce  when free neighbours merge: immediate, or deferred until
+ *             a search fails
+ *   Align     payload alignment and block size granularity, a power of
+ *             two from 8 to a page
+ *
+ * Policies are types with static members only, so the compiler inlines
+ * them into the heap and an instantiation runs the code the same choices
+ * hard-coded would. Slabs, thread caches and mapped blocks are left out:
+ * the point is comparing list policies, mdriver-policy does that over a
+ * matrix of instantiations.
+ */
+#ifndef __MMPOLICY_HPP__
+#define __MMPOLICY_HPP__
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+#include "memlib.h"
+}
+
+namespace mmpolicy {
+
+/* free list links are 32-bit offsets from the heap base in Align units */
+static constexpr unsigned NIL = 0xffffffffu;
+
+/*********************************************************
+ * Classes: Classes::of(size) must not decrease with size,
+ * so every block on a higher list fits what a lower one
+ * was asked for.
+ *********************************************************/
+
+/* a single list */
+struct one_class {
+    static constexpr int count = 1;
+    static int of(size_t) { return 0; }
+    static const char *name() { return "one"; }
+};
+
+/* one list per power of two */
+struct pow2_classes {
+    static constexpr int count = 28;
+    static int of(size_t size) {
+        int f = 63 - __builtin_clzl(size) - 4;
+        return f < count ? f : count - 1;
+    }
+    static const char *name() { return "pow2"; }
+};
+
+/* power of two levels split in 1 << SL_BITS lists, as mm.c's get_class */
+template <int SL_BITS>
+struct tlsf_classes {
+    static_assert(SL_BITS >= 0 && SL_BITS <= 4, "blocks start at 16 bytes");
+    static constexpr int levels = 20;
+    static constexpr int count = levels << SL_BITS;
+    static int of(size_t size) {
+        int f = 63 - __builtin_clzl(size);
+        if (f >= 4 + levels)
+            return count - 1;
+        return ((f - 4) << SL_BITS) |
+            (int)((size >> (f - SL_BITS)) & ((1 << SL_BITS) - 1));
+    }
+    static const char *name() {
+        static char buf[16];
+        snprintf(buf, sizeof(buf), "tlsf<%d>", SL_BITS);
+        return buf;
+    }
+};
+
+/*********************************************************
+ * Fit: Fit::find(h, asize) returns a free block of at
+ * least asize bytes, or NULL. Only the heap's list walk
+ * (first_list, next_list, head, next) is used.
+ *********************************************************/
+
+/* the first block that fits, own list first */
+struct first_fit {
+    template <class H>
+    static char *find(H &h, size_t asize) {
+        for (int c = h.first_list(H::classes::of(asize)); c >= 0;
+             c = h.next_list(c))
+            for (char *bp = h.head(c); bp; bp = h.next(bp))
+                if (H::size(bp) >= asize)
+                    return bp;
+        return NULL;
+    }
+    static const char *name() { return "first"; }
+};
+
+/* the smallest of the first SCAN blocks that fit, like mm.c's find_fit */
+template <int SCAN>
+struct best_fit {
+    template <class H>
+    static char *find(H &h, size_t asize) {
+        for (int c = h.first_list(H::classes::of(asize)); c >= 0;
+             c = h.next_list(c)) {
+            char *best = NULL;
+            int seen = 0;
+            for (char *bp = h.head(c); bp && seen < SCAN; bp = h.next(bp)) {
+                size_t size = H::size(bp);
+                if (size < asize)
+                    continue;
+                if (size == asize)
+                    return bp;
+                if (!best || size < H::size(best))
+                    best = bp;
+                seen++;
+            }
+            if (best)
+                return best;
+        }
+        return NULL;
+    }
+    static const char *name() {
+        static char buf[16];
+        snprintf(buf, sizeof(buf), "best<%d>", SCAN);
+        return buf;
+    }
+};
+
+/* the head of the own list if it fits, else of the next list up: no walk */
+struct good_fit {
+    template <class H>
+    static char *find(H &h, size_t asize) {
+        int c = h.first_list(H::classes::of(asize));
+        if (c < 0)
+            return NULL;
+        if (H::size(h.head(c)) >= asize)
+            return h.head(c);
+        return (c = h.next_list(c)) < 0 ? NULL : h.head(c);
+    }
+    static const char *name() { return "good"; }
+};
+
+/*********************************************************
+ * Order: Order::insert(h, c, bp) puts free block bp on
+ * list c, using the heap's link_front and link_after.
+ *********************************************************/
+
+struct lifo_order {
+    template <class H>
+    static void insert(H &h, int c, char *bp) { h.link_front(c, bp); }
+    static const char *name() { return "lifo"; }
+};
+
+struct address_order {
+    template <class H>
+    static void insert(H &h, int c, char *bp) {
+        char *prev = NULL;
+        for (char *p = h.head(c); p && p < bp; p = h.next(p))
+            prev = p;
+        prev ? h.link_after(prev, bp) : h.link_front(c, bp);
+    }
+    static const char *name() { return "addr"; }
+};
+
+/* smallest first, which makes first_fit a best fit */
+struct size_order {
+    template <class H>
+    static void insert(H &h, int c, char *bp) {
+        size_t size = H::size(bp);
+        char *prev = NULL;
+        for (char *p = h.head(c); p && H::size(p) < size; p = h.next(p))
+            prev = p;
+        prev ? h.link_after(prev, bp) : h.link_front(c, bp);
+    }
+    static const char *name() { return "size"; }
+};
+
+/*********************************************************
+ * Coalesce: eager ones merge on every free, the others
+ * leave that to a sweep of the whole heap when a search
+ * comes back empty, before the heap grows.
+ *********************************************************/
+
+struct immediate {
+    static constexpr bool eager = true;
+    static const char *name() { return "eager"; }
+};
+
+struct deferred {
+    static constexpr bool eager = false;
+    static const char *name() { return "deferred"; }
+};
+
+/*********************************************************
+ * The heap
+ *********************************************************/
+
+template <class Classes, class Fit, class Order, class Coalesce,
+          size_t Align = 8>
+class heap {
+    static_assert(Align >= 8 && (Align & (Align - 1)) == 0 && Align <= 4096,
+                  "Align is a power of two from 8 to a page");
+public:
+    typedef Classes classes;
+    static constexpr size_t align = Align;
+
+    /* header(4) prev(4) next(4) footer(4), rounded to Align */
+    static constexpr size_t min_block = Align > 16 ? Align : 16;
+    /* least bytes the heap grows by, mm.c's CHUNKSIZE */
+    static constexpr size_t chunk = Align > 256 ? Align : 256;
+
+    /* init - start an empty heap at the bottom of memlib region 0 */
+    int init() {
+        char *p = (char *)mem_sbrk(Align);
+        if (p == (char *)-1)
+            return -1;
+        base = p;
+        top = p + Align;
+        /* the epilogue, with no prologue before it */
+        put(p + Align - 4, 1 | PREV_ALLOC);
+        memset(heads, 0xff, sizeof(heads));
+        memset(map, 0, sizeof(map));
+        return 0;
+    }
+
+    void *malloc(size_t size) {
+        size_t asize;
+        char *bp;
+
+        if (size == 0 || size > 0xfffff000UL - Align)
+            return NULL;
+        asize = (size + 4 + Align - 1) & ~(Align - 1);
+        if (asize < min_block)
+            asize = min_block;
+
+        if ((bp = Fit::find(*this, asize)) == NULL && !Coalesce::eager) {
+            sweep();
+            bp = Fit::find(*this, asize);
+        }
+        if (bp == NULL && (bp = grow(asize)) == NULL)
+            return NULL;
+        unlink(bp);
+        place(bp, asize);
+        return bp;
+    }
+
+    void free(void *ptr) {
+        char *bp = (char *)ptr;
+        size_t size;
+
+        if (bp == NULL)
+            return;
+        size = size_of(bp);
+        put(hdr(bp), size | (get(hdr(bp)) & PREV_ALLOC));
+        put(ftr(bp), size);
+        clear_prev_alloc(bp + size);
+        if (Coalesce::eager)
+            bp = merge(bp);
+        insert(bp);
+    }
+
+    void *realloc(void *ptr, size_t size) {
+        char *bp = (char *)ptr, *nbp;
+        size_t asize, old;
+
+        if (bp == NULL)
+            return malloc(size);
+        if (size == 0) {
+            free(bp);
+            return NULL;
+        }
+        asize = (size + 4 + Align - 1) & ~(Align - 1);
+        if (asize < min_block)
+            asize = min_block;
+        old = size_of(bp);
+        if (asize <= old)
+            return bp;
+
+        /* grow into a free neighbour when it is enough */
+        nbp = bp + old;
+        if (!alloc(nbp) && old + size_of(nbp) >= asize) {
+            unlink(nbp);
+            put(hdr(bp), (old + size_of(nbp)) | (get(hdr(bp)) & PREV_ALLOC) | 1);
+            set_prev_alloc(bp + size_of(bp));
+            split(bp, asize);
+            return bp;
+        }
+
+        if ((nbp = (char *)malloc(size)) == NULL)
+            return NULL;
+        memcpy(nbp, bp, old - 4);
+        free(bp);
+        return nbp;
+    }
+
+    /* payload bytes a block can hold */
+    static size_t usable(const void *bp) { return size_of((const char *)bp) - 4; }
+
+    /* the configuration, as "tlsf<2> best<32> lifo eager a8" */
+    static const char *name() {
+        static char buf[80];
+        snprintf(buf, sizeof(buf), "%s %s %s %s a%zu", Classes::name(),
+                 Fit::name(), Order::name(), Coalesce::name(), Align);
+        return buf;
+    }
+
+    /*
+     * The list walk, for Fit and Order
+     */
+
+    /* the first non-empty list from c on, or -1 */
+    int first_list(int c) const {
+        int w = c / 64;
+        unsigned long m;
+
+        if (c >= Classes::count)
+            return -1;
+        for (m = map[w] & (~0UL << (c % 64)); !m; m = map[w])
+            if (++w == MAP_WORDS)
+                return -1;
+        return w * 64 + __builtin_ctzl(m);
+    }
+    int next_list(int c) const { return first_list(c + 1); }
+
+    char *head(int c) const { return from(heads[c]); }
+    char *next(const char *bp) const { return from(get(bp + 4)); }
+    static size_t size(const char *bp) { return size_of(bp); }
+
+    void link_front(int c, char *bp) {
+        char *n = head(c);
+        put(bp, NIL);
+        put(bp + 4, heads[c]);
+        if (n)
+            put(n, off(bp));
+        heads[c] = off(bp);
+        map[c / 64] |= 1UL << (c % 64);
+    }
+
+    void link_after(char *prev, char *bp) {
+        char *n = next(prev);
+        put(bp, off(prev));
+        put(bp + 4, off(n));
+        if (n)
+            put(n, off(bp));
+        put(prev + 4, off(bp));
+    }
+
+private:
+    static constexpr unsigned ALLOC = 1, PREV_ALLOC = 2;
+    static constexpr int MAP_WORDS = (Classes::count + 63) / 64;
+
+    char *base;
+    char *top;                      /* the epilogue's payload, end of heap */
+    unsigned heads[Classes::count];
+    unsigned long map[MAP_WORDS];   /* set bit = list not empty */
+
+    static unsigned get(const char *p) { return *(const unsigned *)p; }
+    static void put(char *p, unsigned v) { *(unsigned *)p = v; }
+    static char *hdr(char *bp) { return bp - 4; }
+    static char *ftr(char *bp) { return bp + size_of(bp) - 8; }
+    static size_t size_of(const char *bp) { return get(bp - 4) & ~(size_t)(Align - 1); }
+    static bool alloc(const char *bp) { return get(bp - 4) & ALLOC; }
+    static bool prev_alloc(const char *bp) { return get(bp - 4) & PREV_ALLOC; }
+    static void set_prev_alloc(char *bp) { put(hdr(bp), get(hdr(bp)) | PREV_ALLOC); }
+    static void clear_prev_alloc(char *bp) { put(hdr(bp), get(hdr(bp)) & ~PREV_ALLOC); }
+
+    unsigned off(const char *p) const {
+        return p ? (unsigned)((p - base) / Align) : NIL;
+    }
+    char *from(unsigned o) const {
+        return o == NIL ? NULL : base + (size_t)o * Align;
+    }
+
+    void insert(char *bp) { Order::insert(*this, Classes::of(size_of(bp)), bp); }
+
+    void unlink(char *bp) {
+        char *p = from(get(bp)), *n = next(bp);
+        int c;
+
+        if (p) {
+            put(p + 4, off(n));
+        } else {
+            c = Classes::of(size_of(bp));
+            heads[c] = off(n);
+            if (!n)
+                map[c / 64] &= ~(1UL << (c % 64));
+        }
+        if (n)
+            put(n, off(p));
+    }
+
+    /* merge - join unlisted free bp with its free neighbours, which are */
+    char *merge(char *bp) {
+        size_t size = size_of(bp);
+        char *nbp = bp + size;
+
+        if (!alloc(nbp)) {
+            unlink(nbp);
+            size += size_of(nbp);
+        }
+        if (!prev_alloc(bp)) {
+            bp -= get(bp - 8) & ~(size_t)(Align - 1);
+            unlink(bp);
+            size += size_of(bp);
+        }
+        /* deferred coalescing can leave yet another free block in front */
+        put(hdr(bp), size | (get(hdr(bp)) & PREV_ALLOC));
+        put(ftr(bp), size);
+        return bp;
+    }
+
+    /* sweep - merge every run of free blocks, for deferred coalescing */
+    void sweep() {
+        char *bp;
+
+        memset(heads, 0xff, sizeof(heads));
+        memset(map, 0, sizeof(map));
+        for (bp = base + Align; bp < top; bp += size_of(bp)) {
+            if (alloc(bp))
+                continue;
+            size_t size = size_of(bp);
+            while (!alloc(bp + size))
+                size += size_of(bp + size);
+            put(hdr(bp), size | PREV_ALLOC);
+            put(ftr(bp), size);
+            insert(bp);
+        }
+    }
+
+    /* grow - extend the heap by at least asize, returning a listed free block */
+    char *grow(size_t asize) {
+        char *bp;
+        size_t tail = 0, want;
+
+        /* a free block at the top only needs topping up */
+        if (!prev_alloc(top))
+            tail = get(top - 8) & ~(size_t)(Align - 1);
+        /* or none at all, when a Fit that skims list heads passed it over */
+        if (tail >= asize)
+            return top - tail;
+        want = asize - tail > chunk ? asize - tail : chunk;
+        if ((bp = (char *)mem_sbrk(want)) == (char *)-1)
+            return NULL;
+        put(hdr(bp), want | (get(hdr(bp)) & PREV_ALLOC));
+        put(ftr(bp), want);
+        top = bp + want;
+        put(hdr(top), ALLOC);       /* the new epilogue */
+        if (tail) {
+            /* merge pulls the tail off its list */
+            bp = merge(bp);
+        }
+        insert(bp);
+        return bp;
+    }
+
+    /* place - mark free unlisted bp allocated, returning its tail */
+    void place(char *bp, size_t asize) {
+        put(hdr(bp), size_of(bp) | (get(hdr(bp)) & PREV_ALLOC) | ALLOC);
+        set_prev_alloc(bp + size_of(bp));
+        split(bp, asize);
+    }
+
+    /* split - give the bytes of allocated bp past asize back as free */
+    void split(char *bp, size_t asize) {
+        size_t size = size_of(bp);
+        char *rest;
+
+        if (size - asize < min_block)
+            return;
+        put(hdr(bp), asize | (get(hdr(bp)) & PREV_ALLOC) | ALLOC);
+        rest = bp + asize;
+        put(hdr(rest), (size - asize) | PREV_ALLOC);
+        put(ftr(rest), size - asize);
+        clear_prev_alloc(rest + size - asize);
+        if (Coalesce::eager && !alloc(rest + size - asize))
+            rest = merge(rest);
+        insert(rest);
+    }
+};
+
+} /* namespace mmpolicy */
+
+#endif /* __MMPOLICY_HPP__ */
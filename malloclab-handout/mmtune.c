@@ -0,0 +1,361 @@
+/*
+ * mmtune.c - Derive mm.c size class parameters from recorded traces
+ *
+ * usage: mmtune [-v] [-u <weight>] [-o <out.h>] <trace>...
+ *
+ * Reads .rep or binary (see trace.h) traces and picks, for the mix of
+ * requests they record, the values of
+ *
+ *   SL_BITS    second level classes per power of two of the free index
+ *   CHUNKSIZE  least bytes the heap is extended by
+ *   SLAB_MAX   largest request served from a slab run
+ *
+ * that minimize weight * util cost + (1 - weight) * time cost, each
+ * summed over the traces by trace weight. The weight defaults to
+ * mdriver's UTIL_WEIGHT; -v prints the cost of every candidate. The
+ * result is a header mm.c compiles against:
+ *
+ *   unix> ./mmtune -o svc.h traces/svc-*.rep
+ *   unix> make clean; make MM_CONFIG=svc.h
+ *
+ * The costs come from replaying each trace against a model of the
+ * allocator, not the allocator itself, and each parameter is chosen on
+ * its own. Both are rough; mdriver has the last word on a tuned build.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "mmlayout.h"
+#include "tracefile.h"
+
+/* mm.c's block layout, the rest is in mmlayout.h */
+#define ALIGN(s)  (((size_t)(s) + (ALIGNMENT-1)) & ~(size_t)(ALIGNMENT-1))
+#define MINBLOCK  (1 << FL_MIN)
+
+/* candidate ranges */
+#define SL_BITS_MAX   4     /* get_class shifts by FL_MIN - SL_BITS */
+#define CHUNK_MIN_LOG 5
+#define CHUNK_MAX_LOG 16
+#define SLAB_LIMIT    512   /* keeps a run at eight objects or more */
+#define SLAB_CLS      (SLAB_LIMIT / ALIGNMENT)
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+#define RUN_ROOM  (SLAB_RUN - 4 - ALIGN(sizeof(run_t))) /* object bytes of a run */
+
+/* what the time costs are counted in */
+#define LINE      64        /* cache line bytes, for the index table */
+#define LINE_NS   0.5       /* a line of index table per request */
+#define STEP_NS   1         /* a free block looked at */
+#define EXTEND_NS 200       /* extend_heap, with its sbrk */
+#define RUN_NS    1000      /* a run taken from and given back to the heap */
+
+static void die(const char *msg, const char *name)
+{
+    fprintf(stderr, "mmtune: %s %s\n", msg, name);
+    exit(1);
+}
+
+static void *xmalloc(size_t n)
+{
+    void *p = malloc(n ? n : 1);
+    if (p == NULL)
+        die("out of memory reading", "traces");
+    return p;
+}
+
+/* the block size mm.c gives a request of s bytes */
+static size_t asize(size_t s)
+{
+    size_t a = ALIGN(s + 4);
+    return a < MINBLOCK ? MINBLOCK : a;
+}
+
+/* the free list mm.c keeps a block of size a on */
+static int get_class(size_t a, int sl_bits)
+{
+    int f = 63 - __builtin_clzl(a);
+    if (f >= FL_MIN + FL_COUNT)
+        return (FL_COUNT << sl_bits) - 1;
+    return ((f - FL_MIN) << sl_bits) | (int)((a >> (f - sl_bits)) & ((1 << sl_bits) - 1));
+}
+
+static int cmp_size(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * sl_cost - free index costs of sl_bits. find_fit takes the lowest
+ * addressed fit of up to FIT_SCAN blocks of the request's own class, so
+ * util hardly minds how sizes share a class; the walk does. A request
+ * looks at as many of its class's blocks as there are, up to FIT_SCAN.
+ * Time: those steps, and the index table in cache lines.
+ */
+static void sl_cost(const trace_file_t *t, int sl_bits, double *loss, double *ns)
+{
+    size_t *sz = xmalloc(t->num_ops * sizeof(size_t));
+    int i, j, n = 0;
+    double steps = 0;
+
+    for (i = 0; i < t->num_ops; i++)
+        if (t->ops[i].type != TRACE_FREE)
+            sz[n++] = asize(t->ops[i].size);
+    qsort(sz, n, sizeof(size_t), cmp_size);
+
+    /* sorted sizes keep each class in one stretch */
+    for (i = 0; i < n; i = j) {
+        int cls = get_class(sz[i], sl_bits);
+        for (j = i; j < n && get_class(sz[j], sl_bits) == cls; j++)
+            ;
+        steps += (double)(j - i) * MIN(j - i, FIT_SCAN);
+    }
+    free(sz);
+
+    *loss = 0;
+    *ns = steps * STEP_NS + (double)t->num_ops *
+        ((4 * (1 + FL_COUNT + (FL_COUNT << sl_bits)) + LINE - 1) / LINE) * LINE_NS;
+}
+
+/*
+ * chunk_cost - heap extension costs of chunk bytes, with the heap as a
+ * perfect fit of the live blocks. Util: bytes past the peak live bytes
+ * the heap was extended to. Time: the extensions.
+ */
+static void chunk_cost(const trace_file_t *t, size_t chunk, double *loss, double *ns)
+{
+    size_t *live = xmalloc(t->num_ids * sizeof(size_t));
+    size_t bytes = 0, peak = 0, heap = chunk;
+    long extends = 1;
+    int i;
+
+    memset(live, 0, t->num_ids * sizeof(size_t));
+    for (i = 0; i < t->num_ops; i++) {
+        trace_op_t *op = &t->ops[i];
+        bytes -= live[op->index];
+        live[op->index] = op->type == TRACE_FREE ? 0 : asize(op->size);
+        bytes += live[op->index];
+        if (bytes > heap) {
+            heap += bytes - heap > chunk ? bytes - heap : chunk;
+            extends++;
+        }
+        if (bytes > peak)
+            peak = bytes;
+    }
+    free(live);
+
+    *loss = (double)(heap - peak) / heap;
+    *ns = (double)extends * EXTEND_NS;
+}
+
+/*
+ * slab_cost - costs of serving requests up to slab_max from runs, for
+ * every slab_max up to SLAB_LIMIT at once. A slot saves the header word
+ * of the heap block it replaces, while a class holds whole runs however
+ * few of its slots are live; a run is taken when the class outgrows its
+ * runs and given back when one run's worth of slots is free. Runs only
+ * start once the heap passes SLAB_HEAP. Util: run bytes past the heap
+ * blocks they replace, at the peak. Time: the runs taken.
+ */
+static void slab_cost(const trace_file_t *t, double loss[SLAB_CLS + 1],
+                      double ns[SLAB_CLS + 1])
+{
+    size_t *live = xmalloc(t->num_ids * sizeof(size_t));
+    char *slab = xmalloc(t->num_ids);
+    long count[SLAB_CLS] = {0}, runs[SLAB_CLS] = {0}, taken[SLAB_CLS] = {0};
+    long heap[SLAB_CLS] = {0};      /* bytes the slots would take as blocks */
+    long peak_runs[SLAB_CLS] = {0}, peak_heap[SLAB_CLS] = {0};
+    size_t bytes = 0, peak = 0;
+    double lost = 0, extra = 0;
+    int i, c, nobjs;
+
+    memset(live, 0, t->num_ids * sizeof(size_t));
+    memset(slab, 0, t->num_ids);
+    for (i = 0; i < t->num_ops; i++) {
+        trace_op_t *op = &t->ops[i];
+        size_t old = live[op->index];
+        if (slab[op->index]) {
+            c = ALIGN(old) / ALIGNMENT - 1;
+            nobjs = RUN_ROOM / ALIGN(old);
+            count[c]--;
+            heap[c] -= asize(old);
+            if (count[c] <= (runs[c] - 1) * nobjs)
+                runs[c]--;
+            slab[op->index] = 0;
+        }
+        if (live[op->index])
+            bytes -= asize(old);
+        live[op->index] = 0;
+        if (op->type == TRACE_FREE)
+            continue;
+        live[op->index] = op->size ? op->size : 1;
+        bytes += asize(op->size);
+        if (peak >= SLAB_HEAP && op->size <= SLAB_LIMIT &&
+            ALIGN(op->size) < asize(op->size)) {
+            c = ALIGN(op->size) / ALIGNMENT - 1;
+            nobjs = RUN_ROOM / ALIGN(op->size);
+            count[c]++;
+            heap[c] += asize(op->size);
+            if (count[c] > runs[c] * nobjs) {
+                runs[c]++;
+                taken[c]++;
+            }
+            slab[op->index] = 1;
+        }
+        if (bytes > peak) {
+            peak = bytes;
+            memcpy(peak_runs, runs, sizeof(runs));
+            memcpy(peak_heap, heap, sizeof(heap));
+        }
+    }
+    free(live);
+    free(slab);
+
+    loss[0] = ns[0] = 0;
+    for (c = 0; c < SLAB_CLS; c++) {
+        lost += (double)peak_runs[c] * SLAB_RUN - peak_heap[c];
+        extra += (double)taken[c] * RUN_NS;
+        loss[c + 1] = peak ? lost / peak : 0;
+        ns[c + 1] = extra;
+    }
+}
+
+/*
+ * grade - cost of losing loss of the util and ns per request, on the
+ * scale mdriver grades on: util between MIN_SPACE and MAX_SPACE, and
+ * throughput between MIN_SPEED and MAX_SPEED, taken to run at the top.
+ * Like mdriver, callers average util over traces but throughput over
+ * all their requests together.
+ */
+static double grade(double weight, double loss, double ns)
+{
+    double op_ns = 1e9 / MAX_SPEED;
+
+    return weight * loss / (MAX_SPACE - MIN_SPACE) +
+        (1 - weight) * MAX_SPEED / (MAX_SPEED - MIN_SPEED) * ns / (op_ns + ns);
+}
+
+int main(int argc, char **argv)
+{
+    double weight = UTIL_WEIGHT, total = 0, u, t, best;
+    double ops = 0;
+    double sl[SL_BITS_MAX + 1] = {0}, sl_ns[SL_BITS_MAX + 1] = {0};
+    double chunk[CHUNK_MAX_LOG + 1] = {0}, chunk_ns[CHUNK_MAX_LOG + 1] = {0};
+    double slab[SLAB_CLS + 1] = {0}, slab_ns[SLAB_CLS + 1] = {0};
+    double su[SLAB_CLS + 1], st[SLAB_CLS + 1];
+    const char *outname = NULL;
+    FILE *out = stdout;
+    trace_file_t *tr;
+    int ntr, i, b, c, sl_bits = 1, chunk_log = CHUNK_MIN_LOG, slab_cls = 0;
+    int verbose = 0;
+
+    while ((c = getopt(argc, argv, "u:o:vh")) != EOF) {
+        switch (c) {
+        case 'u':
+            weight = atof(optarg);
+            if (weight < 0 || weight > 1)
+                die("util weight must be in [0, 1], got", optarg);
+            break;
+        case 'o':
+            outname = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-v] [-u <weight>] [-o <out.h>] <trace>...\n",
+                    argv[0]);
+            exit(c != 'h');
+        }
+    }
+    if ((ntr = argc - optind) == 0)
+        die("no traces", "given");
+
+    tr = xmalloc(ntr * sizeof(trace_file_t));
+    for (i = 0; i < ntr; i++) {
+        if (trace_load(&tr[i], argv[optind + i]) < 0)
+            exit(1);
+        total += tr[i].weight;
+    }
+    if (total == 0)
+        die("all traces have weight", "0");
+
+    for (i = 0; i < ntr; i++) {
+        double w = tr[i].weight / total;
+        if (w == 0)
+            continue;
+        ops += w * tr[i].num_ops;
+        for (b = 1; b <= SL_BITS_MAX; b++) {
+            sl_cost(&tr[i], b, &u, &t);
+            sl[b] += w * u;
+            sl_ns[b] += w * t;
+        }
+        for (b = CHUNK_MIN_LOG; b <= CHUNK_MAX_LOG; b++) {
+            chunk_cost(&tr[i], (size_t)1 << b, &u, &t);
+            chunk[b] += w * u;
+            chunk_ns[b] += w * t;
+        }
+        slab_cost(&tr[i], su, st);
+        for (c = 0; c <= SLAB_CLS; c++) {
+            slab[c] += w * su[c];
+            slab_ns[c] += w * st[c];
+        }
+    }
+    if (ops == 0)
+        die("no requests in", "traces");
+    for (b = 1; b <= SL_BITS_MAX; b++)
+        sl[b] = grade(weight, sl[b], sl_ns[b] / ops);
+    for (b = CHUNK_MIN_LOG; b <= CHUNK_MAX_LOG; b++)
+        chunk[b] = grade(weight, chunk[b], chunk_ns[b] / ops);
+    for (c = 0; c <= SLAB_CLS; c++)
+        slab[c] = grade(weight, slab[c], slab_ns[c] / ops);
+
+    /* ties go to the smaller table, chunk and run set */
+    for (best = sl[1], b = 2; b <= SL_BITS_MAX; b++)
+        if (sl[b] < best)
+            best = sl[sl_bits = b];
+    for (best = chunk[CHUNK_MIN_LOG], b = CHUNK_MIN_LOG + 1; b <= CHUNK_MAX_LOG; b++)
+        if (chunk[b] < best)
+            best = chunk[chunk_log = b];
+    for (best = slab[0], c = 1; c <= SLAB_CLS; c++)
+        if (slab[c] < best)
+            best = slab[slab_cls = c];
+    /* mm.c sizes its run tables by SLAB_MAX, keep one class */
+    if (slab_cls == 0)
+        slab_cls = 1;
+
+    if (verbose) {
+        for (b = 1; b <= SL_BITS_MAX; b++)
+            fprintf(stderr, "SL_BITS   %6d: %.4f\n", b, sl[b]);
+        for (b = CHUNK_MIN_LOG; b <= CHUNK_MAX_LOG; b++)
+            fprintf(stderr, "CHUNKSIZE %6d: %.4f\n", 1 << b, chunk[b]);
+        for (c = 1; c <= SLAB_CLS; c++)
+            fprintf(stderr, "SLAB_MAX  %6d: %.4f\n", c * ALIGNMENT, slab[c]);
+    }
+
+    fprintf(stderr, "SL_BITS %d (cost %.4f), CHUNKSIZE %d (cost %.4f), "
+            "SLAB_MAX %d (cost %.4f)\n", sl_bits, sl[sl_bits],
+            1 << chunk_log, chunk[chunk_log], slab_cls * ALIGNMENT,
+            slab[slab_cls]);
+
+    if (outname && (out = fopen(outname, "w")) == NULL)
+        die("could not create", outname);
+    fprintf(out, "/*\n * Generated by mmtune with util weight %.2f from\n", weight);
+    for (i = 0; i < ntr; i++)
+        fprintf(out, " *   %s\n", tr[i].name);
+    fprintf(out, " * Build with make MM_CONFIG=<this file>.\n */\n");
+    fprintf(out, "#define SL_BITS   %d\n", sl_bits);
+    fprintf(out, "#define CHUNKSIZE (1<<%d)\n", chunk_log);
+    fprintf(out, "#define SLAB_MAX  %d\n", slab_cls * ALIGNMENT);
+    if (outname && fclose(out) != 0)
+        die("could not write", outname);
+
+    for (i = 0; i < ntr; i++)
+        trace_unload(&tr[i]);
+    free(tr);
+    return 0;
+}
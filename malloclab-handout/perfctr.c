@@ -0,0 +1,102 @@
+/*
+ * perfctr.c - Hardware event counts around a timed run, from perf_event
+ *
+ * Each event gets a counter of its own on the calling thread, user
+ * space only, so that perf_event_paranoid up to 2 lets us have it. An
+ * event the cpu or the kernel won't give us (no PMU under most VMs)
+ * is left out and reads as -1. When there are more events than
+ * hardware counters the kernel multiplexes them, and the counts are
+ * scaled up by the time each was enabled over the time it ran.
+ */
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perfctr.h"
+
+#define CACHE_READ_MISS(cache) ((cache) | PERF_COUNT_HW_CACHE_OP_READ << 8 | \
+                                PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+static const struct {
+    unsigned type;
+    unsigned long long config;
+} events[PERFCTR_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+static int fds[PERFCTR_EVENTS];
+static pid_t owner;     /* process the counters count, 0 if none open */
+
+/*
+ * perfctr_open - open a counter per event for the calling process,
+ *     closing those of before. Return how many could be opened.
+ */
+int perfctr_open(void)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+        if (owner && fds[i] >= 0)
+            close(fds[i]);
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+            PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[i] >= 0)
+            n++;
+    }
+    owner = getpid();
+    return n;
+}
+
+/*
+ * perfctr_start - reset and start the counters. A forked child has its
+ *     parent's, which count the parent, so it opens its own.
+ */
+void perfctr_start(void)
+{
+    int i;
+
+    if (owner != getpid())
+        perfctr_open();
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/*
+ * perfctr_stop - stop the counters and read them into c
+ */
+void perfctr_stop(perfctr_t *c)
+{
+    unsigned long long v[3]; /* value, time enabled, time running */
+    int i;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++)
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+        c->count[i] = -1;
+        if (fds[i] < 0 || read(fds[i], v, sizeof(v)) != sizeof(v))
+            continue;
+        c->count[i] = v[2] ? (double)v[0] * v[1] / v[2] : 0;
+    }
+}
@@ -0,0 +1,33 @@
+/*
+ * perfctr.h - Hardware event counts around a timed run, from perf_event
+ */
+#ifndef __PERFCTR_H__
+#define __PERFCTR_H__
+
+/* the events counted, in the order of perfctr_t's counts */
+enum {
+    PERFCTR_INSNS,           /* instructions retired */
+    PERFCTR_CYCLES,          /* cpu cycles */
+    PERFCTR_L1D_MISSES,      /* L1 data cache read misses */
+    PERFCTR_LLC_MISSES,      /* last level cache misses */
+    PERFCTR_BRANCH_MISSES,   /* mispredicted branches */
+    PERFCTR_DTLB_MISSES,     /* data TLB read misses */
+    PERFCTR_FAULTS,          /* page faults, a software event */
+    PERFCTR_EVENTS
+};
+
+typedef struct {
+    double count[PERFCTR_EVENTS]; /* -1 for an event that was not counted */
+} perfctr_t;
+
+/* Open a counter per event for the calling process, return how many
+   the machine gives us */
+int perfctr_open(void);
+
+/* Reset and start the counters, reopening them after a fork */
+void perfctr_start(void);
+
+/* Stop the counters and read them into c */
+void perfctr_stop(perfctr_t *c);
+
+#endif /* __PERFCTR_H__ */
@@ -0,0 +1,112 @@
+/*
+ * rep2bin.c - Convert a .rep text trace to the binary trace format
+ *
+ * usage: rep2bin <in.rep> <out.bin>
+ *
+ * The binary format is described in trace.h. mdriver tells the two
+ * formats apart by the magic number, so a converted trace can be run
+ * with -f like any other.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/* longest encoding of one request: four 10-byte varints */
+#define MAXREQ 40
+
+static void die(const char *msg, const char *name)
+{
+    fprintf(stderr, "rep2bin: %s %s\n", msg, name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    unsigned char buf[4 * MAXREQ], *p;
+    char type[1024];
+    int weight, num_ids, num_ops, ignore_ranges, i;
+    int index, prev = 0;
+    unsigned size = 0, align;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <in.rep> <out.bin>\n", argv[0]);
+        exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+        die("could not open", argv[1]);
+    if ((out = fopen(argv[2], "w")) == NULL)
+        die("could not create", argv[2]);
+
+    if (fscanf(in, "%d %d %d %d", &weight, &num_ids, &num_ops,
+               &ignore_ranges) != 4)
+        die("bad header in", argv[1]);
+    p = buf;
+    memcpy(p, TRACE_MAGIC, TRACE_MAGIC_LEN);
+    p += TRACE_MAGIC_LEN;
+    p = put_varint(p, weight);
+    p = put_varint(p, num_ids);
+    p = put_varint(p, num_ops);
+    p = put_varint(p, ignore_ranges);
+    fwrite(buf, 1, p - buf, out);
+
+    for (i = 0; i < num_ops; i++) {
+        if (fscanf(in, "%s", type) != 1)
+            die("too few requests in", argv[1]);
+        p = buf;
+        switch (type[0]) {
+        case 'a':
+        case 'r':
+            /* a size left out repeats the last one, as in mdriver */
+            if (fscanf(in, "%d", &index) != 1)
+                die("bad request in", argv[1]);
+            if (fscanf(in, "%u", &size) != 1 && ferror(in))
+                die("could not read", argv[1]);
+            p = put_varint(p, zigzag(index - prev) << 2 |
+                           (type[0] == 'a' ? TRACE_ALLOC : TRACE_REALLOC));
+            p = put_varint(p, size);
+            break;
+        case 'f':
+            if (fscanf(in, "%d", &index) != 1)
+                die("bad request in", argv[1]);
+            p = put_varint(p, zigzag(index - prev) << 2 | TRACE_FREE);
+            break;
+        case 'm':
+            if (fscanf(in, "%d %u %u", &index, &size, &align) != 3)
+                die("bad request in", argv[1]);
+            p = put_varint(p, zigzag(index - prev) << 2 | TRACE_EXT);
+            p = put_varint(p, TRACE_MEMALIGN - TRACE_EXT);
+            p = put_varint(p, size);
+            p = put_varint(p, align);
+            break;
+        case 's':
+        case 'u':
+            if (fscanf(in, "%d", &index) != 1)
+                die("bad request in", argv[1]);
+            p = put_varint(p, zigzag(index - prev) << 2 | TRACE_EXT);
+            p = put_varint(p, (type[0] == 's' ? TRACE_FREE_SIZED : TRACE_USABLE) -
+                           TRACE_EXT);
+            break;
+        case 'c':
+            if (fscanf(in, "%d", &index) != 1)
+                die("bad request in", argv[1]);
+            if (fscanf(in, "%u", &size) != 1 && ferror(in))
+                die("could not read", argv[1]);
+            p = put_varint(p, zigzag(index - prev) << 2 | TRACE_EXT);
+            p = put_varint(p, TRACE_CALLOC - TRACE_EXT);
+            p = put_varint(p, size);
+            break;
+        default:
+            die("bogus request type in", argv[1]);
+        }
+        prev = index;
+        fwrite(buf, 1, p - buf, out);
+    }
+
+    fclose(in);
+    if (fclose(out) != 0)
+        die("could not write", argv[2]);
+    return 0;
+}
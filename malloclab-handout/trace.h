@@ -0,0 +1,76 @@
+/*
+ * trace.h - Binary trace format, written by rep2bin and read by mdriver
+ *
+ * A binary trace carries the same header and requests as a .rep text
+ * trace, every number an unsigned LEB128 varint:
+ *
+ *   "MTR1" weight num_ids num_ops ignore_ranges
+ *   then for each request
+ *     zigzag(index - previous index) << 2 | min(type, TRACE_EXT)
+ *     type - TRACE_EXT, for types from TRACE_EXT on only
+ *     size, for allocs, reallocs, memaligns and callocs only
+ *     alignment, for memaligns only
+ *
+ * Most requests touch a block close to the one before, so a request
+ * usually packs into two to four bytes against the ten or so of text.
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#define TRACE_MAGIC     "MTR1"
+#define TRACE_MAGIC_LEN 4
+
+/* request types, in the order of mdriver's traceop_t */
+#define TRACE_ALLOC      0
+#define TRACE_FREE       1
+#define TRACE_REALLOC    2
+#define TRACE_MEMALIGN   3  /* "m id size alignment" in a .rep trace */
+#define TRACE_FREE_SIZED 4  /* "s id", free with the block's size */
+#define TRACE_USABLE     5  /* "u id", then use all of the usable size */
+#define TRACE_CALLOC     6  /* "c id size", a zeroed alloc */
+
+#define TRACE_EXT        3  /* the two type bits of every type from here on */
+
+/* put_varint - store v at p, return the byte after it */
+static inline unsigned char *put_varint(unsigned char *p, unsigned long v)
+{
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+/* get_varint - load *v from p, return the byte after it, or NULL if
+ * the varint runs past end */
+static inline const unsigned char *get_varint(const unsigned char *p,
+                                              const unsigned char *end,
+                                              unsigned long *v)
+{
+    unsigned long x = 0;
+    int shift = 0;
+
+    while (p < end && shift < 64) {
+        x |= (unsigned long)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *v = x;
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+/* small deltas of either sign become small unsigned numbers */
+static inline unsigned long zigzag(long v)
+{
+    return ((unsigned long)v << 1) ^ (unsigned long)(v >> (8 * sizeof(long) - 1));
+}
+
+static inline long unzigzag(unsigned long v)
+{
+    return (long)(v >> 1) ^ -(long)(v & 1);
+}
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,42 @@
+/*
+ * tracefile.h - Load a .rep or binary trace for the tools around mdriver
+ *
+ * mdriver keeps its own reader, which also sets up the block tables it
+ * replays into. mmtune and mdriver-policy only need the requests, and
+ * only model sizes: a memalign or calloc loads as an alloc of its size,
+ * a sized free as a free, and usable size queries are dropped.
+ */
+#ifndef __TRACEFILE_H__
+#define __TRACEFILE_H__
+
+#include <stddef.h>
+
+#include "trace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    int type;               /* TRACE_ALLOC, TRACE_FREE or TRACE_REALLOC */
+    int index;              /* block id, never free(NULL)'s -1 */
+    size_t size;
+} trace_op_t;
+
+typedef struct {
+    const char *name;
+    double weight;          /* 0: not graded, and no requests loaded */
+    int num_ids;
+    int num_ops;
+    trace_op_t *ops;
+} trace_file_t;
+
+/* Returns 0, or -1 after saying what is wrong with the trace on stderr */
+int trace_load(trace_file_t *t, const char *name);
+void trace_unload(trace_file_t *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TRACEFILE_H__ */
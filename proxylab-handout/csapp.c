@@ -573,31 +573,51 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 /* $end rio_writen */
 
 
+/*
+ * rio_fill - refill the internal buffer if it is empty. Returns the
+ *    number of unread bytes, 0 on EOF, -1 on error.
+ */
+/* $begin rio_fill */
+static ssize_t rio_fill(rio_t *rp)
+{
+    while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_bufsize);
+	if (rp->rio_cnt < 0) {
+	    if (errno != EINTR) /* interrupted by sig handler return */
+		return -1;
+	}
+	else if (rp->rio_cnt == 0)  /* EOF */
+	    return 0;
+	else 
+	    rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
+    }
+    return rp->rio_cnt;
+}
+/* $end rio_fill */
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
  *    buffer, where n is the number of bytes requested by the user and
  *    rio_cnt is the number of unread bytes in the internal buffer. On
  *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ *    read() if the internal buffer is empty. Requests at least as big
+ *    as the buffer bypass it and read straight into the user buffer.
  */
 /* $begin rio_read */
 static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 {
     int cnt;
+    ssize_t rc;
 
-    while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
-	if (rp->rio_cnt < 0) {
+    if (rp->rio_cnt <= 0 && n >= rp->rio_bufsize) {
+	while ((rc = read(rp->rio_fd, usrbuf, n)) < 0)
 	    if (errno != EINTR) /* interrupted by sig handler return */
 		return -1;
-	}
-	else if (rp->rio_cnt == 0)  /* EOF */
-	    return 0;
-	else 
-	    rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
+	return rc;
     }
+    if ((rc = rio_fill(rp)) <= 0)
+	return rc;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -615,12 +635,25 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
  */
 /* $begin rio_readinitb */
 void rio_readinitb(rio_t *rp, int fd) 
+{
+    rio_readinitbuf(rp, fd, rp->rio_ibuf, sizeof(rp->rio_ibuf));
+}
+/* $end rio_readinitb */
+
+/*
+ * rio_readinitbuf - Like rio_readinitb, but read through a caller
+ *    supplied buffer of bufsize bytes instead of the embedded one
+ */
+/* $begin rio_readinitbuf */
+void rio_readinitbuf(rio_t *rp, int fd, void *buf, size_t bufsize) 
 {
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
+    rp->rio_buf = buf;
+    rp->rio_bufsize = bufsize;
     rp->rio_bufptr = rp->rio_buf;
 }
-/* $end rio_readinitb */
+/* $end rio_readinitbuf */
 
 /*
  * rio_readnb - Robustly read n bytes (buffered)
@@ -654,27 +687,295 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n')
-		break;
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *nl = NULL, *bufp = usrbuf;
+
+    if (maxlen == 0)
+	return 0;         /* no room, not even for the NUL */
+    while (n < maxlen - 1 && !nl) { 
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;    /* error */
+	if (rc == 0)
+	    break;        /* EOF */
+
+	/* Copy up to and including the newline in one go */
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
     }
     *bufp = 0;
     return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_peekline - return the next text line without copying it. *linep
+ *    points into the internal buffer and the line, including its
+ *    newline, is consumed; it stays valid until the next call on rp.
+ *    A line longer than the buffer comes back in buffer-sized pieces
+ *    with no newline. Returns the line length, 0 on EOF, -1 on error.
+ */
+/* $begin rio_peekline */
+ssize_t rio_peekline(rio_t *rp, char **linep) 
+{
+    size_t scanned = 0, n;
+    ssize_t rc;
+    char *nl, *end;
+
+    for (;;) {
+	/* memchr is vectorized in libc; only scan the new bytes */
+	nl = memchr(rp->rio_bufptr + scanned, '\n', rp->rio_cnt - scanned);
+	if (nl) {
+	    n = nl - rp->rio_bufptr + 1;
+	    break;
+	}
+	scanned = rp->rio_cnt;
+	if (rp->rio_cnt == rp->rio_bufsize) { /* line fills the buffer */
+	    n = rp->rio_cnt;
+	    break;
+	}
+
+	/* Slide the partial line to the front if there is no room after it */
+	end = rp->rio_bufptr + rp->rio_cnt;
+	if (end == rp->rio_buf + rp->rio_bufsize) {
+	    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	    rp->rio_bufptr = rp->rio_buf;
+	    end = rp->rio_buf + rp->rio_cnt;
+	}
+	if (rp->rio_cnt == 0)
+	    rp->rio_bufptr = end = rp->rio_buf;
+	rc = read(rp->rio_fd, end, rp->rio_buf + rp->rio_bufsize - end);
+	if (rc < 0) {
+	    if (errno == EINTR) /* interrupted by sig handler return */
+		continue;
+	    return -1;
+	}
+	if (rc == 0) {          /* EOF, return the unterminated tail */
+	    n = rp->rio_cnt;
+	    if (n == 0)
+		return 0;
+	    break;
+	}
+	rp->rio_cnt += rc;
+    }
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    return n;
+}
+/* $end rio_peekline */
+
+/*
+ * rio_peekb - return every unread byte in the internal buffer (refilling
+ *    it first if it is empty) without copying. The bytes are consumed
+ *    and stay valid until the next call on rp. Returns the number of
+ *    bytes, 0 on EOF, -1 on error.
+ */
+/* $begin rio_peekb */
+ssize_t rio_peekb(rio_t *rp, char **bufp) 
+{
+    ssize_t n;
+
+    if ((n = rio_fill(rp)) <= 0)
+	return n;
+    *bufp = rp->rio_bufptr;
+    rp->rio_bufptr += n;
+    rp->rio_cnt = 0;
+    return n;
+}
+/* $end rio_peekb */
+
+/*
+ * rio_writev_all - write every byte described by iov, restarting after
+ *    short writes, signal interruptions and (for non-blocking fds)
+ *    EAGAIN, in which case we wait for the fd to become writable.
+ *    Sockets are written with MSG_NOSIGNAL, so a vanished peer is an
+ *    EPIPE return rather than a SIGPIPE. The iov array is consumed
+ *    in place.
+ */
+/* $begin rio_writev_all */
+static ssize_t rio_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t nwritten, total = 0;
+    struct pollfd pfd;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+
+    while (iovcnt > 0) {
+	if (iov->iov_len == 0) { /* skip drained entries */
+	    iov++;
+	    iovcnt--;
+	    continue;
+	}
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	if ((nwritten = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == ENOTSOCK)
+	    nwritten = writev(fd, iov, iovcnt);
+	if (nwritten < 0) {
+	    if (errno == EINTR)  /* interrupted by sig handler return */
+		continue;        /* and call writev() again */
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		pfd.fd = fd;     /* non-blocking fd is full, wait for room */
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		    return -1;
+		continue;
+	    }
+	    return -1;           /* errno set by writev() */
+	}
+	total += nwritten;
+	while (nwritten > 0) {   /* advance past what was written */
+	    if ((size_t)nwritten >= iov->iov_len) {
+		nwritten -= iov->iov_len;
+		iov++;
+		iovcnt--;
+	    } else {
+		iov->iov_base = (char *)iov->iov_base + nwritten;
+		iov->iov_len -= nwritten;
+		nwritten = 0;
+	    }
+	}
+    }
+    return total;
+}
+/* $end rio_writev_all */
+
+/*
+ * rio_writeinitb - Associate a descriptor with a write buffer
+ */
+/* $begin rio_writeinitb */
+void rio_writeinitb(rio_wbuf_t *wp, int fd) 
+{
+    wp->rio_fd = fd;
+    wp->rio_cnt = 0;
+}
+/* $end rio_writeinitb */
+
+/*
+ * rio_flushb - robustly write out everything pending in the write buffer
+ */
+/* $begin rio_flushb */
+ssize_t rio_flushb(rio_wbuf_t *wp) 
+{
+    struct iovec iov;
+    ssize_t n;
+
+    if (wp->rio_cnt == 0)
+	return 0;
+    iov.iov_base = wp->rio_buf;
+    iov.iov_len = wp->rio_cnt;
+    if ((n = rio_writev_all(wp->rio_fd, &iov, 1)) < 0)
+	return -1;
+    wp->rio_cnt = 0;
+    return n;
+}
+/* $end rio_flushb */
+
+/*
+ * rio_writevb - gather the pending buffer and iovcnt user buffers into
+ *    as few writev() calls as possible. Nothing is left pending.
+ *    Returns the number of user bytes written.
+ */
+/* $begin rio_writevb */
+ssize_t rio_writevb(rio_wbuf_t *wp, const struct iovec *usriov, int iovcnt) 
+{
+    struct iovec iov[RIO_IOVMAX + 1];
+    ssize_t n, total = 0;
+    int i, cnt;
+
+    while (iovcnt > 0 || wp->rio_cnt > 0) {
+	cnt = 0;
+	if (wp->rio_cnt > 0) {
+	    iov[cnt].iov_base = wp->rio_buf;
+	    iov[cnt++].iov_len = wp->rio_cnt;
+	}
+	for (i = 0; i < iovcnt && i < RIO_IOVMAX; i++) {
+	    iov[cnt++] = usriov[i];
+	    total += usriov[i].iov_len;
+	}
+	if ((n = rio_writev_all(wp->rio_fd, iov, cnt)) < 0)
+	    return -1;
+	wp->rio_cnt = 0;
+	usriov += i;
+	iovcnt -= i;
+    }
+    return total;
+}
+/* $end rio_writevb */
+
+/*
+ * rio_writenb - robustly write n bytes (buffered). Small writes are
+ *    appended to the buffer; a write that does not fit goes out in one
+ *    writev() together with whatever was pending.
+ */
+/* $begin rio_writenb */
+ssize_t rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n) 
+{
+    struct iovec iov;
+
+    if (wp->rio_cnt + n <= sizeof(wp->rio_buf)) {
+	memcpy(wp->rio_buf + wp->rio_cnt, usrbuf, n);
+	wp->rio_cnt += n;
+	return n;
+    }
+    iov.iov_base = usrbuf;
+    iov.iov_len = n;
+    return rio_writevb(wp, &iov, 1);
+}
+/* $end rio_writenb */
+
+/*
+ * rio_printfb - formatted write into the write buffer, flushing first
+ *    if the output would not fit in the space left
+ */
+/* $begin rio_printfb */
+ssize_t rio_printfb(rio_wbuf_t *wp, const char *fmt, ...) 
+{
+    va_list ap;
+    char *bufp;
+    int n, left;
+
+    left = sizeof(wp->rio_buf) - wp->rio_cnt;
+    va_start(ap, fmt);
+    n = vsnprintf(wp->rio_buf + wp->rio_cnt, left, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+	return -1;
+    if (n < left) {      /* fit in the buffer */
+	wp->rio_cnt += n;
+	return n;
+    }
+
+    if (rio_flushb(wp) < 0)
+	return -1;
+    if (n < sizeof(wp->rio_buf)) { /* fits in an empty buffer */
+	va_start(ap, fmt);
+	vsnprintf(wp->rio_buf, sizeof(wp->rio_buf), fmt, ap);
+	va_end(ap);
+	wp->rio_cnt = n;
+	return n;
+    }
+    bufp = malloc(n + 1); /* longer than the whole buffer */
+    if (bufp == NULL)
+	return -1;
+    va_start(ap, fmt);
+    vsnprintf(bufp, n + 1, fmt, ap);
+    va_end(ap);
+    n = rio_writenb(wp, bufp, n);
+    free(bufp);
+    return n;
+}
+/* $end rio_printfb */
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -698,6 +999,11 @@ void Rio_readinitb(rio_t *rp, int fd)
     rio_readinitb(rp, fd);
 } 
 
+void Rio_readinitbuf(rio_t *rp, int fd, void *buf, size_t bufsize)
+{
+    rio_readinitbuf(rp, fd, buf, bufsize);
+} 
+
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n) 
 {
     ssize_t rc;
@@ -716,6 +1022,47 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_peekline(rio_t *rp, char **linep) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_peekline(rp, linep)) < 0)
+	unix_error("Rio_peekline error");
+    return rc;
+} 
+
+ssize_t Rio_peekb(rio_t *rp, char **bufp) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_peekb(rp, bufp)) < 0)
+	unix_error("Rio_peekb error");
+    return rc;
+} 
+
+void Rio_writeinitb(rio_wbuf_t *wp, int fd)
+{
+    rio_writeinitb(wp, fd);
+}
+
+void Rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n) 
+{
+    if (rio_writenb(wp, usrbuf, n) != n)
+	unix_error("Rio_writenb error");
+}
+
+void Rio_writevb(rio_wbuf_t *wp, const struct iovec *iov, int iovcnt) 
+{
+    if (rio_writevb(wp, iov, iovcnt) < 0)
+	unix_error("Rio_writevb error");
+}
+
+void Rio_flushb(rio_wbuf_t *wp) 
+{
+    if (rio_flushb(wp) < 0)
+	unix_error("Rio_flushb error");
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
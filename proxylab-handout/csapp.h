@@ -20,6 +20,9 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -43,10 +46,23 @@ typedef struct {
     int rio_fd;                /* descriptor for this internal buf */
     int rio_cnt;               /* unread bytes in internal buf */
     char *rio_bufptr;          /* next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* internal buffer */
+    char *rio_buf;             /* internal buffer, rio_ibuf by default */
+    size_t rio_bufsize;        /* size of rio_buf */
+    char rio_ibuf[RIO_BUFSIZE]; /* embedded default buffer */
 } rio_t;
 /* $end rio_t */
 
+/* Persistent state for buffered Rio output */
+/* $begin rio_wbuf_t */
+#define RIO_WBUFSIZE 8192
+#define RIO_IOVMAX   64        /* user iovecs gathered per writev() */
+typedef struct {
+    int rio_fd;                /* descriptor for this internal buf */
+    int rio_cnt;               /* pending bytes in internal buf */
+    char rio_buf[RIO_WBUFSIZE]; /* internal buffer */
+} rio_wbuf_t;
+/* $end rio_wbuf_t */
+
 /* External variables */
 extern int h_errno;    /* defined by BIND for DNS errors */ 
 extern char **environ; /* defined by libc */
@@ -146,15 +162,31 @@ void V(sem_t *sem);
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
+void rio_readinitbuf(rio_t *rp, int fd, void *buf, size_t bufsize);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_peekline(rio_t *rp, char **linep);
+ssize_t	rio_peekb(rio_t *rp, char **bufp);
+void rio_writeinitb(rio_wbuf_t *wp, int fd);
+ssize_t rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n);
+ssize_t rio_writevb(rio_wbuf_t *wp, const struct iovec *iov, int iovcnt);
+ssize_t rio_printfb(rio_wbuf_t *wp, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+ssize_t rio_flushb(rio_wbuf_t *wp);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
 void Rio_readinitb(rio_t *rp, int fd); 
+void Rio_readinitbuf(rio_t *rp, int fd, void *buf, size_t bufsize);
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_peekline(rio_t *rp, char **linep);
+ssize_t Rio_peekb(rio_t *rp, char **bufp);
+void Rio_writeinitb(rio_wbuf_t *wp, int fd);
+void Rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n);
+void Rio_writevb(rio_wbuf_t *wp, const struct iovec *iov, int iovcnt);
+void Rio_flushb(rio_wbuf_t *wp);
 
 /* Client/server helper functions */
 int open_clientfd(char *hostname, int portno);
@@ -1,14 +1,30 @@
+#define _GNU_SOURCE  /* getaddrinfo_a */
 #include <stdio.h>
 #include "csapp.h"
 #include "sbuf.h"
 #include "cache.h"
 #include "util.h"
+#include "timer.h"
+#include "shaper.h"
 
 /*********************************
  * Variables and Types
  *********************************/
 #define POOL_SIZE 4 /* thread pool size */
 #define SBUFSIZE  300
+#define RELAY_BUFSIZE (64*1024) /* upstream read buffer for relaying */
+
+/* deadlines in ms, enforced by the timer wheel but for DNS_TIMEOUT */
+#define DNS_TIMEOUT        5000  /* resolver must find the origin */
+#define CONNECT_TIMEOUT    5000  /* origin must accept the connection */
+#define FIRST_BYTE_TIMEOUT 15000 /* ... and start answering after the request */
+#define IDLE_TIMEOUT       15000 /* max gap between two reads once it answers */
+#define CLIENT_TIMEOUT     15000 /* client must send its request, and keep reading */
+
+/* default rates in KB/s, 0 = unlimited; overridden on the command line */
+#define LINK_RATE   0 /* everything the proxy relays */
+#define CLIENT_RATE 0 /* per client address */
+#define ORIGIN_RATE 0 /* per origin host, cache misses only */
 
 static char *user_agent[2] = {"User-Agent", "Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3"};
 static char *accepts[2] = {"Accept", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8"};
@@ -18,17 +34,32 @@ static char *proxy_conns[2] = {"Proxy-Connection", "close"};
 
 static sbuf_t sbuf; /* shared buffer of connected descriptors */
 
-/* exceptional control for thread */
+/* per worker state, one deadline for each end of the connection */
 typedef struct {
     pthread_t tid;
-    jmp_buf pipe_buf;
-    jmp_buf error_buf;
-} thread_control_t;
+    tw_timer_t upstream;   /* connect, first byte and idle on the origin */
+    tw_timer_t downstream; /* request and relay writes on the client */
+    flow_t flow;           /* bandwidth accounting of the current relay */
+} worker_t;
 
 typedef struct sockaddr_in SAI;
 
-thread_control_t threads[POOL_SIZE];
+/* An origin name lookup. The resolver has no descriptor for the wheel
+ * to shut down, so it runs in the background and the worker waits for
+ * it at most DNS_TIMEOUT. One given up on is freed when it completes. */
+typedef struct {
+    struct gaicb cb;
+    struct addrinfo hints;
+    char host[MAXLINE];
+    char port[20];
+    int refs;      /* the worker and the completion, the last one frees */
+    sem_t mutex;   /* protects refs */
+} lookup_t;
+
+static worker_t workers[POOL_SIZE];
+static timer_wheel_t wheel;
 static cache_t cache;
+static shaper_t shaper;
 
 /*********************************
  * Function prototype
@@ -37,18 +68,12 @@ static cache_t cache;
 void* thread(void * p); 
 
 /* serve one connection */
-void  serve_client(int fd);
+void  serve_client(worker_t *w, int fd);
 
 /* request as a proxy and send back response to client */
-void  request(int fd, char *uri, char *hp, char *pathp, 
+void  request(worker_t *w, int fd, char *uri, char *hp, char *pathp, 
               int port, header_t hs, int hc);
 
-/* return current thread's index in thread pool */
-int   thread_control_index(pthread_t tid);
-
-/* SIGPIPE handler */
-void  sigpipe_handler(int sig);
-
 /* reply client about error */
 void  client_error(int fd, char *cause, char *errnum, 
                    char *shortmsg, char *longmsg);
@@ -63,9 +88,17 @@ int   parse_header(rio_t *rp, header_t headers, int *hc, int fd, char *uri);
 /* shoe some cache stats */ 
 void* report_cache(void *p);
 
-/* my own wrapper of rio package, suffix _p means polite. */
-void rio_writen_p(int fd, void *usrbuf, size_t n);
-int  open_clientfd_p(char *hostname, int port);
+/* my own wrapper of rio package, suffix _p means polite: 
+ * errors are logged and returned as -1, never fatal. */
+int  rio_writenb_p(rio_wbuf_t *wp, void *usrbuf, size_t n);
+int  rio_writevb_p(rio_wbuf_t *wp, const struct iovec *iov, int iovcnt);
+int  rio_flushb_p(rio_wbuf_t *wp);
+int  rio_error_p(char *op);
+int  open_clientfd_p(worker_t *w, char *hostname, int port);
+int  resolve_p(char *hostname, char *port, struct addrinfo **result);
+
+/* write n bytes to the client, paced by the shaper, under the client deadline */
+int  relay_write(worker_t *w, rio_wbuf_t *wp, char *buf, int n);
 
 /*
  * main thread create a thread pool and go to a busy loop, which tirelessly accept 
@@ -84,19 +117,29 @@ int main(int argc, char **argv){
     pthread_t tid;
 
     /* Check arguments */
-    if (argc != 2) {
-       fprintf(stderr, "Usage: %s <port number>\n", argv[0]);
+    if (argc != 2 && argc != 5) {
+       fprintf(stderr, "Usage: %s <port number> [<link KB/s> <client KB/s> <origin KB/s>]\n", argv[0]);
        exit(0);
     }
     port = atoi(argv[1]);
+    /* init bandwidth shaper */
+    if (argc == 5)
+        shaper_init(&shaper, atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+    else
+        shaper_init(&shaper, LINK_RATE, CLIENT_RATE, ORIGIN_RATE);
     listenfd = Open_listenfd(port);
     /* init shared buffer */
     sbuf_init(&sbuf, SBUFSIZE);
     /* init web object cache */
     cache_init(&cache);
+    /* start the timer wheel, it shuts down descriptors past deadline */
+    tw_init(&wheel);
+    Pthread_create(&tid, NULL, tw_run, &wheel);
 
     dbg_printf("Proxy server running...\n");
     for (i = 0; i < POOL_SIZE; i++)  { /* Create worker threads */
+        tw_timer_init(&workers[i].upstream);
+        tw_timer_init(&workers[i].downstream);
         Pthread_create(&tid, NULL, thread, (void*)i);
     }
 
@@ -104,8 +147,8 @@ int main(int argc, char **argv){
     Pthread_create(&tid, NULL, report_cache, NULL);
 #endif    
 
-    /* installing signal handler */
-    Signal(SIGPIPE, sigpipe_handler);
+    /* no SIGPIPE handler: rio sends with MSG_NOSIGNAL, so a vanished
+     * peer shows up as an EPIPE return instead */
 
     clientlen = sizeof(clientaddr);
     while (1) {
@@ -123,17 +166,17 @@ int main(int argc, char **argv){
 void *thread(void *p) {
     Pthread_detach(pthread_self());
     long i = (long)p;
-    threads[i].tid = pthread_self();
+    workers[i].tid = pthread_self();
     dbg_printf("Worker %ld up.\n", i);
     while (1) { 
         int connfd = sbuf_remove(&sbuf); /* Remove connfd from buffer */
-        serve_client(connfd);            /* Service client */
+        serve_client(&workers[i], connfd); /* Service client */
         Close(connfd);
     }
     return NULL;
 } 
 
-void serve_client(int fd) {
+void serve_client(worker_t *w, int fd) {
     char buf[MAXLINE];
     char method[MAXLINE];
     char uri[MAXLINE];
@@ -144,14 +187,21 @@ void serve_client(int fd) {
     int hc = 0; /* header count */
     int port = 80;
     rio_t rio;
+    SAI peer;
+    socklen_t peerlen = sizeof(peer);
 
     dbg_printf("[Connected %d]\n", (int)fd);
 
-    /* Read request line and headers */
+    /* Read request line and headers, the client gets CLIENT_TIMEOUT */
+    tw_arm(&wheel, &w->downstream, fd, CLIENT_TIMEOUT);
     Rio_readinitb(&rio, fd);
-    if (Rio_readlineb(&rio, buf, MAXLINE) <= 0) return;
-    if (parse_method(fd, buf, method, uri, version, host, path, &port) < 0) return;
-    if (parse_header(&rio, headers, &hc, fd, uri) < 0) return;
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0 ||
+        parse_method(fd, buf, method, uri, version, host, path, &port) < 0 ||
+        parse_header(&rio, headers, &hc, fd, uri) < 0) {
+        tw_disarm(&wheel, &w->downstream);
+        return;
+    }
+    tw_disarm(&wheel, &w->downstream);
 
     /* construct header */
     append_header(user_agent[0], user_agent[1], headers, &hc);
@@ -162,124 +212,243 @@ void serve_client(int fd) {
     if (need_header("Host", headers, &hc)) 
         append_header("Host", host, headers, &hc);
 
-    request(fd, uri, host, path, port, headers, hc);
+    /* bandwidth is accounted to the client address */
+    if (getpeername(fd, (SA *)&peer, &peerlen) < 0)
+        peer.sin_addr.s_addr = 0;
+    shaper_flow_begin(&shaper, &w->flow, inet_ntoa(peer.sin_addr));
+    request(w, fd, uri, host, path, port, headers, hc);
+    shaper_flow_end(&shaper, &w->flow);
     dbg_printf("[Disconnected %d]\n", (int)fd);
 }
 
-void request(int reply_to_fd, char *uri, char *hostp, 
+void request(worker_t *w, int reply_to_fd, char *uri, char *hostp, 
              char *pathp, int port, header_t headers, int hc) {
     rio_t rio;
-    char buf[MAXLINE];
+    rio_wbuf_t to_server, to_client;
+    char *buf;
+    char relay_buf[RELAY_BUFSIZE];
     char data[MAX_OBJECT_SIZE];
-    int data_size = 0, i;
-    int clientfd = open_clientfd_p(hostp, port);
-    if (clientfd < 0) {
-        client_error(reply_to_fd, "", "1000", "DNS failed", "DNS failed");
-        return;
-    }
+    int data_size = 0, i, ok, timed_out;
+    int clientfd;
 
     dbg_printf("[request %d] started.\n", (int)reply_to_fd);
 
-    /* control return to here from errors(SIGPIPE, ECONNRESET, close file descriptors and exit */
-    int ctrl_index = thread_control_index(pthread_self());
-    if (ctrl_index < 0) {
-        dbg_printf("[Error]thread do not have related jmp_buf.\n");
-        return;
-    }
-    if (setjmp(threads[ctrl_index].error_buf) != 0) {  /* back from ECONNRESET */
-        /* may jmp here cause clientfd create failure */
-        if(clientfd > 0) Close(clientfd); 
-        return; 
-    }
-    if (sigsetjmp(threads[ctrl_index].pipe_buf, 1) != 0) { /* back from SIGPIPE */
-        /* may jmp here cause clientfd create failure */
-        if(clientfd > 0) Close(clientfd); 
-        return; 
-    }
-
+    Rio_writeinitb(&to_client, reply_to_fd);
     int hit = find_hit(&cache, uri);
     if (hit >= 0) { /* hit */
         get_hit(&cache, uri, data, &data_size);
         dbg_printf("[request %d] cache hit, %d bytes.\n", (int)reply_to_fd, data_size);
         dbg_printf("[request %d] forwarding.", (int)reply_to_fd);
-        rio_writen_p(reply_to_fd, data, data_size);
-        Close(clientfd);
+        relay_write(w, &to_client, data, data_size);
         dbg_printf("\n[request %d] forwarding done.\n", (int)reply_to_fd);        
-    } else { /* miss */
-        /* send request */
-        Rio_readinitb(&rio, clientfd);
-        sprintf(buf, "GET %s HTTP/1.0\r\n", pathp);
-        dbg_printf("[request %d] %s", (int)reply_to_fd, buf);
-        rio_writen_p(clientfd, buf, strlen(buf));
-        for (i = 0; i < hc; ++i) {
-            sprintf(buf, "%s: %s\r\n", headers[i][0], headers[i][1]);
-            rio_writen_p(clientfd, buf, strlen(buf));
-        }
-        sprintf(buf, "\r\n");
-        rio_writen_p(clientfd, buf, strlen(buf));
+        return;
+    }
+
+    /* miss, only now connect upstream, and charge the origin too */
+    shaper_flow_origin(&shaper, &w->flow, hostp);
+    clientfd = open_clientfd_p(w, hostp, port);
+    if (clientfd < 0) {
+        if (errno == ETIMEDOUT)
+            client_error(reply_to_fd, hostp, "504", "Gateway Timeout", "Origin could not be reached in time");
+        else
+            client_error(reply_to_fd, "", "1000", "DNS failed", "DNS failed");
+        return;
+    }
+
+    /* send request, request line and headers go out in one write.
+     * The first byte deadline starts now and covers the send too. */
+    tw_arm(&wheel, &w->upstream, clientfd, FIRST_BYTE_TIMEOUT);
+    Rio_readinitbuf(&rio, clientfd, relay_buf, RELAY_BUFSIZE);
+    Rio_writeinitb(&to_server, clientfd);
+    dbg_printf("[request %d] GET %s HTTP/1.0\n", (int)reply_to_fd, pathp);
+    ok = rio_printfb(&to_server, "GET %s HTTP/1.0\r\n", pathp) >= 0;
+    for (i = 0; ok && i < hc; ++i) {
+        ok = rio_printfb(&to_server, "%s: %s\r\n", headers[i][0], headers[i][1]) >= 0;
+    }
+    ok = ok && rio_printfb(&to_server, "\r\n") >= 0;
+    ok = ok && rio_flushb_p(&to_server) >= 0;
         
-        /* receive response */
-        i = 0;
-        data_size = 0;
-        int byteread;
-        char *current = data;
-        dbg_printf("[request %d] forwarding.\n", (int)reply_to_fd);
-        while ((byteread = Rio_readnb(&rio, buf, MAXLINE))) {
-            data_size += byteread;
-            if (data_size <= MAX_OBJECT_SIZE) {
-                memcpy(current, buf, byteread);
-                current += byteread;
-            }
-            rio_writen_p(reply_to_fd, buf, byteread);
+    /* receive response. The upstream deadline only runs while we read:
+     * time spent waiting for the shaper or the client is not idle time. */
+    int byteread = 0;
+    char *current = data;
+    timed_out = 0;
+    dbg_printf("[request %d] forwarding.\n", (int)reply_to_fd);
+    while (ok) {
+        byteread = rio_peekb(&rio, &buf); /* buf points into relay_buf */
+        /* a fired deadline shut clientfd down, which reads as a plain EOF */
+        timed_out = tw_disarm(&wheel, &w->upstream);
+        if (byteread <= 0 || timed_out)
+            break;
+        data_size += byteread;
+        if (data_size <= MAX_OBJECT_SIZE) {
+            memcpy(current, buf, byteread);
+            current += byteread;
         }
+        ok = relay_write(w, &to_client, buf, byteread) >= 0;
+        tw_arm(&wheel, &w->upstream, clientfd, IDLE_TIMEOUT);
+    }
+    if (byteread < 0) 
+        ok = rio_error_p("read upstream");
+
+    timed_out |= tw_disarm(&wheel, &w->upstream);
+    Close(clientfd);
+    if (timed_out) {
+        dbg_printf("[request %d] upstream timed out after %d bytes.\n", (int)reply_to_fd, data_size);
+        if (data_size == 0)
+            client_error(reply_to_fd, hostp, "504", "Gateway Timeout", "Origin did not answer in time");
+        return;
+    }
+    if (!ok) {
+        dbg_printf("[request %d] aborted after %d bytes.\n", (int)reply_to_fd, data_size);
+        return;
+    }
 
-        /* update cache */
-        if (data_size <= MAX_OBJECT_SIZE) {
-            if (data_size + cache.total_size <= MAX_CACHE_SIZE) { 
-                // store
-                store(&cache, uri, data, data_size);
-                dbg_printf("[request %d] cache miss, store %d bytes.\n", (int)reply_to_fd, data_size);
-            } else { 
-                // evict
-                evict(&cache, uri, data, data_size);
-                dbg_printf("[request %d] cache miss, evict %d bytes.\n", (int)reply_to_fd, data_size);
-            }
+    /* update cache */
+    if (data_size <= MAX_OBJECT_SIZE) {
+        if (data_size + cache.total_size <= MAX_CACHE_SIZE) { 
+            // store
+            store(&cache, uri, data, data_size);
+            dbg_printf("[request %d] cache miss, store %d bytes.\n", (int)reply_to_fd, data_size);
+        } else { 
+            // evict
+            evict(&cache, uri, data, data_size);
+            dbg_printf("[request %d] cache miss, evict %d bytes.\n", (int)reply_to_fd, data_size);
         }
-        Close(clientfd);
-        dbg_printf("[request %d] forwarding done, %d bytes.\n", (int)reply_to_fd, data_size);    
     }
+    dbg_printf("[request %d] forwarding done, %d bytes.\n", (int)reply_to_fd, data_size);    
 }
 
-void rio_writen_p(int fd, void *usrbuf, size_t n) {
-    if (rio_writen(fd, usrbuf, n) != n) {
-        switch (errno) {
-        case ECONNRESET:
-            dbg_printf("[Error]connection reset caught, recovered.\n");
-            int ctrl_index = thread_control_index(pthread_self());
-            longjmp(threads[ctrl_index].error_buf, -1);
-        default:
-            dbg_printf("[Error]Unknown.");                
-        }
+int relay_write(worker_t *w, rio_wbuf_t *wp, char *buf, int n) {
+    struct iovec iov;
+    int k, rc;
+
+    /* relay straight from buf, no copy into the write buffer, in
+     * pieces as large as the shaper grants */
+    while (n > 0) {
+        k = shaper_acquire(&shaper, &w->flow, n);
+        iov.iov_base = buf;
+        iov.iov_len = k;
+        /* the client deadline only runs while we write */
+        tw_arm(&wheel, &w->downstream, wp->rio_fd, CLIENT_TIMEOUT);
+        rc = rio_writevb_p(wp, &iov, 1);
+        if (tw_disarm(&wheel, &w->downstream) || rc < 0)
+            return -1;
+        buf += k;
+        n -= k;
     }
+    return 0;
 }
 
-int open_clientfd_p(char *hostname, int port) {
-    struct addrinfo hints;
+int rio_writenb_p(rio_wbuf_t *wp, void *usrbuf, size_t n) {
+    if (rio_writenb(wp, usrbuf, n) != n) 
+        return rio_error_p("write");
+    return 0;
+}
+
+int rio_writevb_p(rio_wbuf_t *wp, const struct iovec *iov, int iovcnt) {
+    if (rio_writevb(wp, iov, iovcnt) < 0) 
+        return rio_error_p("writev");
+    return 0;
+}
+
+int rio_flushb_p(rio_wbuf_t *wp) {
+    if (rio_flushb(wp) < 0) 
+        return rio_error_p("flush");
+    return 0;
+}
+
+int rio_error_p(char *op) {
+    switch (errno) {
+    case ECONNRESET:
+    case EPIPE:
+        dbg_printf("[Error]%s: peer went away, recovered.\n", op);
+        break;
+    default:
+        dbg_printf("[Error]%s: %s.\n", op, strerror(errno));                
+    }
+    return -1;
+}
+
+/* lookup_put - drop a reference to l, freeing it with the last one */
+static void lookup_put(lookup_t *l) {
+    int refs;
+
+    P(&l->mutex);
+    refs = --l->refs;
+    V(&l->mutex);
+    if (refs == 0) {
+        if (l->cb.ar_result)
+            freeaddrinfo(l->cb.ar_result);
+        sem_destroy(&l->mutex);
+        Free(l);
+    }
+}
+
+/* lookup_done - completion of a lookup, on a resolver thread */
+static void lookup_done(union sigval sv) {
+    lookup_put(sv.sival_ptr);
+}
+
+/* resolve_p - getaddrinfo for IPv4 stream sockets that gives up after
+ * DNS_TIMEOUT. Returns 0 or an EAI_ code; a timeout is EAI_SYSTEM with
+ * errno ETIMEDOUT. */
+int resolve_p(char *hostname, char *port, struct addrinfo **result) {
+    lookup_t *l = Calloc(1, sizeof(lookup_t));
+    struct gaicb *list[1] = { &l->cb };
+    struct sigevent sev;
+    struct timespec timeout = { DNS_TIMEOUT / 1000, 
+                                DNS_TIMEOUT % 1000 * 1000000L };
+    int s;
+
+    strncpy(l->host, hostname, MAXLINE-1);
+    strncpy(l->port, port, sizeof(l->port)-1);
+    l->hints.ai_family = AF_INET;    /* Allow IPv4 */
+    l->hints.ai_socktype = SOCK_STREAM;
+    l->cb.ar_name = l->host;
+    l->cb.ar_service = l->port;
+    l->cb.ar_request = &l->hints;
+    l->refs = 2;
+    Sem_init(&l->mutex, 0, 1);
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = lookup_done;
+    sev.sigev_value.sival_ptr = l;
+    if ((s = getaddrinfo_a(GAI_NOWAIT, list, 1, &sev)) != 0) {
+        sem_destroy(&l->mutex);
+        Free(l);
+        return s;
+    }
+    while (gai_suspend((const struct gaicb **)list, 1, &timeout) == EAI_INTR)
+        ;
+    /* judge by the request, gai_suspend's own code for a timeout varies */
+    if ((s = gai_error(&l->cb)) == EAI_INPROGRESS) {
+        s = EAI_SYSTEM;
+        errno = ETIMEDOUT;
+    } else if (s == 0) {
+        *result = l->cb.ar_result;   /* ours now, not the lookup's */
+        l->cb.ar_result = NULL;
+    }
+    lookup_put(l);
+    return s;
+}
+
+int open_clientfd_p(worker_t *w, char *hostname, int port) {
     struct addrinfo *result, *rp;
     char portp[20];
-    int sfd, s;
+    int sfd, s, rc, timed_out = 0;
 
     sprintf(portp, "%d", port);
     /* Obtain address(es) matching host/port */
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;    /* Allow IPv4 */
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0;          /* Any protocol */
-
-    s = getaddrinfo(hostname, portp, &hints, &result);
+    s = resolve_p(hostname, portp, &result);
     if (s != 0) {
-        dbg_printf("[Error]getaddrinfo: %s\n", gai_strerror(s));
+        if (s == EAI_SYSTEM) {
+            dbg_printf("[Error]getaddrinfo: %s\n", strerror(errno));
+        } else {
+            dbg_printf("[Error]getaddrinfo: %s\n", gai_strerror(s));
+            errno = 0;
+        }
         return -1;
     }
 
@@ -294,35 +463,30 @@ int open_clientfd_p(char *hostname, int port) {
             inet_ntoa(((SAI*)(rp->ai_addr))->sin_addr), ntohs(((SAI*)(rp->ai_addr))->sin_port));
         if (sfd == -1)
             continue;
-        if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
+        /* a connect still pending at the deadline is aborted by shutdown */
+        tw_arm(&wheel, &w->upstream, sfd, CONNECT_TIMEOUT);
+        rc = connect(sfd, rp->ai_addr, rp->ai_addrlen);
+        if (tw_disarm(&wheel, &w->upstream)) {
+            dbg_printf("[Error]connect to %s timed out\n", hostname);
+            timed_out = 1;
+        } else if (rc != -1) {
+            freeaddrinfo(result);
             return sfd;                  /* Success */
-    }
-
-    if (rp == NULL) {               /* No address succeeded */
-        dbg_printf("[Error]Could not connect\n");
-        return -1;
-    }
-    return -1;
-}
-
-int thread_control_index(pthread_t tid) {
-    int i;
-    for (i = 0; i < POOL_SIZE; ++i) {
-        if (threads[i].tid == tid) {
-            return i;
         }
+        Close(sfd);
     }
-    return -1;
-}
 
-void sigpipe_handler(int sig) {
-    dbg_printf("[Error]SIGPIPE caught, recovered.\n");
-    int ctrl_index = thread_control_index(pthread_self());
-    siglongjmp(threads[ctrl_index].pipe_buf, -1);
+    /* No address succeeded */
+    dbg_printf("[Error]Could not connect\n");
+    freeaddrinfo(result);
+    if (timed_out)
+        errno = ETIMEDOUT;
+    return -1;
 }
 
 void client_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    char buf[MAXLINE], body[MAXBUF];
+    char body[MAXBUF];
+    rio_wbuf_t wb;
 
     /* Build the HTTP response body */
     sprintf(body, "<html><title>Tiny Error</title>");
@@ -332,13 +496,12 @@ void client_error(int fd, char *cause, char *errnum, char *shortmsg, char *longm
     sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
 
     /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    rio_writen_p(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    rio_writen_p(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    rio_writen_p(fd, buf, strlen(buf));
-    rio_writen_p(fd, body, strlen(body));
+    Rio_writeinitb(&wb, fd);
+    rio_printfb(&wb, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+    rio_printfb(&wb, "Content-type: text/html\r\n");
+    rio_printfb(&wb, "Content-length: %d\r\n\r\n", (int)strlen(body));
+    rio_writenb_p(&wb, body, strlen(body));
+    rio_flushb_p(&wb);
 }
 
 int parse_method(int fd, char *buf, char *method, char *uri, char *version, char *host, char *path, int *port) {
@@ -365,33 +528,43 @@ int parse_method(int fd, char *buf, char *method, char *uri, char *version, char
 int parse_header(rio_t *rp, header_t headersp, int *hc, int fd, char *uri) {
     dbg_printf("parsing header.\n");
     *hc = 0;
-    char buf[MAXLINE], k[MAXLINE], v[MAXLINE];
-    char *tok;
-
-    if (Rio_readlineb(rp, buf, MAXLINE) <= 0){
-        client_error(fd, uri, "400", "Bad Request", "Incomplete requset");
-        return -1; // usr cancel input
-    }
+    char k[MAXLINE], v[MAXLINE];
+    char *line, *tok, *end;
+    ssize_t n;
+
+    /* lines are parsed in place in rio's buffer, only k/v get copied */
+    while ((n = rio_peekline(rp, &line)) > 0) {
+        if (line[n-1] != '\n') {
+            client_error(fd, uri, "400", "Bad Request", "Header too long");
+            return -1; // no newline within a buffer, or eof
+        }
+        end = line + n - 1;                      /* strip \r\n */
+        if (end > line && end[-1] == '\r') end--;
+        if (end == line) 
+            return 0;                            /* blank line, done */
 
-    while(strcmp(buf, "\r\n") && strcmp(buf, "\n")) {
-        tok = strchr(buf, ':');
+        tok = memchr(line, ':', end - line);
         if (!tok) {
             client_error(fd, uri, "400", "Bad Request", "Bad header");
             return -1; // not key-value pair
-        } else {
-            *tok = '\0';
-            strcpy(k, buf);
-            tok += 1;
-            if (strlen(tok) < 3) return -1; // value too short
-            tok[strlen(tok)-2] = '\0';
-            strcpy(v, tok+1);
-            if (need_header(k, headersp, hc)) {
-                append_header(k, v, headersp, hc);
+        }
+        memcpy(k, line, tok - line);
+        k[tok - line] = '\0';
+        tok += 1;
+        while (tok < end && (*tok == ' ' || *tok == '\t')) tok++;
+        if (tok == end) return -1; // value too short
+        memcpy(v, tok, end - tok);
+        v[end - tok] = '\0';
+        if (need_header(k, headersp, hc)) {
+            if (*hc >= MAX_HEADER - 6) { /* leave room for our own */
+                client_error(fd, uri, "400", "Bad Request", "Too many headers");
+                return -1;
             }
+            append_header(k, v, headersp, hc);
         }
-        Rio_readlineb(rp, buf, MAXLINE);
     }
-    return 0;
+    client_error(fd, uri, "400", "Bad Request", "Incomplete requset");
+    return -1; // usr cancel input
 }
 
 void *report_cache(void *p) {
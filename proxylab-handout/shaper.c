@@ -0,0 +1,228 @@
+#include "shaper.h"
+#include <time.h>
+
+static double _now(void);
+static void _bucket_init(bucket_t *b, double rate, double now);
+static void _refill(bucket_t *b, double now);
+static double _avail(bucket_t *b);
+static double _wait(bucket_t *b);
+static void _charge(bucket_t *b, int n);
+static bucket_t *_get(shaper_t *sp, bucket_t **table, char *key, double rate);
+static void _put(bucket_t *b);
+static void _enqueue(shaper_t *sp, flow_t *f);
+static flow_t *_dequeue(shaper_t *sp);
+static double _schedule(shaper_t *sp);
+
+void shaper_init(shaper_t *sp, int link_kbps, int client_kbps, int origin_kbps) {
+    double now = _now();
+    memset(sp, 0, sizeof(shaper_t));
+    sp->enabled = link_kbps > 0 || client_kbps > 0 || origin_kbps > 0;
+    sp->client_rate = client_kbps * 1024.0;
+    sp->origin_rate = origin_kbps * 1024.0;
+    _bucket_init(&sp->link, link_kbps * 1024.0, now);
+    pthread_mutex_init(&sp->mutex, NULL);
+    pthread_cond_init(&sp->cond, NULL);
+}
+
+void shaper_flow_begin(shaper_t *sp, flow_t *f, char *client) {
+    memset(f, 0, sizeof(flow_t));
+    if (!sp->enabled) return;
+    pthread_mutex_lock(&sp->mutex);
+    f->client = _get(sp, sp->clients, client, sp->client_rate);
+    pthread_mutex_unlock(&sp->mutex);
+}
+
+void shaper_flow_origin(shaper_t *sp, flow_t *f, char *origin) {
+    if (!sp->enabled) return;
+    pthread_mutex_lock(&sp->mutex);
+    f->origin = _get(sp, sp->origins, origin, sp->origin_rate);
+    pthread_mutex_unlock(&sp->mutex);
+}
+
+void shaper_flow_end(shaper_t *sp, flow_t *f) {
+    if (!sp->enabled) return;
+    pthread_mutex_lock(&sp->mutex);
+    if (f->client) _put(f->client);
+    if (f->origin) _put(f->origin);
+    f->client = f->origin = NULL;
+    pthread_mutex_unlock(&sp->mutex);
+}
+
+int shaper_acquire(shaper_t *sp, flow_t *f, int want) {
+    struct timespec ts;
+    double wait;
+    int n;
+
+    if (!sp->enabled) return want;
+
+    pthread_mutex_lock(&sp->mutex);
+    f->want = want;
+    f->grant = 0;
+    _enqueue(sp, f);
+    while (!f->grant) {
+        /* whoever is awake runs the scheduler for everybody */
+        wait = _schedule(sp);
+        if (f->grant) break;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += (time_t)wait;
+        ts.tv_nsec += (long)((wait - (time_t)wait) * 1e9);
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&sp->cond, &sp->mutex, &ts);
+    }
+    n = f->grant;
+    f->grant = 0;
+    pthread_mutex_unlock(&sp->mutex);
+    return n;
+}
+
+/*
+ * Deficit round robin over the active flows. The flow at the head gets
+ * a quantum added and is granted what its deficit and all three buckets
+ * allow. A flow whose grant covers its whole want has emptied its queue
+ * and starts over from a zero deficit; one cut short keeps at most a
+ * quantum. A flow held back by its own client/origin bucket is rotated
+ * without earning a quantum, so it cannot hoard credit; an empty link
+ * bucket stops the round. Returns how long to sleep before retrying,
+ * until the first dry bucket that holds anyone back has refilled.
+ */
+static double _schedule(shaper_t *sp) {
+    double now = _now(), own, link, w, wait = SHAPER_MAX_WAIT;
+    int visited, n, granted = 0;
+    flow_t *f;
+
+    _refill(&sp->link, now);
+    for (visited = 0; sp->head && visited < sp->nactive; ) {
+        f = sp->head;
+        if (f->client) _refill(f->client, now);
+        if (f->origin) _refill(f->origin, now);
+        own = f->client ? _avail(f->client) : 1e18;
+        if (f->origin && _avail(f->origin) < own) own = _avail(f->origin);
+        if (own < 1) {                       /* own bucket is dry */
+            w = f->client ? _wait(f->client) : 0;
+            if (f->origin && _wait(f->origin) > w) w = _wait(f->origin);
+            if (w < wait) wait = w;
+            _enqueue(sp, _dequeue(sp));
+            visited++;
+            continue;
+        }
+        link = _avail(&sp->link);
+        if (link < 1) {                      /* link is dry, stop */
+            wait = _wait(&sp->link);
+            break;
+        }
+        f->deficit += SHAPER_QUANTUM;
+        n = f->want;
+        if (n > f->deficit) n = f->deficit;
+        if (n > own) n = (int)own;
+        if (n > link) n = (int)link;
+        f->deficit -= n;
+        if (n == f->want)
+            f->deficit = 0;                  /* leaves the active list */
+        else if (f->deficit > SHAPER_QUANTUM)
+            f->deficit = SHAPER_QUANTUM;
+        f->grant = n;
+        _charge(&sp->link, n);
+        if (f->client) _charge(f->client, n);
+        if (f->origin) _charge(f->origin, n);
+        _dequeue(sp);
+        granted = 1;
+    }
+    if (granted)
+        pthread_cond_broadcast(&sp->cond);
+    if (wait > SHAPER_MAX_WAIT) wait = SHAPER_MAX_WAIT;
+    if (wait < 0.001) wait = 0.001;
+    return wait;
+}
+
+static double _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void _bucket_init(bucket_t *b, double rate, double now) {
+    b->rate = rate;
+    b->burst = rate * SHAPER_BURST_MS / 1000.0;
+    if (b->burst < SHAPER_QUANTUM) b->burst = SHAPER_QUANTUM;
+    b->tokens = b->burst;
+    b->stamp = now;
+}
+
+static void _refill(bucket_t *b, double now) {
+    if (b->rate <= 0) return;
+    b->tokens += (now - b->stamp) * b->rate;
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->stamp = now;
+}
+
+static double _avail(bucket_t *b) {
+    return b->rate <= 0 ? 1e18 : b->tokens;
+}
+
+/* seconds until b holds a token again, 0 if it does or is unlimited */
+static double _wait(bucket_t *b) {
+    return b->rate <= 0 || b->tokens >= 1 ? 0 : (1 - b->tokens) / b->rate;
+}
+
+static void _charge(bucket_t *b, int n) {
+    if (b->rate > 0) b->tokens -= n;
+}
+
+/* find or create the bucket for key; idle full buckets are reclaimed */
+static bucket_t *_get(shaper_t *sp, bucket_t **table, char *key, double rate) {
+    unsigned h = 5381;
+    char *c;
+    bucket_t **pp, *b;
+    double now = _now();
+
+    for (c = key; *c; c++) h = h * 33 + (unsigned char)*c;
+    pp = &table[h % SHAPER_TABLE];
+    while ((b = *pp) != NULL) {
+        if (!strcmp(b->key, key)) {
+            b->refcnt++;
+            return b;
+        }
+        _refill(b, now);
+        if (b->refcnt == 0 && b->tokens >= b->burst) {
+            *pp = b->next;                   /* forgets nothing: it was full */
+            Free(b->key);
+            Free(b);
+            continue;
+        }
+        pp = &b->next;
+    }
+    b = Malloc(sizeof(bucket_t));
+    b->key = Malloc(strlen(key)+1);
+    strcpy(b->key, key);
+    _bucket_init(b, rate, now);
+    b->refcnt = 1;
+    b->next = table[h % SHAPER_TABLE];
+    table[h % SHAPER_TABLE] = b;
+    return b;
+}
+
+static void _put(bucket_t *b) {
+    b->refcnt--; /* kept until full again, see _get */
+}
+
+static void _enqueue(shaper_t *sp, flow_t *f) {
+    f->next = NULL;
+    f->queued = 1;
+    if (sp->tail) sp->tail->next = f;
+    else sp->head = f;
+    sp->tail = f;
+    sp->nactive++;
+}
+
+static flow_t *_dequeue(shaper_t *sp) {
+    flow_t *f = sp->head;
+    sp->head = f->next;
+    if (!sp->head) sp->tail = NULL;
+    f->next = NULL;
+    f->queued = 0;
+    sp->nactive--;
+    return f;
+}
@@ -0,0 +1,68 @@
+#ifndef __SHAPER_H__
+#define __SHAPER_H__
+
+#include "csapp.h"
+
+/*
+ * Bandwidth shaping for relayed data. Every relay write is charged to
+ * the client's token bucket, the origin's token bucket and the shared
+ * link bucket. When flows compete for the link, deficit round robin
+ * hands the tokens out a quantum at a time, so a small object queued
+ * behind bulk transfers goes out within one round.
+ */
+#define SHAPER_QUANTUM  8192  /* DRR quantum, bytes per flow per round */
+#define SHAPER_BURST_MS 100   /* bucket depth, in ms worth of its rate */
+#define SHAPER_TABLE    64    /* hash chains for client/origin buckets */
+#define SHAPER_MAX_WAIT 0.1   /* re-run the scheduler at least this often (s) */
+
+/* token bucket, a rate of 0 means unlimited */
+struct bucket_t {
+    char *key;
+    double rate;      /* bytes per second */
+    double burst;     /* max tokens */
+    double tokens;
+    double stamp;     /* time of the last refill, seconds */
+    int refcnt;       /* flows charging this bucket */
+    struct bucket_t *next;
+};
+
+typedef struct bucket_t bucket_t;
+
+/* one relay in progress */
+struct flow_t {
+    bucket_t *client;
+    bucket_t *origin;
+    int want;         /* bytes asked for while queued */
+    int grant;        /* bytes handed out by the scheduler */
+    int deficit;      /* DRR deficit counter */
+    int queued;
+    struct flow_t *next;
+};
+
+typedef struct flow_t flow_t;
+
+typedef struct {
+    int enabled;                     /* any rate set at all */
+    double client_rate;              /* per client, bytes/s */
+    double origin_rate;              /* per origin, bytes/s */
+    bucket_t link;                   /* all relayed traffic */
+    bucket_t *clients[SHAPER_TABLE];
+    bucket_t *origins[SHAPER_TABLE];
+    flow_t *head;                    /* DRR active list */
+    flow_t *tail;
+    int nactive;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} shaper_t;
+
+/* rates in KB/s, 0 leaves that dimension unlimited */
+void shaper_init(shaper_t *sp, int link_kbps, int client_kbps, int origin_kbps);
+
+void shaper_flow_begin(shaper_t *sp, flow_t *f, char *client);
+void shaper_flow_origin(shaper_t *sp, flow_t *f, char *origin);
+void shaper_flow_end(shaper_t *sp, flow_t *f);
+
+/* block until f may send; returns how many of want bytes (>= 1) */
+int  shaper_acquire(shaper_t *sp, flow_t *f, int want);
+
+#endif /* __SHAPER_H__ */
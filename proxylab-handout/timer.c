@@ -0,0 +1,101 @@
+#include "timer.h"
+#include <time.h>
+
+static long _clock_ticks(void);
+static void _link(timer_wheel_t *tw, tw_timer_t *t);
+static void _unlink(tw_timer_t *t);
+
+void tw_init(timer_wheel_t *tw) {
+    int i;
+    for (i = 0; i < TW_SLOTS; ++i) {
+        tw->slots[i].prev = tw->slots[i].next = &tw->slots[i];
+    }
+    tw->now = _clock_ticks();
+    Sem_init(&tw->mutex, 0, 1);
+}
+
+void tw_timer_init(tw_timer_t *t) {
+    t->fd = -1;
+    t->armed = 0;
+    t->fired = 0;
+    t->prev = t->next = NULL;
+}
+
+void tw_arm(timer_wheel_t *tw, tw_timer_t *t, int fd, int ms) {
+    long ticks = (ms + TW_TICK_MS - 1) / TW_TICK_MS;
+    P(&tw->mutex);
+    if (t->armed) 
+        _unlink(t);
+    t->fd = fd;
+    t->fired = 0;
+    t->armed = 1;
+    /* +1 so a deadline never fires early by a partially elapsed tick */
+    t->expires = tw->now + (ticks > 0 ? ticks : 1) + 1;
+    _link(tw, t);
+    V(&tw->mutex);
+}
+
+int tw_disarm(timer_wheel_t *tw, tw_timer_t *t) {
+    int fired;
+    P(&tw->mutex);
+    if (t->armed) {
+        _unlink(t);
+        t->armed = 0;
+    }
+    fired = t->fired;
+    V(&tw->mutex);
+    return fired;
+}
+
+/*
+ * Advance the wheel one slot per elapsed tick. Timers that hash to the
+ * slot but belong to a later revolution stay where they are.
+ */
+void *tw_run(void *p) {
+    timer_wheel_t *tw = p;
+    tw_timer_t *head, *t, *next;
+    struct timespec ts = {0, TW_TICK_MS * 1000000L};
+    long target;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        nanosleep(&ts, NULL);
+        target = _clock_ticks();
+        P(&tw->mutex);
+        while (tw->now < target) {
+            tw->now++;
+            head = &tw->slots[tw->now % TW_SLOTS];
+            for (t = head->next; t != head; t = next) {
+                next = t->next;
+                if (t->expires > tw->now) 
+                    continue;
+                _unlink(t);
+                t->armed = 0;
+                t->fired = 1;
+                shutdown(t->fd, SHUT_RDWR);
+            }
+        }
+        V(&tw->mutex);
+    }
+    return NULL;
+}
+
+static long _clock_ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (1000 / TW_TICK_MS) + ts.tv_nsec / (TW_TICK_MS * 1000000L);
+}
+
+static void _link(timer_wheel_t *tw, tw_timer_t *t) {
+    tw_timer_t *head = &tw->slots[t->expires % TW_SLOTS];
+    t->next = head->next;
+    t->prev = head;
+    head->next->prev = t;
+    head->next = t;
+}
+
+static void _unlink(tw_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
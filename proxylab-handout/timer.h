@@ -0,0 +1,43 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include "csapp.h"
+
+/*
+ * Hashed timer wheel. A timer watches one descriptor; when its deadline
+ * passes the wheel thread shuts the descriptor down, which makes any
+ * connect/read/write blocked on it return, and marks the timer fired.
+ */
+#define TW_TICK_MS 100   /* wheel resolution */
+#define TW_SLOTS   512   /* one revolution is TW_SLOTS * TW_TICK_MS */
+
+struct tw_timer_t {
+    int fd;                  /* descriptor to shut down on expiry */
+    long expires;            /* absolute tick of the deadline */
+    int armed;
+    int fired;               /* deadline passed since the last arm */
+    struct tw_timer_t *prev;
+    struct tw_timer_t *next;
+};
+
+typedef struct tw_timer_t tw_timer_t;
+
+typedef struct {
+    long now;                     /* ticks processed so far */
+    tw_timer_t slots[TW_SLOTS];   /* list heads, timers hash by expires */
+    sem_t mutex;                  /* protects everything above */
+} timer_wheel_t;
+
+void tw_init(timer_wheel_t *tw);
+void tw_timer_init(tw_timer_t *t);
+
+/* (re)arm t to shut fd down ms milliseconds from now */
+void tw_arm(timer_wheel_t *tw, tw_timer_t *t, int fd, int ms);
+
+/* cancel t; returns whether it fired. fd is safe to close afterwards */
+int  tw_disarm(timer_wheel_t *tw, tw_timer_t *t);
+
+/* wheel thread routine, argument is the timer_wheel_t */
+void *tw_run(void *p);
+
+#endif /* __TIMER_H__ */
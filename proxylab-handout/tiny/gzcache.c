@@ -0,0 +1,143 @@
+/*
+ * gzcache.c - bounded in-memory cache of gzip'ed static files
+ *
+ * Tiny is iterative, so the cache needs no locking. Entries are keyed
+ * by file name and validated against the mtime and size the entry was
+ * compressed from; a stale entry is dropped on lookup.
+ */
+#include <zlib.h>
+#include "csapp.h"
+#include "gzcache.h"
+
+static void _unlink(gzcache_t *c, gzobj_t *o);
+static void _push(gzcache_t *c, gzobj_t *o);
+static void _drop(gzcache_t *c, gzobj_t *o);
+
+void gzcache_init(gzcache_t *c)
+{
+    c->total_size = 0;
+    c->item_count = 0;
+    c->head = c->tail = NULL;
+}
+
+void gzcache_deinit(gzcache_t *c)
+{
+    while (c->head)
+	_drop(c, c->head);
+}
+
+/*
+ * gzcache_find - return the cached copy of name if it is still fresh,
+ *     and move it to the front of the LRU list
+ */
+gzobj_t *gzcache_find(gzcache_t *c, char *name, time_t mtime, off_t srcsize)
+{
+    gzobj_t *o;
+
+    for (o = c->head; o != NULL; o = o->next) {
+	if (strcmp(o->name, name))
+	    continue;
+	if (o->mtime != mtime || o->srcsize != srcsize) { /* file changed */
+	    _drop(c, o);
+	    return NULL;
+	}
+	_unlink(c, o);
+	_push(c, o);
+	return o;
+    }
+    return NULL;
+}
+
+/*
+ * gzcache_store - take ownership of data and insert it, evicting least
+ *     recently used entries to make room. Returns NULL (and frees data)
+ *     if the object is too big to be cached at all.
+ */
+gzobj_t *gzcache_store(gzcache_t *c, char *name, time_t mtime, off_t srcsize,
+		       char *data, int size)
+{
+    gzobj_t *o;
+
+    if (size > GZ_MAX_OBJECT_SIZE) {
+	Free(data);
+	return NULL;
+    }
+    while (c->tail && c->total_size + size > GZ_MAX_CACHE_SIZE)
+	_drop(c, c->tail);
+
+    o = Malloc(sizeof(gzobj_t));
+    o->name = Malloc(strlen(name)+1);
+    strcpy(o->name, name);
+    o->mtime = mtime;
+    o->srcsize = srcsize;
+    o->data = data;
+    o->size = size;
+    _push(c, o);
+    c->total_size += size;
+    c->item_count++;
+    return o;
+}
+
+/*
+ * gzip_compress - compress src with a gzip wrapper (not raw zlib) so
+ *     the result can be sent as Content-Encoding: gzip
+ */
+int gzip_compress(char *src, int n, char **dstp)
+{
+    z_stream zs;
+    char *dst;
+    int bound;
+
+    memset(&zs, 0, sizeof(zs));
+    /* 15 window bits, +16 selects the gzip header and trailer */
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+		     8, Z_DEFAULT_STRATEGY) != Z_OK)
+	return -1;
+    bound = deflateBound(&zs, n);
+    dst = Malloc(bound);
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = n;
+    zs.next_out = (Bytef *)dst;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+	deflateEnd(&zs);
+	Free(dst);
+	return -1;
+    }
+    deflateEnd(&zs);
+    *dstp = dst;
+    return (int)zs.total_out;
+}
+
+static void _unlink(gzcache_t *c, gzobj_t *o)
+{
+    if (o->prev)
+	o->prev->next = o->next;
+    else
+	c->head = o->next;
+    if (o->next)
+	o->next->prev = o->prev;
+    else
+	c->tail = o->prev;
+}
+
+static void _push(gzcache_t *c, gzobj_t *o)
+{
+    o->prev = NULL;
+    o->next = c->head;
+    if (c->head)
+	c->head->prev = o;
+    else
+	c->tail = o;
+    c->head = o;
+}
+
+static void _drop(gzcache_t *c, gzobj_t *o)
+{
+    _unlink(c, o);
+    c->total_size -= o->size;
+    c->item_count--;
+    Free(o->name);
+    Free(o->data);
+    Free(o);
+}
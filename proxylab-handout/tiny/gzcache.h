@@ -0,0 +1,43 @@
+#ifndef __GZCACHE_H__
+#define __GZCACHE_H__
+
+#include <sys/types.h>
+#include <time.h>
+
+#define GZ_MAX_CACHE_SIZE  1049000 /* bytes of compressed data kept around */
+#define GZ_MAX_OBJECT_SIZE 102400  /* largest compressed object we cache */
+#define GZ_MAX_SOURCE_SIZE 1048576 /* don't compress bigger files on the fly */
+#define GZ_MIN_SOURCE_SIZE 256     /* not worth the gzip header below this */
+
+/* one compressed file, keyed by name and the stat() it was built from */
+struct gzobj_t {
+    char *name;
+    time_t mtime;
+    off_t srcsize;
+    char *data;
+    int size;
+    struct gzobj_t *prev;
+    struct gzobj_t *next;
+};
+
+typedef struct gzobj_t gzobj_t;
+
+/* LRU list, most recently used at the head */
+typedef struct {
+    int total_size;
+    int item_count;
+    gzobj_t *head;
+    gzobj_t *tail;
+} gzcache_t;
+
+void gzcache_init(gzcache_t *c);
+void gzcache_deinit(gzcache_t *c);
+
+gzobj_t *gzcache_find(gzcache_t *c, char *name, time_t mtime, off_t srcsize);
+gzobj_t *gzcache_store(gzcache_t *c, char *name, time_t mtime, off_t srcsize,
+		       char *data, int size);
+
+/* gzip n bytes at src into a Malloc'ed buffer, return its size or -1 */
+int gzip_compress(char *src, int n, char **dstp);
+
+#endif /* __GZCACHE_H__ */
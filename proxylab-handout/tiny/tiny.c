@@ -4,16 +4,23 @@
  *     GET method to serve static and dynamic content.
  */
 #include "csapp.h"
+#include "gzcache.h"
 
 void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+void read_requesthdrs(rio_t *rp, int *gzip_ok);
+int accepts_gzip(char *value, int len);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(int fd, char *filename, struct stat *sbuf, int gzip_ok);
+void send_headers(rio_wbuf_t *wp, int size, char *filetype, char *encoding, int vary);
+void send_body(rio_wbuf_t *wp, char *body, int size);
 void get_filetype(char *filename, char *filetype);
+int is_compressible(char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg);
 
+static gzcache_t gzcache; /* gzip'ed copies of compressible files */
+
 int main(int argc, char **argv) 
 {
     int listenfd, connfd, port, clientlen;
@@ -25,6 +32,7 @@ int main(int argc, char **argv)
 	exit(1);
     }
     port = atoi(argv[1]);
+    gzcache_init(&gzcache);
 
     listenfd = Open_listenfd(port);
     while (1) {
@@ -42,7 +50,7 @@ int main(int argc, char **argv)
 /* $begin doit */
 void doit(int fd) 
 {
-    int is_static;
+    int is_static, gzip_ok = 0;
     struct stat sbuf;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
@@ -50,14 +58,15 @@ void doit(int fd)
   
     /* Read request line and headers */
     Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
+    if (Rio_readlineb(&rio, buf, MAXLINE) == 0)
+	return;
     sscanf(buf, "%s %s %s", method, uri, version);
     if (strcasecmp(method, "GET")) { 
        clienterror(fd, method, "501", "Not Implemented",
                 "Tiny does not implement this method");
         return;
     }
-    read_requesthdrs(&rio);
+    read_requesthdrs(&rio, &gzip_ok);
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);
@@ -73,7 +82,7 @@ void doit(int fd)
 			"Tiny couldn't read the file");
 	    return;
 	}
-	serve_static(fd, filename, sbuf.st_size);
+	serve_static(fd, filename, &sbuf, gzip_ok);
     }
     else { /* Serve dynamic content */
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
@@ -87,23 +96,56 @@ void doit(int fd)
 /* $end doit */
 
 /*
- * read_requesthdrs - read and parse HTTP request headers
+ * read_requesthdrs - read and parse HTTP request headers, noting
+ *     whether the client will take a gzip'ed response
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+void read_requesthdrs(rio_t *rp, int *gzip_ok) 
 {
-    char buf[MAXLINE];
+    char *line;
+    int n;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {
-	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
+    /* Lines are looked at in place in the rio buffer, never copied */
+    while((n = Rio_peekline(rp, &line)) > 0) {
+	printf("%.*s", n, line);
+	if ((n == 2 && line[0] == '\r') || n == 1)
+	    break;
+	if (n > 16 && !strncasecmp(line, "Accept-Encoding:", 16))
+	    *gzip_ok = accepts_gzip(line + 16, n - 16);
     }
     return;
 }
 /* $end read_requesthdrs */
 
+/*
+ * accepts_gzip - scan an Accept-Encoding value for a gzip (or *) coding
+ *     that the client has not ruled out with q=0
+ */
+int accepts_gzip(char *value, int len) 
+{
+    char *tok, *q, *save, list[MAXLINE];
+    size_t n;
+
+    if (len > MAXLINE-1)
+	len = MAXLINE-1;
+    memcpy(list, value, len);
+    list[len] = '\0';
+    for (tok = strtok_r(list, ",\r\n", &save); tok; 
+	 tok = strtok_r(NULL, ",\r\n", &save)) {
+	while (*tok == ' ' || *tok == '\t')
+	    tok++;
+	n = strcspn(tok, "; \t");  /* the coding, without its params */
+	if (!(n == 4 && !strncasecmp(tok, "gzip", 4)) &&
+	    !(n == 1 && *tok == '*'))
+	    continue;
+	q = strstr(tok, "q=");
+	if (q && atof(q + 2) == 0.0)
+	    continue;
+	return 1;
+    }
+    return 0;
+}
+
 /*
  * parse_uri - parse URI into filename and CGI args
  *             return 0 if dynamic content, 1 if static
@@ -137,30 +179,109 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - copy a file back to the client, gzip'ed if the
+ *     client allows it and either a fresh file.gz sibling exists or
+ *     the file is of a compressible type
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) 
+void serve_static(int fd, char *filename, struct stat *sbuf, int gzip_ok) 
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    int srcfd, filesize = sbuf->st_size, gzsize, vary, has_gz;
+    char *srcp, *gzp, filetype[MAXLINE], gzname[MAXLINE];
+    struct stat gzsbuf;
+    gzobj_t *o;
+    rio_wbuf_t wb;
  
-    /* Send response headers to client */
+    Rio_writeinitb(&wb, fd);
     get_filetype(filename, filetype);
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));
+
+    /* A fresh file.gz sibling, of any type, is a gzip variant, so the
+       plain response varies on Accept-Encoding too */
+    snprintf(gzname, MAXLINE, "%s.gz", filename);
+    has_gz = stat(gzname, &gzsbuf) == 0 && S_ISREG(gzsbuf.st_mode) && 
+	(S_IRUSR & gzsbuf.st_mode) && gzsbuf.st_mtime >= sbuf->st_mtime;
+    vary = has_gz || is_compressible(filetype);
+
+    if (gzip_ok) {
+	/* Prefer a precompressed sibling that is at least as new */
+	if (has_gz) {
+	    send_headers(&wb, gzsbuf.st_size, filetype, "gzip", 1);
+	    srcfd = Open(gzname, O_RDONLY, 0);
+	    srcp = Mmap(0, gzsbuf.st_size, PROT_READ, MAP_PRIVATE, srcfd, 0);
+	    Close(srcfd);
+	    send_body(&wb, srcp, gzsbuf.st_size);
+	    Munmap(srcp, gzsbuf.st_size);
+	    return;
+	}
+
+	/* Otherwise compress on the fly, remembering the result */
+	if (is_compressible(filetype) && filesize >= GZ_MIN_SOURCE_SIZE && 
+	    filesize <= GZ_MAX_SOURCE_SIZE) {
+	    o = gzcache_find(&gzcache, filename, sbuf->st_mtime, filesize);
+	    if (o && o->size < filesize) {
+		send_headers(&wb, o->size, filetype, "gzip", 1);
+		send_body(&wb, o->data, o->size);
+		return;
+	    }
+	    if (!o) {
+		srcfd = Open(filename, O_RDONLY, 0);
+		srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+		Close(srcfd);
+		gzsize = gzip_compress(srcp, filesize, &gzp);
+		Munmap(srcp, filesize);
+		if (gzsize > 0 && gzsize < filesize) {
+		    send_headers(&wb, gzsize, filetype, "gzip", 1);
+		    send_body(&wb, gzp, gzsize);
+		}
+		/* cache even incompressible results so we don't retry */
+		if (gzsize > 0)
+		    gzcache_store(&gzcache, filename, sbuf->st_mtime, 
+				  filesize, gzp, gzsize);
+		if (gzsize > 0 && gzsize < filesize)
+		    return;
+	    }
+	}
+    }
+
+    /* Send response headers to client */
+    send_headers(&wb, filesize, filetype, NULL, vary);
 
     /* Send response body to client */
     srcfd = Open(filename, O_RDONLY, 0);
     srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
     Close(srcfd);
-    Rio_writen(fd, srcp, filesize);
+    send_body(&wb, srcp, filesize);
     Munmap(srcp, filesize);
 }
 
+/*
+ * send_headers - buffer the response headers for a static file of size
+ *     bytes, with an optional Content-Encoding
+ */
+void send_headers(rio_wbuf_t *wp, int size, char *filetype, char *encoding, int vary) 
+{
+    rio_printfb(wp, "HTTP/1.0 200 OK\r\n");
+    rio_printfb(wp, "Server: Tiny Web Server\r\n");
+    rio_printfb(wp, "Content-length: %d\r\n", size);
+    if (encoding)
+	rio_printfb(wp, "Content-encoding: %s\r\n", encoding);
+    if (vary)
+	rio_printfb(wp, "Vary: Accept-Encoding\r\n");
+    rio_printfb(wp, "Content-type: %s\r\n\r\n", filetype);
+}
+
+/*
+ * send_body - write the buffered headers and the body in one writev()
+ */
+void send_body(rio_wbuf_t *wp, char *body, int size) 
+{
+    struct iovec iov;
+
+    iov.iov_base = body;
+    iov.iov_len = size;
+    Rio_writevb(wp, &iov, 1);
+}
+
 /*
  * get_filetype - derive file type from file name
  */
@@ -175,6 +296,14 @@ void get_filetype(char *filename, char *filetype)
     else
 	strcpy(filetype, "text/plain");
 }  
+
+/*
+ * is_compressible - text is worth gzip'ing, images already are compressed
+ */
+int is_compressible(char *filetype) 
+{
+    return !strncmp(filetype, "text/", 5);
+}
 /* $end serve_static */
 
 /*
@@ -183,13 +312,14 @@ void get_filetype(char *filename, char *filetype)
 /* $begin serve_dynamic */
 void serve_dynamic(int fd, char *filename, char *cgiargs) 
 {
-    char buf[MAXLINE], *emptylist[] = { NULL };
+    char *emptylist[] = { NULL };
+    rio_wbuf_t wb;
 
-    /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    /* Return first part of HTTP response, before the child writes */
+    Rio_writeinitb(&wb, fd);
+    rio_printfb(&wb, "HTTP/1.0 200 OK\r\n");
+    rio_printfb(&wb, "Server: Tiny Web Server\r\n");
+    Rio_flushb(&wb);
   
     if (Fork() == 0) { /* child */
 	/* Real server would set all CGI vars here */
@@ -208,7 +338,8 @@ void serve_dynamic(int fd, char *filename, char *cgiargs)
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg) 
 {
-    char buf[MAXLINE], body[MAXBUF];
+    char body[MAXBUF];
+    rio_wbuf_t wb;
 
     /* Build the HTTP response body */
     sprintf(body, "<html><title>Tiny Error</title>");
@@ -218,12 +349,11 @@ void clienterror(int fd, char *cause, char *errnum,
     sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
 
     /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    Rio_writeinitb(&wb, fd);
+    rio_printfb(&wb, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+    rio_printfb(&wb, "Content-type: text/html\r\n");
+    rio_printfb(&wb, "Content-length: %d\r\n\r\n", (int)strlen(body));
+    Rio_writenb(&wb, body, strlen(body));
+    Rio_flushb(&wb);
 }
 /* $end clienterror */